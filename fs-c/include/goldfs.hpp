@@ -0,0 +1,278 @@
+#pragma once
+
+// - Standard C++
+#include <algorithm>
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+// - Require C++20 to compile the code
+#if __cplusplus < 202002L
+#error "C++20 compiler is required"
+#endif
+
+// - The C header needs C11 atomics, so the entry points used here are
+// declared again. The structures mirror 'ssfs_sqe_t' and 'ssfs_cqe_t'.
+extern "C" {
+typedef struct _ssfs_sqe {
+  int32_t op;
+  int32_t fd;
+  int32_t offset;
+  int32_t length;
+  char *buf;
+  void *user_data;
+} ssfs_sqe_t;
+
+typedef struct _ssfs_cqe {
+  int32_t result;
+  void *user_data;
+} ssfs_cqe_t;
+
+void mkssfs_ex(int fresh, int flags);
+int ssfs_unmount(void);
+int ssfs_fopen(char *name);
+int ssfs_fclose(int fileID);
+int ssfs_submit(const ssfs_sqe_t *sqes, int num);
+int ssfs_reap(ssfs_cqe_t *cqes, int max);
+}
+
+namespace goldfs {
+
+// - Mirrors SSFS_AIO_* and SSFS_MOUNT_*
+constexpr int32_t aio_read = 0;
+constexpr int32_t aio_write = 1;
+constexpr int mount_log = 0X1;
+constexpr int mount_cache(int blocks) noexcept { return blocks << 8; }
+
+class engine;
+
+/**
+ * @class io_awaitable
+ * @brief Read or write awaited by a coroutine. The coroutine is suspended
+ * until the I/O engine completes the request and 'filesystem::poll' resumes
+ * it. 'co_await' yields the number of bytes moved or -1 on error.
+ */
+class io_awaitable {
+public:
+  io_awaitable(engine *e, int32_t op, int32_t fd, char *buf, int32_t length,
+               int32_t offset) noexcept
+      : engine_(e), sqe_{op, fd, offset, length, buf, this} {}
+
+  // - A closed file fails without suspending
+  bool await_ready() const noexcept { return engine_ == nullptr; }
+  bool await_suspend(std::coroutine_handle<> h);
+  int32_t await_resume() const noexcept { return result_; }
+
+private:
+  friend class engine;
+
+  engine *engine_;                   //!< Engine running the request
+  ssfs_sqe_t sqe_;                   //!< Request handed to 'ssfs_submit'
+  int32_t result_ = -1;              //!< Result of the request
+  std::coroutine_handle<> handle_{}; //!< Coroutine waiting for the result
+};
+
+/**
+ * @class engine
+ * @brief Submits the requests of suspended coroutines and resumes them once
+ * they complete. Requests which do not fit in the queue of the library wait
+ * in a backlog until completions make room. The file system is unmounted
+ * when the engine is destroyed.
+ */
+class engine {
+public:
+  engine() noexcept = default;
+  engine(const engine &) = delete;
+  engine &operator=(const engine &) = delete;
+  ~engine() { ssfs_unmount(); }
+
+  bool submit(io_awaitable *a) {
+    int r = backlog_.empty() ? ssfs_submit(&a->sqe_, 1) : 0;
+    if (r < 0) {
+      return false;
+    }
+
+    if (r == 0) {
+      backlog_.push_back(a);
+    }
+    pending_++;
+    return true;
+  }
+
+  size_t poll() {
+    ssfs_cqe_t cqes[64];
+    int n = ssfs_reap(cqes, 64);
+    if (n <= 0) {
+      return 0;
+    }
+
+    // - A resumed coroutine may submit further requests, so the backlog is
+    // flushed before any of them runs
+    pending_ -= static_cast<size_t>(n);
+    while (!backlog_.empty() && ssfs_submit(&backlog_.front()->sqe_, 1) == 1) {
+      backlog_.pop_front();
+    }
+
+    for (int i = 0; i < n; i++) {
+      auto *a = static_cast<io_awaitable *>(cqes[i].user_data);
+      a->result_ = cqes[i].result;
+      a->handle_.resume();
+    }
+
+    return static_cast<size_t>(n);
+  }
+
+  size_t pending() const noexcept { return pending_; }
+
+private:
+  std::deque<io_awaitable *> backlog_; //!< Requests not submitted yet
+  size_t pending_ = 0;                 //!< Requests not completed yet
+};
+
+// - The coroutine goes on at once when the request cannot be submitted
+inline bool io_awaitable::await_suspend(std::coroutine_handle<> h) {
+  handle_ = h;
+  return engine_->submit(this);
+}
+
+/**
+ * @class file
+ * @brief Open file. The handle is closed when the object is destroyed. Reads
+ * and writes are positional, so one file may have many of them in flight.
+ * The buffers have to stay valid until the awaited request completes. The
+ * file keeps the file system mounted until it is destroyed.
+ */
+class file {
+public:
+  file() noexcept = default;
+  file(std::shared_ptr<engine> e, int fd) noexcept
+      : engine_(std::move(e)), fd_(fd) {}
+  file(file &&o) noexcept
+      : engine_(std::move(o.engine_)), fd_(std::exchange(o.fd_, -1)) {}
+  file &operator=(file &&o) noexcept {
+    if (this != &o) {
+      close();
+      engine_ = std::move(o.engine_);
+      fd_ = std::exchange(o.fd_, -1);
+    }
+    return *this;
+  }
+  file(const file &) = delete;
+  file &operator=(const file &) = delete;
+  ~file() { close(); }
+
+  explicit operator bool() const noexcept { return fd_ >= 0; }
+
+  /**
+   * @brief Reads data from the file at a given position.
+   * @param buf Room for the data, of which at most INT32_MAX bytes are used
+   * @param offset Absolute position within the file
+   * @return Awaitable yielding the number of bytes read or -1 on error
+   */
+  io_awaitable read(std::span<char> buf, int32_t offset) noexcept {
+    return {fd_ >= 0 ? engine_.get() : nullptr, aio_read, fd_, buf.data(),
+            clamp(buf.size()), offset};
+  }
+
+  /**
+   * @brief Writes data to the file at a given position.
+   * @param buf Data to write, of which at most INT32_MAX bytes are used
+   * @param offset Absolute position within the file
+   * @return Awaitable yielding the number of bytes written or -1 on error
+   */
+  io_awaitable write(std::span<const char> buf, int32_t offset) noexcept {
+    // - The library only reads from the buffer of a write
+    return {fd_ >= 0 ? engine_.get() : nullptr, aio_write, fd_,
+            const_cast<char *>(buf.data()), clamp(buf.size()), offset};
+  }
+
+  // - The engine is released after the handle, so the file system is still
+  // mounted when the last file closes
+  void close() noexcept {
+    if (fd_ >= 0) {
+      ssfs_fclose(fd_);
+      fd_ = -1;
+    }
+    engine_.reset();
+  }
+
+private:
+  // - A request moves at most INT32_MAX bytes, like a short read or write
+  static int32_t clamp(size_t length) noexcept {
+    return static_cast<int32_t>(std::min<size_t>(length, INT32_MAX));
+  }
+
+  std::shared_ptr<engine> engine_; //!< Engine running the requests
+  int fd_ = -1;                    //!< Handle given by 'ssfs_fopen'
+};
+
+/**
+ * @class filesystem
+ * @brief Mounted file system. There is a single file system per process, so
+ * only one object should exist at a time. The owner of the event loop calls
+ * 'poll' to resume the coroutines whose requests completed. The file system
+ * is unmounted once the object and all of its files are destroyed.
+ */
+class filesystem {
+public:
+  /**
+   * @brief Mounts the file system.
+   * @param fresh Non zero to create a new file system
+   * @param flags Mount options, 'mount_log' for log-structured writes and
+   * 'mount_cache' to cap the block cache
+   */
+  explicit filesystem(bool fresh, int flags = 0)
+      : engine_(std::make_shared<engine>()) {
+    mkssfs_ex(fresh ? 1 : 0, flags);
+  }
+  filesystem(filesystem &&) noexcept = default;
+  filesystem &operator=(filesystem &&) noexcept = default;
+  filesystem(const filesystem &) = delete;
+  filesystem &operator=(const filesystem &) = delete;
+
+  // - Suspended coroutines are resumed before the engine is released. Files
+  // still open keep the file system mounted.
+  ~filesystem() {
+    if (engine_ == nullptr) {
+      return;
+    }
+
+    while (engine_->pending() > 0) {
+      engine_->poll();
+    }
+  }
+
+  /**
+   * @brief Opens a file, which is created if needed.
+   * @param name Name of the file
+   * @return The file, which converts to false on error
+   */
+  file open(const std::string &name) {
+    std::vector<char> s(name.begin(), name.end());
+    s.push_back('\0');
+    int fd = ssfs_fopen(s.data());
+    return {fd >= 0 ? engine_ : nullptr, fd};
+  }
+
+  /**
+   * @brief Resumes the coroutines whose requests completed.
+   * @return Number of coroutines resumed
+   */
+  size_t poll() { return engine_->poll(); }
+
+  /**
+   * @brief Number of requests which did not complete yet.
+   */
+  size_t pending() const noexcept { return engine_->pending(); }
+
+private:
+  std::shared_ptr<engine> engine_; //!< Engine shared by the files
+};
+
+} // namespace goldfs
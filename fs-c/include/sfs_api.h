@@ -2,9 +2,18 @@
 
 // - Standard C
 #include <assert.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+// - POSIX
+#include <pthread.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 // - Provided code
 #include <disk_emu.h>
@@ -26,23 +35,38 @@
 #define BLOCKS_PER_INODE 14
 #define MAX_FN_LEN 11
 #define MAGIC 0XDEADBEEF
-#define MAX_FILES 256
-#define MAX_OPEN_FILES 32
+#define INODE_BLOCKS_MAX 64
+#define DIR_BLOCKS_MAX 16
+#define FDT_CHUNK_SIZE 64
+#define FDT_CHUNKS_MAX 1024
+#define SNAPSHOTS_MAX 16
+#define EPOCH_MAX INT32_MAX
+#define RC_BLOCKS_MAX 2
 #define INDIRECT_BLOCK_ENTRY_SIZE 4
 #define INDIRECT_BLOCKS (BLOCK_SIZE / INDIRECT_BLOCK_ENTRY_SIZE)
 #define FILE_SIZE_MAX_DIRECT (BLOCKS_PER_INODE * BLOCK_SIZE)
 #define FILE_SIZE_MAX (FILE_SIZE_MAX_DIRECT + INDIRECT_BLOCKS * BLOCK_SIZE)
 #define MAX_BLOCKS_PER_FILE (BLOCKS_PER_INODE + INDIRECT_BLOCKS)
+#define INODE_INLINE_MAX (BLOCKS_PER_INODE * INDIRECT_BLOCK_ENTRY_SIZE)
+#define INODE_READ_RETRIES 4
+#define COPY_CHUNK_BLOCKS 32
+#define HOT_BLOCKS_MAX (BLOCK_SIZE / 4 - 2)
 
 // - Defines for file system entry sizes
 #define DIR_ENTRY_SIZE 16
 #define INODE_ENTRY_SIZE 64
+#define DIR_ENTRIES_PER_BLOCK (BLOCK_SIZE / DIR_ENTRY_SIZE)
+#define INODES_PER_BLOCK (BLOCK_SIZE / INODE_ENTRY_SIZE)
+#define MAX_FILES (INODE_BLOCKS_MAX * INODES_PER_BLOCK)
 
 // - Defines for table entry states
 #define ENTRY_TAKEN 0
 #define ENTRY_FREE 1
 #define ENTRY_INVALID (-1)
 
+// - Defines for I-node flags
+#define INODE_INLINE 0X1
+
 // - Defines of error codes
 #define MY_OK 0
 #define MY_ERR (-1)
@@ -52,13 +76,19 @@ static char MY_NAME[] = "goldfs";
 /**
  * @class _inode
  * @brief I-node structure for storage of file data. This structure is
- * stored on disk and cached in memory for faster access.
+ * stored on disk and cached in memory for faster access. Files of at most
+ * INODE_INLINE_MAX bytes keep their data in place of the data block
+ * locations while INODE_INLINE is set.
  */
 typedef struct __attribute__((packed)) _inode {
-  uint32_t size;                 //!< Size of the file
-  int32_t ptr[BLOCKS_PER_INODE]; //!< Data block locations
-  int16_t next;                  //!< Next block to look for I-nodes
-  int16_t free;                  //!< State of an I-node
+  uint32_t size; //!< Size of the file
+  union {
+    int32_t ptr[BLOCKS_PER_INODE]; //!< Data block locations
+    char data[INODE_INLINE_MAX];   //!< Data of the file if held inline
+  };
+  int16_t next;  //!< Indirect block or ENTRY_INVALID until it is needed
+  int8_t free;   //!< State of an I-node
+  uint8_t flags; //!< Flags of an I-node
 } inode_t;
 
 #if 1
@@ -66,23 +96,63 @@ _Static_assert(sizeof(inode_t) == INODE_ENTRY_SIZE,
                "iNode size must be INODE_ENTRY_SIZE");
 #endif
 
+/**
+ * @class _snapshot
+ * @brief Snapshot taken by 'ssfs_commit'. It names a copy of the root, which
+ * shares every block with the file system as it was at that time.
+ */
+typedef struct __attribute__((packed)) _snapshot {
+  int32_t root;   //!< Block holding the copy of the root
+  uint32_t epoch; //!< Epoch of the snapshot, also returned as its number
+} snapshot_t;
+
+/**
+ * @class _root
+ * @brief Root of a snapshot: the locations of the directory, I-node and
+ * reference count blocks as they were recorded in the super-block, and the
+ * number of free I-nodes at that time.
+ */
+typedef struct __attribute__((packed)) _root {
+  int32_t dir_block_num;                  //!< Directory blocks count
+  int32_t inode_block_num;                //!< I-node blocks count
+  int32_t dir_blocks[DIR_BLOCKS_MAX];     //!< Directory block locations
+  int32_t inode_blocks[INODE_BLOCKS_MAX]; //!< I-node block locations
+  int32_t rc_blocks[RC_BLOCKS_MAX];       //!< Reference count block locations
+  int32_t free_inodes;                    //!< Free I-nodes
+} root_t;
+
 /**
  * @class _super_block
  * @brief Super-block structure for the header of the disk. This structure
  * is stored on the disk and cached in memory for faster access.
  */
 typedef struct __attribute__((packed)) _super_block {
-  uint32_t magic;          //!< Magic
-  uint32_t blocks;         //!< Number of blocks
-  uint32_t blocks_size;    //!< Size of a block
-  int32_t sb_block_idx;    //!< Super-block starting index
-  int32_t sb_block_num;    //!< Super-block block count
-  int32_t fbm_block_idx;   //!< Free bit map starting index
-  int32_t fbm_block_num;   //!< Free bit map block count
-  int32_t dir_block_idx;   //!< Directory starting block index
-  int32_t dir_block_num;   //!< Directory blocks count
-  int32_t inode_block_idx; //!< I-node starting block index
-  int32_t inode_block_num; //!< I-node blocks count
+  uint32_t magic;            //!< Magic
+  uint32_t blocks;           //!< Number of blocks
+  uint32_t blocks_size;      //!< Size of a block
+  int32_t sb_block_idx;      //!< Super-block starting index
+  int32_t sb_block_num;      //!< Super-block block count
+  int32_t fbm_block_idx;     //!< Free bit map starting index
+  int32_t fbm_block_num;     //!< Free bit map block count
+  int32_t journal_block_idx; //!< Journal starting index
+  int32_t journal_block_num; //!< Journal block count
+  int32_t em_block_idx;      //!< Epoch map starting index
+  int32_t em_block_num;      //!< Epoch map block count
+  int32_t rc_block_idx;      //!< Reference count table index when created
+  int32_t rc_block_num;      //!< Reference count table block count
+  int32_t hot_block_idx;     //!< Hot block list starting index
+  int32_t hot_block_num;     //!< Hot block list block count
+  uint32_t epoch;            //!< Epoch of blocks allocated now
+  int32_t snapshot_num;      //!< Number of snapshots
+  int32_t dir_block_num;     //!< Directory blocks count
+  int32_t inode_block_num;   //!< I-node blocks count
+  snapshot_t snapshots[SNAPSHOTS_MAX];    //!< Snapshots, oldest first
+  int32_t dir_blocks[DIR_BLOCKS_MAX];     //!< Directory block locations
+  int32_t inode_blocks[INODE_BLOCKS_MAX]; //!< I-node block locations
+  int32_t rc_blocks[RC_BLOCKS_MAX];       //!< Reference count block locations
+  uint32_t clean;                         //!< Non zero after a clean unmount
+  int32_t free_blocks;                    //!< Free blocks at the unmount
+  int32_t free_inodes;                    //!< Free I-nodes at the unmount
 } super_block_t;
 
 #if 1
@@ -103,6 +173,60 @@ typedef struct __attribute__((packed)) _fbm_table {
   uint8_t block[NUM_BLOCKS]; //!< State of a block: ENTRY_TAKEN or ENTRY_FREE
 } fbm_table_t;
 
+/**
+ * @class _epoch_entry
+ * @brief Epochs in which a block was allocated and released. A block is
+ * referenced by every snapshot taken in between.
+ */
+typedef struct __attribute__((packed)) _epoch_entry {
+  uint32_t birth; //!< Epoch in which the block was allocated
+  uint32_t death; //!< Epoch in which it was released or zero while in use
+} epoch_entry_t;
+
+/**
+ * @class _epoch_map
+ * @brief Epochs of each block. A block allocated no later than the newest
+ * snapshot may be shared with a snapshot, so it is copied before being changed
+ * and kept when the file system releases it, until the last snapshot
+ * referencing it is deleted. This structure is stored on the disk and cached
+ * in memory for faster access.
+ */
+typedef struct __attribute__((packed)) _epoch_map {
+  epoch_entry_t block[NUM_BLOCKS]; //!< Epochs of a block
+} epoch_map_t;
+
+/**
+ * @class _rc_table
+ * @brief Number of files referencing each block besides the first one, as
+ * blocks of a cloned file are shared until either file writes them. This
+ * structure is stored on the disk and cached in memory for faster access.
+ */
+typedef struct __attribute__((packed)) _rc_table {
+  uint16_t count[NUM_BLOCKS]; //!< Extra references to a block
+} rc_table_t;
+
+#if 1
+_Static_assert(sizeof(rc_table_t) == RC_BLOCKS_MAX * BLOCK_SIZE,
+               "reference count table must fill RC_BLOCKS_MAX blocks");
+#endif
+
+/**
+ * @class _hot_table
+ * @brief Blocks cached when the file system was unmounted, which the next
+ * mount reads ahead. The blocks used most are first. This structure is only
+ * stored on the disk.
+ */
+typedef struct __attribute__((packed)) _hot_table {
+  int32_t num;                   //!< Number of blocks
+  int32_t frequent;              //!< Leading blocks which were used often
+  int32_t block[HOT_BLOCKS_MAX]; //!< Blocks
+} hot_table_t;
+
+#if 1
+_Static_assert(sizeof(hot_table_t) == BLOCK_SIZE,
+               "hot block list size must be BLOCK_SIZE");
+#endif
+
 /**
  * @class _dir_entry
  * @brief Directory entry used for mapping file-names to I-nodes. This
@@ -119,27 +243,475 @@ _Static_assert(sizeof(dir_entry_t) == DIR_ENTRY_SIZE,
                "directory entry size must be DIR_ENTRY_SIZE");
 #endif
 
+#if 1
+_Static_assert(MAX_FILES == DIR_BLOCKS_MAX * DIR_ENTRIES_PER_BLOCK,
+               "directory must be able to hold an entry for every I-node");
+#endif
+
+/**
+ * @class _dir_table
+ * @brief Directory cached in memory. Blocks are loaded or allocated on demand
+ * so that memory stays proportional to the size of the directory.
+ */
+typedef struct _dir_table {
+  uint32_t size;                         //!< Number of entries in the table
+  dir_entry_t *block[DIR_BLOCKS_MAX];    //!< Cached directory blocks
+  _Atomic int8_t loaded[DIR_BLOCKS_MAX]; //!< Non zero once a block is cached
+} dir_table_t;
+
+/**
+ * @class _inode_state
+ * @brief State of an I-node shared by all file descriptors opened on it. This
+ * structure is only stored in memory. The size and the block map are published
+ * under a sequence count so that readers take a snapshot without writing to
+ * shared memory. The count is odd while a writer changes the file.
+ */
+typedef struct _inode_state {
+  uint32_t refs;         //!< Number of file descriptors bound to the I-node
+  int8_t unlinked;       //!< Non zero if the file was removed while still open
+  pthread_rwlock_t lock; //!< Exclusive for writes and a fallback for reads
+  _Atomic uint32_t seq;  //!< Sequence count of the published state
+  _Atomic uint32_t size; //!< Published size of the file
+  _Atomic int32_t *_Atomic map; //!< Published block map or NULL until loaded
+  _Atomic int8_t inlined; //!< Non zero while the data is held in the I-node
+} inode_state_t;
+
+/**
+ * @class _inode_table
+ * @brief I-node table cached in memory. Blocks are loaded or allocated on
+ * demand so that memory stays proportional to the number of I-nodes.
+ */
+typedef struct _inode_table {
+  _Atomic uint32_t size;                   //!< Number of I-nodes in the table
+  inode_t *block[INODE_BLOCKS_MAX];        //!< Cached I-node blocks
+  inode_state_t *state[INODE_BLOCKS_MAX];  //!< State of cached I-nodes
+  pthread_mutex_t lock[INODE_BLOCKS_MAX];  //!< Guards changes to a block
+  _Atomic int8_t loaded[INODE_BLOCKS_MAX]; //!< Non zero once a block is cached
+} inode_table_t;
+
 /**
  * @class _file_entry
  * @brief File descriptor entry used for keeping track of open files. It
  * maps file descriptor to I-nodes. This structure is only stored in memory.
  */
-typedef struct __attribute__((packed)) _file_entry {
-  int8_t free;          //!< State of an entry: ENTRY_TAKEN or ENTRY_FREE
-  int32_t ptr_read;     //!< Absolute position of the read pointer
-  int32_t ptr_write;    //!< Absolute position of the write pointer
-  int32_t linked_inode; //!< I-node associated with this file descriptor
+typedef struct _file_entry {
+  _Atomic int8_t free;   //!< State of an entry: ENTRY_TAKEN or ENTRY_FREE
+  int32_t ptr_read;      //!< Absolute position of the read pointer
+  int32_t ptr_write;     //!< Absolute position of the write pointer
+  int32_t linked_inode;  //!< I-node associated with this file descriptor
+  int32_t advice;        //!< Access pattern given by 'ssfs_fadvise'
+  pthread_rwlock_t lock; //!< Exclusive when the pointers are used or changed
 } file_entry_t;
 
+/**
+ * @class _file_entry_table
+ * @brief File descriptor table. It grows on demand by chunks so that entries
+ * never move, and is only stored in memory.
+ */
+typedef struct _file_entry_table {
+  _Atomic uint32_t size;               //!< Number of entries in the table
+  file_entry_t *chunk[FDT_CHUNKS_MAX]; //!< File descriptor entries
+} file_entry_table_t;
+
 // - Defines for file system special blocks
 #define SB_BLOCK 0
 #define SB_BLOCK_NUM 1
-#define DIR_BLOCK (SB_BLOCK + SB_BLOCK_NUM)
-#define DIR_BLOCK_NUM (MAX_FILES / (BLOCK_SIZE / DIR_ENTRY_SIZE))
-#define INODE_BLOCK (DIR_BLOCK + DIR_BLOCK_NUM)
-#define INODE_BLOCK_NUM (MAX_FILES / (BLOCK_SIZE / INODE_ENTRY_SIZE))
-#define FBM_BLOCK (INODE_BLOCK + INODE_BLOCK_NUM)
+#define FBM_BLOCK (SB_BLOCK + SB_BLOCK_NUM)
 #define FBM_BLOCK_NUM 1
+#define EM_BLOCK (FBM_BLOCK + FBM_BLOCK_NUM)
+#define EM_BLOCK_NUM (sizeof(epoch_map_t) / BLOCK_SIZE)
+#define RC_BLOCK (EM_BLOCK + EM_BLOCK_NUM)
+#define RC_BLOCK_NUM (sizeof(rc_table_t) / BLOCK_SIZE)
+#define HOT_BLOCK (RC_BLOCK + RC_BLOCK_NUM)
+#define HOT_BLOCK_NUM 1
+// - The journal follows the blocks tracked by the free bit map
+#define JOURNAL_BLOCK NUM_BLOCKS
+#define JOURNAL_BLOCK_NUM 64
+
+// - Defines for the journal
+#define JOURNAL_MAGIC 0X4A524E4C
+#define JOURNAL_HEADER 0
+#define JOURNAL_DESCRIPTOR 1
+#define JOURNAL_COMMIT 2
+#define JOURNAL_TX_MAX (JOURNAL_BLOCK_NUM - 3)
+#define JOURNAL_HANDLE_BLOCKS 12
+
+/**
+ * @class _journal_record
+ * @brief Control block of the journal. The first block of the journal is a
+ * header naming the first transaction to replay. Each transaction follows as a
+ * descriptor, the images of the blocks it changed and a commit block holding
+ * the checksum of the descriptor and the images.
+ */
+typedef struct __attribute__((packed)) _journal_record {
+  uint32_t magic;    //!< Magic
+  uint32_t type;     //!< JOURNAL_HEADER, JOURNAL_DESCRIPTOR or JOURNAL_COMMIT
+  uint32_t tid;      //!< Transaction identifier
+  uint32_t count;    //!< Number of block images in the transaction
+  uint32_t revoked;  //!< Number of blocks freed by the transaction
+  uint32_t checksum; //!< Checksum of the transaction in a commit block
+  int32_t block[2 * JOURNAL_TX_MAX]; //!< Home locations, then revoked blocks
+} journal_record_t;
+
+_Static_assert(sizeof(journal_record_t) <= BLOCK_SIZE,
+               "A journal record must fit in a block");
+
+/**
+ * @class _journal
+ * @brief Journal state cached in memory. Changes to metadata blocks are
+ * collected in the running transaction until the last handle on it ends, and
+ * then committed at once. Committed images are kept until they are written to
+ * their home locations by a checkpoint. A freed block is not allocated again
+ * before the transaction freeing it commits, which the free bit map lock
+ * guards.
+ */
+typedef struct _journal {
+  pthread_mutex_t lock;           //!< Guards the journal state
+  pthread_cond_t cond;            //!< Signalled when a transaction commits
+  uint32_t updates;               //!< Handles open on the running transaction
+  int8_t committing;              //!< Non zero while a commit is written
+  _Atomic uint32_t tid;           //!< Running transaction
+  _Atomic uint32_t committed;     //!< Last committed transaction
+  int32_t head;                   //!< Next free block of the journal
+  uint32_t count;                 //!< Blocks in the running transaction
+  uint32_t revoked;               //!< Blocks revoked by it
+  int32_t block[JOURNAL_TX_MAX];  //!< Blocks in the running transaction
+  int32_t revoke[JOURNAL_TX_MAX]; //!< Blocks revoked by it
+  char *running[NUM_BLOCKS];      //!< Images of the running transaction
+  char *pending[NUM_BLOCKS];      //!< Images waiting for a checkpoint
+  uint32_t released[NUM_BLOCKS];  //!< Transaction which freed a block
+} journal_t;
+
+// - Batched operations
+#define SSFS_OP_CREATE 0 //!< Creates a file unless it exists
+#define SSFS_OP_REMOVE 1 //!< Removes a file
+#define SSFS_OP_WRITE 2  //!< Writes to a file, which is created if needed
+
+/**
+ * @class _ssfs_op
+ * @brief Operation applied by 'ssfs_batch'.
+ */
+typedef struct _ssfs_op {
+  int32_t type;    //!< Kind of operation, one of SSFS_OP_*
+  char *name;      //!< Name of the file
+  const char *buf; //!< Data written by SSFS_OP_WRITE
+  int32_t length;  //!< Length of the data
+  int32_t offset;  //!< Position written by SSFS_OP_WRITE
+  int32_t result;  //!< Set to the result of the operation
+} ssfs_op_t;
+
+// - Mount options
+#define SSFS_MOUNT_LOG 0X1       //!< Log-structured writes
+#define SSFS_MOUNT_CACHE_SHIFT 8 //!< Position of the cache size in the flags
+
+//! Caps the block cache to 'n' blocks on [1, NUM_BLOCKS]
+#define SSFS_MOUNT_CACHE(n) ((n) << SSFS_MOUNT_CACHE_SHIFT)
+
+// - Log segments
+#define SEGMENT_BLOCKS 32
+#define SEGMENT_CLEAN_MIN 4  //!< Free segments the cleaner keeps
+#define SEGMENT_COMMIT_MS 50 //!< Longest delay of a commit in log mode
+
+/**
+ * @class _summary_entry
+ * @brief Block of a file held by a block of the log. Blocks shared by clones
+ * name the file which mapped them last.
+ */
+typedef struct _summary_entry {
+  int16_t inode; //!< I-node of the file or ENTRY_INVALID
+  int16_t index; //!< Index of the block in the file
+} summary_entry_t;
+
+/**
+ * @class _segment
+ * @brief Log segment cached in memory. In log-structured mode every data
+ * write goes to newly allocated blocks at the head of the log, which are
+ * buffered until a whole segment is written at once. The metadata is not
+ * committed as each call ends but once the segment is full or
+ * SEGMENT_COMMIT_MS passed, so that small writes fill the segment. A cleaner
+ * thread writes these commits and moves the live blocks out of sparsely used
+ * segments so the log finds free runs. It finds the files to visit in a
+ * summary of the owner of each block, which is kept as files map blocks and
+ * completed by visiting every file once per mount or restore.
+ */
+typedef struct _segment {
+  pthread_mutex_t lock;       //!< Guards the buffer and the cleaner state
+  pthread_mutex_t clean_lock; //!< Held while the cleaner moves blocks
+  pthread_cond_t cond;        //!< Wakes the cleaner
+  pthread_t cleaner;          //!< Cleaner thread
+  int8_t enabled;             //!< Non zero in log-structured mode
+  int8_t wake;                //!< Non zero when the cleaner has work
+  int8_t stop;                //!< Non zero when the cleaner has to exit
+  int8_t delayed;             //!< Non zero while a commit is delayed
+  int8_t full;                //!< Non zero once the segment filled up
+  struct timespec due;        //!< Time by which a delayed commit is written
+  int8_t summarized;          //!< Every file was visited, under clean_lock
+  summary_entry_t summary[NUM_BLOCKS]; //!< Owner of each block
+  _Atomic int32_t head;       //!< Next block of the log
+  int32_t start;              //!< First buffered block
+  int32_t count;              //!< Number of buffered blocks
+  char buf[SEGMENT_BLOCKS * BLOCK_SIZE]; //!< Buffered blocks
+} segment_t;
+
+// - Asynchronous requests
+#define SSFS_AIO_READ 0  //!< Reads with 'ssfs_pread'
+#define SSFS_AIO_WRITE 1 //!< Writes with 'ssfs_pwrite'
+#define AIO_WORKERS 4    //!< Threads of the I/O engine
+#define AIO_QUEUE_MAX 64 //!< Requests submitted and not reaped yet
+#define AIO_AHEAD_MAX 16 //!< Reads ahead queued at most
+
+/**
+ * @class _ssfs_sqe
+ * @brief Request submitted by 'ssfs_submit'.
+ */
+typedef struct _ssfs_sqe {
+  int32_t op;      //!< Kind of request, one of SSFS_AIO_*
+  int32_t fd;      //!< File handle given by a call to 'ssfs_fopen'
+  int32_t offset;  //!< Absolute position within the file
+  int32_t length;  //!< Length of the data
+  char *buf;       //!< Data to write or room for the data to read
+  void *user_data; //!< Handed back untouched with the completion
+} ssfs_sqe_t;
+
+/**
+ * @class _ssfs_cqe
+ * @brief Completion returned by 'ssfs_reap'.
+ */
+typedef struct _ssfs_cqe {
+  int32_t result;  //!< Result of 'ssfs_pread' or 'ssfs_pwrite'
+  void *user_data; //!< User data of the request
+} ssfs_cqe_t;
+
+// - goldfs.hpp declares both structures again and checks the same layout
+#if 1
+_Static_assert(sizeof(ssfs_sqe_t) ==
+                   4 * sizeof(int32_t) + sizeof(char *) + sizeof(void *),
+               "ssfs_sqe_t layout must match goldfs.hpp");
+_Static_assert(offsetof(ssfs_sqe_t, buf) == 4 * sizeof(int32_t),
+               "ssfs_sqe_t layout must match goldfs.hpp");
+_Static_assert(sizeof(ssfs_cqe_t) == 2 * sizeof(void *),
+               "ssfs_cqe_t layout must match goldfs.hpp");
+_Static_assert(offsetof(ssfs_cqe_t, user_data) == sizeof(void *),
+               "ssfs_cqe_t layout must match goldfs.hpp");
+#endif
+
+/**
+ * @class _aio_ahead
+ * @brief Range of a file queued to be read into the block cache.
+ */
+typedef struct _aio_ahead {
+  int32_t inode;  //!< I-node of the file
+  int32_t offset; //!< Absolute position within the file
+  int32_t length; //!< Length of the range
+  int32_t ahead;  //!< Non zero for a read ahead of a sequential reader
+} aio_ahead_t;
+
+/**
+ * @class _aio
+ * @brief I/O engine. Worker threads take submitted requests in order and run
+ * them concurrently, then queue their completions until they are reaped. The
+ * workers also read ahead into the block cache when no request is waiting.
+ * The workers are started by the first submission or read ahead after
+ * mounting.
+ */
+typedef struct _aio {
+  pthread_mutex_t lock;             //!< Guards the queues
+  pthread_cond_t cond;              //!< Wakes the workers
+  pthread_t workers[AIO_WORKERS];   //!< Worker threads
+  pid_t owner;                      //!< Process which started the workers
+  int32_t running;                  //!< Number of workers
+  int8_t enabled;                   //!< Non zero while mounted
+  int8_t stop;                      //!< Non zero when the workers have to exit
+  int32_t pending;                  //!< Requests not reaped yet
+  uint32_t sq_head;                 //!< First submitted request
+  uint32_t sq_count;                //!< Number of submitted requests
+  uint32_t cq_head;                 //!< First completion
+  uint32_t cq_count;                //!< Number of completions
+  ssfs_sqe_t sq[AIO_QUEUE_MAX];     //!< Submitted requests
+  ssfs_cqe_t cq[AIO_QUEUE_MAX];     //!< Completions
+  uint32_t ahead_head;              //!< First queued read ahead
+  uint32_t ahead_count;             //!< Number of queued reads ahead
+  int32_t ahead_running;            //!< Reads ahead being run by the workers
+  aio_ahead_t ahead[AIO_AHEAD_MAX]; //!< Queued reads ahead
+} aio_t;
+
+// - Block cache
+#define BCACHE_BLOCKS 512   //!< Data blocks cached by default
+#define BCACHE_SHARDS 8     //!< Most shards of the cache, each with a lock
+#define BCACHE_SHARD_MIN 8  //!< Fewest slots of a shard
+#define BCACHE_PIN 0X1      //!< Pins the block
+#define BCACHE_COLD 0X2     //!< Makes the block the first one to be reused
+#define BCACHE_AHEAD 0X4    //!< Block read ahead, which is not a use of it
+#define BCACHE_FREQUENT 0X8 //!< Block known to be used often
+#define READAHEAD_BLOCKS 32 //!< Blocks read ahead of sequential reads
+
+// - Access advice, the first three describe how a file is read
+#define SSFS_FADV_NORMAL 0X0     //!< No read-ahead, blocks are kept
+#define SSFS_FADV_SEQUENTIAL 0X1 //!< Reads ahead of every read
+#define SSFS_FADV_RANDOM 0X2     //!< No read-ahead
+#define SSFS_FADV_NOREUSE 0X4    //!< Blocks read are the first ones evicted
+#define SSFS_FADV_WILLNEED 0X8   //!< Queues a range to be read into the cache
+#define SSFS_FADV_DONTNEED 0X10  //!< Drops a range from the cache
+
+// - Lists of the block cache, the last two only hold block numbers
+#define BCACHE_T1 0   //!< Blocks used once recently
+#define BCACHE_T2 1   //!< Blocks used at least twice recently
+#define BCACHE_FREE 2 //!< Slots holding no block
+#define BCACHE_B1 3   //!< Ghosts of the blocks evicted from T1
+#define BCACHE_B2 4   //!< Ghosts of the blocks evicted from T2
+#define BCACHE_LISTS 5
+
+/**
+ * @class _bcache_link
+ * @brief Links of a slot or a ghost within its list.
+ */
+typedef struct _bcache_link {
+  int32_t prev; //!< More recently used entry or ENTRY_INVALID
+  int32_t next; //!< Less recently used entry or ENTRY_INVALID
+} bcache_link_t;
+
+/**
+ * @class _bcache_list
+ * @brief List of the block cache, ordered from the most recently used entry.
+ */
+typedef struct _bcache_list {
+  int32_t head; //!< Most recently used entry or ENTRY_INVALID
+  int32_t tail; //!< Least recently used entry or ENTRY_INVALID
+  int32_t size; //!< Number of entries
+} bcache_list_t;
+
+/**
+ * @class _bcache_buf
+ * @brief Slot of the block cache.
+ */
+typedef struct _bcache_buf {
+  int32_t block;        //!< Cached block or ENTRY_INVALID
+  _Atomic int32_t pins; //!< Number of users of the data, which keep the slot
+  int8_t list;          //!< List holding the slot or ENTRY_INVALID if detached
+  int8_t ref;           //!< Uses since the slot was last passed, at most 2
+  int8_t shard;         //!< Shard owning the slot
+} bcache_buf_t;
+
+/**
+ * @class _bcache_retired
+ * @brief Data of the slots of an earlier mount, which is freed once the last
+ * of its pinned blocks is released.
+ */
+typedef struct _bcache_retired {
+  char *data;                   //!< Data of the slots
+  int32_t capacity;             //!< Number of slots
+  int32_t pins;                 //!< Number of users left
+  struct _bcache_retired *next; //!< Next retired data or NULL
+} bcache_retired_t;
+
+/**
+ * @class _bcache_shard
+ * @brief Part of the block cache holding the blocks whose number modulo the
+ * number of shards is its index, with its own slots, lists and lock.
+ */
+typedef struct _bcache_shard {
+  pthread_mutex_t lock;             //!< Guards the shard
+  int32_t first;                    //!< First slot of the shard
+  int32_t capacity;                 //!< Number of slots
+  int32_t target;                   //!< Target size of T1
+  int32_t last;                     //!< Last block used
+  uint64_t hits;                    //!< Blocks found in the shard
+  uint64_t misses;                  //!< Blocks missing from the shard
+  bcache_list_t list[BCACHE_LISTS]; //!< Lists, one of BCACHE_*
+} bcache_shard_t;
+
+/**
+ * @class _bcache
+ * @brief Cache of data blocks with adaptive replacement (ARC). Blocks used
+ * once are in T1 and blocks used again are in T2, so a scan only replaces
+ * blocks of T1. The target size of T1 grows when a block evicted from T1 is
+ * used again and shrinks for a block evicted from T2. A use only counts a
+ * reference of the slot, and the replacement moves the slots it passes which
+ * were used since, as with CLOCK, so a hit takes a single lock and moves
+ * nothing. A block written while it is pinned is detached from the cache, so
+ * its users keep the data they were given. The blocks are spread over shards
+ * so that threads using different blocks do not wait for each other. The
+ * slots are allocated for each mount, while no other call uses the cache.
+ */
+typedef struct _bcache {
+  pthread_mutex_t lock;                //!< Guards the retired data
+  _Atomic uint32_t gen;                //!< Bumped whenever blocks are written
+  int32_t capacity;                    //!< Number of slots
+  int32_t shards;                      //!< Number of shards
+  bcache_shard_t shard[BCACHE_SHARDS]; //!< Shards
+  int32_t slot[NUM_BLOCKS];            //!< Slot of a block or ENTRY_INVALID
+  int8_t ghost[NUM_BLOCKS];            //!< Ghost list of a block
+  bcache_link_t glink[NUM_BLOCKS];     //!< Links of the ghosts, by block
+  bcache_link_t *link;                 //!< Links of the slots
+  bcache_buf_t *buf;                   //!< Slots
+  char *data;                          //!< Data of the slots, a block each
+  bcache_retired_t *retired;           //!< Data of earlier mounts still pinned
+} bcache_t;
+
+/**
+ * @class _warm
+ * @brief Reader running in the background after a mount. It loads the I-node
+ * and directory blocks which were not used yet, then the blocks which were
+ * cached at the last unmount in the order of the blocks on disk.
+ */
+typedef struct _warm {
+  pthread_mutex_t lock;    //!< Guards 'running'
+  pthread_cond_t cond;     //!< Signalled when the thread is done
+  pid_t owner;             //!< Process which started the thread
+  int8_t running;          //!< Non zero until the thread is done
+  int8_t registered;       //!< Non zero once 'warm_fork' is registered
+  _Atomic int8_t stop;     //!< Non zero when the thread has to exit
+  int32_t inode_blocks;    //!< I-node blocks to load
+  int32_t dir_blocks;      //!< Directory blocks to load
+  int8_t list[NUM_BLOCKS]; //!< List a block was in or ENTRY_INVALID
+} warm_t;
+
+/**
+ * @class _space
+ * @brief Summary of the free space, kept up to date as blocks and I-nodes are
+ * taken and freed. A clean unmount saves it in the super-block, so that the
+ * next mount does not count it again.
+ */
+typedef struct _space {
+  _Atomic int32_t free_blocks; //!< Free blocks on the disk
+  _Atomic int32_t free_inodes; //!< Free I-nodes in the I-node table
+} space_t;
+
+/**
+ * @class _ssfs_cache_stats
+ * @brief Statistics of the block cache given by 'ssfs_cache_stats'.
+ */
+typedef struct _ssfs_cache_stats {
+  int32_t capacity; //!< Number of blocks the cache holds at most
+  int32_t recent;   //!< Blocks used once recently
+  int32_t frequent; //!< Blocks used at least twice recently
+  int32_t target;   //!< Target number of blocks used once
+  uint64_t hits;    //!< Blocks found in the cache
+  uint64_t misses;  //!< Blocks missing from the cache
+} ssfs_cache_stats_t;
+
+/**
+ * @class _ssfs_space_stats
+ * @brief Free space of the file system given by 'ssfs_space_stats'.
+ */
+typedef struct _ssfs_space_stats {
+  int32_t blocks;      //!< Number of blocks
+  int32_t free_blocks; //!< Blocks which are free
+  int32_t inodes;      //!< Number of I-nodes in the I-node table
+  int32_t free_inodes; //!< I-nodes which are free
+} ssfs_space_stats_t;
+
+/**
+ * @class _ssfs_view
+ * @brief Range of a file given by 'ssfs_read_view'. The pieces point to
+ * pinned blocks of the cache, which are not copied.
+ */
+typedef struct _ssfs_view {
+  int32_t iovcnt;                              //!< Number of pieces
+  struct iovec iov[MAX_BLOCKS_PER_FILE + 1];   //!< Pieces covering the range
+  const char *pinned[MAX_BLOCKS_PER_FILE + 1]; //!< Pinned block of a piece
+  char data[INODE_INLINE_MAX];                 //!< Copy of data in the I-node
+} ssfs_view_t;
 
 // - Super block management
 
@@ -164,6 +736,14 @@ int32_t sb_update(const super_block_t sb_);
  */
 int32_t sb_init(super_block_t *sb_);
 
+/**
+ * @brief Checks that a Super-block describes the geometry the file system
+ * was built with.
+ * @param sb_ Super-block
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t sb_check(const super_block_t *sb_);
+
 // - Free bit map management
 
 /**
@@ -188,11 +768,78 @@ int32_t fbm_update(const fbm_table_t fbm_table_);
 
 int32_t fbm_init(fbm_table_t *fbm_table_);
 
+// - Epoch map management
+
+/**
+ * @brief Reads the epoch map from disk.
+ * @param em Epoch map
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t em_read(epoch_map_t *em);
+
+/**
+ * @brief Updates the epoch map on disk.
+ * @param em Epoch map
+ * @param idx Block whose entry changed or ENTRY_INVALID to update every block
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t em_update(const epoch_map_t *em, int32_t idx);
+
+/**
+ * @brief Initialises the epoch map in memory.
+ * @param em Epoch map
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t em_init(epoch_map_t *em);
+
+// - Reference count management
+
+/**
+ * @brief Reads the reference count table from disk.
+ * @param rc Reference count table
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t rc_read(rc_table_t *rc);
+
+/**
+ * @brief Updates the reference count table on disk. A block of the table which
+ * is shared with a snapshot is copied first. The free bit map lock has to be
+ * held.
+ * @param rc Reference count table
+ * @param idx Block whose entry changed or ENTRY_INVALID to update every block
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t rc_update(const rc_table_t *rc, int32_t idx);
+
+/**
+ * @brief Initialises the reference count table in memory.
+ * @param rc Reference count table
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t rc_init(rc_table_t *rc);
+
+// - Hot block list management
+
+/**
+ * @brief Reads the hot block list from disk. File systems created without a
+ * list give an empty one.
+ * @param hot Hot block list
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t hot_read(hot_table_t *hot);
+
+/**
+ * @brief Updates the hot block list on disk.
+ * @param hot Hot block list
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t hot_update(const hot_table_t *hot);
+
 // - Block management (updates the free bit map table)
 
 /**
- * @brief Allocates a free block and returns its index. If the requested
- * index is taken, then, the function fails.
+ * @brief Allocates a free block and returns its index. If the suggested
+ * index is taken, then, the next free block after it is taken.
  * @param fbm_table_ Free bit map table
  * @param idx A suggested index is considered only if the value of idx is >= 0
  * @return Index of the block or MY_ERR otherwise
@@ -200,212 +847,1190 @@ int32_t fbm_init(fbm_table_t *fbm_table_);
 int32_t block_allocate(fbm_table_t *fbm_table_, int32_t idx);
 
 /**
- * @brief Marks a block as free.
+ * @brief Allocates a block like 'block_allocate' while the free bit map lock
+ * is held.
+ * @param fbm_table_ Free bit map table
+ * @param idx A suggested index is considered only if the value of idx is >= 0
+ * @return Index of the block or MY_ERR otherwise
+ */
+int32_t block_take(fbm_table_t *fbm_table_, int32_t idx);
+
+/**
+ * @brief Allocates several blocks with a single update of the free bit map.
+ * The first run of free blocks long enough to hold all of them is taken, and
+ * the first free blocks found otherwise.
+ * @param fbm_table_ Free bit map table
+ * @param idx The search starts at a suggested index if the value of idx is >= 0
+ * @param num Number of blocks
+ * @param block_list List receiving the indices of the blocks
+ * @return Number of blocks allocated or MY_ERR if the disk cannot hold all of
+ * them, in which case none is allocated
+ */
+int32_t block_allocate_run(fbm_table_t *fbm_table_, int32_t idx, int32_t num,
+                           int32_t *block_list);
+
+/**
+ * @brief Marks a block as free. A block referenced by several files loses a
+ * reference instead, and a block shared with a snapshot is recorded as
+ * released and freed once no snapshot references it.
  * @param fbm_table_ Free bit map table
  * @param idx Block index in free bit map
  * @return MY_OK is returned on success and MY_ERR otherwise
  */
 int32_t block_deallocate(fbm_table_t *fbm_table_, int32_t idx);
 
+/**
+ * @brief Marks several blocks as free like 'block_deallocate' with a single
+ * update of the free bit map.
+ * @param fbm_table_ Free bit map table
+ * @param block_list List of block indices, where ENTRY_INVALID is skipped
+ * @param num Number of entries in the list
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t block_deallocate_list(fbm_table_t *fbm_table_,
+                              const int32_t *block_list, int32_t num);
+
+/**
+ * @brief Checks whether a block may be shared with a snapshot or another file.
+ * The free bit map lock has to be held.
+ * @param idx Block index
+ * @return Non zero if the block may be shared and zero otherwise
+ */
+int block_shared(int32_t idx);
+
+/**
+ * @brief Checks whether a block may be allocated. It has to be free, and the
+ * transaction which freed it committed, so that committed metadata no longer
+ * references it. The free bit map lock has to be held.
+ * @param fbm_table_ Free bit map table
+ * @param idx Block index
+ * @return Non zero if the block may be allocated and zero otherwise
+ */
+int block_available(const fbm_table_t *fbm_table_, int32_t idx);
+
+/**
+ * @brief Prepares a block of the file system to be changed. A shared block is
+ * replaced by a newly allocated one, which the caller then writes in full,
+ * while the old one has to be released by the caller. Other blocks are
+ * returned as is.
+ * @param fbm_table_ Free bit map table
+ * @param idx Block index
+ * @return Index of the block to write to or MY_ERR otherwise
+ */
+int32_t block_cow(fbm_table_t *fbm_table_, int32_t idx);
+
 // - Directory management
 
+/**
+ * @brief Obtains a directory entry. The block holding it is read from disk
+ * on first use.
+ * @param t Pointer to the directory table
+ * @param idx Index of the entry
+ * @return Address of the entry or NULL if the index is out of range
+ */
+dir_entry_t *dir_get(dir_table_t *t, int32_t idx);
+
+/**
+ * @brief Reads a directory block from disk unless it is cached.
+ * @param t Pointer to the directory table
+ * @param i Index of the block within the directory
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t dir_load_block(dir_table_t *t, int32_t i);
+
 /**
  * @brief Finds the I-node associated with the file-name.
- * @param d Pointer to the directory structure
- * @param size Size of the directory
+ * @param t Pointer to the directory table
  * @param name File name
  * @return Index of the entry associated with name or MY_ERR otherwise
  */
-int32_t dir_find(dir_entry_t *d, uint32_t size, const char *name);
+int32_t dir_find(dir_table_t *t, const char *name);
 
 /**
  * @brief Removes the association of the I-node and a file-name.
- * @param d Pointer to the directory structure
- * @param size Size of the directory
+ * @param t Pointer to the directory table
  * @param name File name
- * @return MY_OK is returned on success and MY_ERR otherwise
+ * @return Index of the removed entry or MY_ERR otherwise
  */
-int32_t dir_remove(dir_entry_t *d, uint32_t size, const char *name);
+int32_t dir_remove(dir_table_t *t, const char *name);
 
 /**
- * @brief Adds the association between the file-name and an I-node.
- * @param d Pointer to the directory structure
- * @param size Size of the directory
+ * @brief Adds the association between the file-name and an I-node. A new
+ * directory block is allocated if all entries are taken.
+ * @param t Pointer to the directory table
  * @param name File name
  * @param node I-node index
+ * @return Index of the new entry or MY_ERR otherwise
+ */
+int32_t dir_add(dir_table_t *t, const char *name, uint32_t node);
+
+/**
+ * @brief Opens the directory on disk. Its blocks are read on first use.
+ * @param t Pointer to the directory table
  * @return MY_OK is returned on success and MY_ERR otherwise
  */
-int32_t dir_add(dir_entry_t *d, uint32_t size, const char *name, uint32_t node);
+int32_t dir_read(dir_table_t *t);
 
 /**
- * @brief Reads the directory from disk.
- * @param d Pointer to the directory structure
- * @param size Size of the directory
+ * @brief Updates the directory block holding an entry on disk.
+ * @param t Pointer to the directory table
+ * @param idx Index of the entry or ENTRY_INVALID to update every cached block
  * @return MY_OK is returned on success and MY_ERR otherwise
  */
-int32_t dir_read(dir_entry_t *d, uint32_t size);
+int32_t dir_update(dir_table_t *t, int32_t idx);
 
 /**
- * @brief Updates the directory on disk.
- * @param d Pointer to the directory structure
- * @param size Size of the directory
+ * @brief Initialises an empty directory in memory.
+ * @param t Pointer to the directory table
  * @return MY_OK is returned on success and MY_ERR otherwise
  */
-int32_t dir_update(const dir_entry_t *d, uint32_t size);
+int32_t dir_init(dir_table_t *t);
 
 /**
- * @brief Initialises the directory on disk.
- * @param d Pointer to the directory structure
- * @param size Size of the directory
+ * @brief Frees memory held by the directory table.
+ * @param t Pointer to the directory table
  * @return MY_OK is returned on success and MY_ERR otherwise
  */
-int32_t dir_init(dir_entry_t *d, uint32_t size);
+int32_t dir_release(dir_table_t *t);
 
 // - File descriptor management
 
 /**
- * @brief Removes the file descriptor.
- * @param f Pointer to the file descriptor table
- * @param size Size of the file descriptor table
+ * @brief Obtains a file descriptor entry whether it is open or not. Entries
+ * never move once the table has grown to hold them.
+ * @param t Pointer to the file descriptor table
+ * @param fd File descriptor
+ * @return Address of the entry or NULL if the descriptor is out of range
+ */
+file_entry_t *fdt_get(const file_entry_table_t *t, int fd);
+
+/**
+ * @brief Locks an open file descriptor entry. A shared lock is enough to use
+ * the I-node bound to the entry, while an exclusive lock is needed to use or
+ * change its pointers and to close it.
+ * @param t Pointer to the file descriptor table
+ * @param fd File descriptor
+ * @param exclusive Non zero to lock the entry exclusively
+ * @return Address of the locked entry or NULL if the descriptor is not open
+ */
+file_entry_t *fdt_lock(const file_entry_table_t *t, int fd, int exclusive);
+
+/**
+ * @brief Unlocks an entry locked by a call to 'fdt_lock'.
+ * @param f Pointer to the file descriptor entry
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t fdt_unlock(file_entry_t *f);
+
+/**
+ * @brief Removes the file descriptor. The entry must be locked exclusively.
+ * @param t Pointer to the file descriptor table
  * @param fd File descriptor to remove
  * @return MY_OK is returned on success and MY_ERR otherwise
  */
-int32_t fdt_remove(file_entry_t *f, uint32_t size, int fd);
+int32_t fdt_remove(file_entry_table_t *t, int fd);
 
 /**
- * @brief Find the first free file descriptor.
- * @param f Pointer to the file descriptor table
- * @param size Size of the file descriptor table
+ * @brief Find the first free file descriptor. The table is grown if all
+ * entries are taken.
+ * @param t Pointer to the file descriptor table
  * @param inode_idx The I-node bound to the file
  * @return A new file descriptor or MY_ERR otherwise
  */
-
-int32_t fdt_add(file_entry_t *f, uint32_t size, uint32_t inode_idx);
+int32_t fdt_add(file_entry_table_t *t, uint32_t inode_idx);
 
 /**
  * @brief Initialises the file descriptor table.
- * @param f Pointer to the file descriptor table
- * @param size Size of the file descriptor table
+ * @param t Pointer to the file descriptor table
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t fdt_init(file_entry_table_t *t);
+
+/**
+ * @brief Frees memory held by the file descriptor table.
+ * @param t Pointer to the file descriptor table
  * @return MY_OK is returned on success and MY_ERR otherwise
  */
-int32_t fdt_init(file_entry_t *f, uint32_t size);
+int32_t fdt_release(file_entry_table_t *t);
 
 // - I-node management
 
 /**
- * @brief Finds the data block where an I-node is located.
- * @param p Pointer to the I-node table
- * @param size Size of the I-node table
- * @param idx Index of the I-node to look for
- * @return Index of the block where the I-node resides
+ * @brief Obtains an I-node. The block holding it is read from disk on first
+ * use.
+ * @param t Pointer to the I-node table
+ * @param idx Index of the I-node
+ * @return Address of the I-node or NULL if the index is out of range
  */
-int32_t inode_find(inode_t *p, uint32_t size, int32_t idx);
+inode_t *inode_get(inode_table_t *t, int32_t idx);
 
 /**
- * @brief Removes the I-node from the I-node table.
- * @param p Pointer to the I-node table
- * @param size Size of the I-node table
- * @param idx Index of the I-node to look for
- * @return MY_OK is returned on success and MY_ERR otherwise
+ * @brief Obtains the in-memory state of an I-node.
+ * @param t Pointer to the I-node table
+ * @param idx Index of the I-node
+ * @return Address of the state or NULL if the index is out of range
  */
-int32_t inode_remove(inode_t *p, uint32_t size, int32_t idx);
+inode_state_t *inode_get_state(inode_table_t *t, int32_t idx);
 
 /**
- * @brief Allocates a new I-node to the I-node table.
- * @param p Pointer to the I-node table
- * @param size Size of the I-node table
- * @return Index of I-node in the table on success and MY_ERR otherwise
+ * @brief Reads an I-node block from disk unless it is cached.
+ * @param t Pointer to the I-node table
+ * @param i Index of the block within the table
+ * @return MY_OK is returned on success and MY_ERR otherwise
  */
-int32_t inode_allocate(inode_t *p, uint32_t size);
+int32_t inode_load_block(inode_table_t *t, int32_t i);
 
 /**
- * @brief Initialises the I-node table.
- * @param p Pointer to the I-node table
- * @param size Size of the I-node table
+ * @brief Locks the I-node block holding an I-node. Fields of an I-node are only
+ * changed with its block locked so that 'inode_update' never writes a torn
+ * I-node to disk.
+ * @param t Pointer to the I-node table
+ * @param idx Index of the I-node
  * @return MY_OK is returned on success and MY_ERR otherwise
  */
-int32_t inode_init(inode_t *p, uint32_t size);
+int32_t inode_lock_block(inode_table_t *t, int32_t idx);
 
 /**
- * @brief Reads the I-node table from disk.
- * @param p Pointer to the I-node table
- * @param size Size of the I-node table
+ * @brief Unlocks an I-node block locked by 'inode_lock_block'.
+ * @param t Pointer to the I-node table
+ * @param idx Index of the I-node
  * @return MY_OK is returned on success and MY_ERR otherwise
  */
-int32_t inode_read(inode_t *p, uint32_t size);
+int32_t inode_unlock_block(inode_table_t *t, int32_t idx);
 
 /**
- * @brief Updates the I-nodes table to disk.
- * @param p Pointer to the I-node table
- * @param size Size of the I-node table
- * @return MY_OK is returned on success and MY_ERR otherwise
+ * @brief Finds the data block where an I-node is located.
+ * @param t Pointer to the I-node table
+ * @param idx Index of the I-node to look for
+ * @return Index of the block where the I-node resides or MY_ERR otherwise
  */
-int32_t inode_update(const inode_t *p, uint32_t size);
+int32_t inode_find(inode_table_t *t, int32_t idx);
 
 /**
- * @brief Obtains a list of blocks associated with an I-node.
- * @param p I-node
- * @param size Size of the block table
- * @return Address of the block table is returned on success and NULL otherwise
+ * @brief Removes the I-node from the I-node table.
+ * @param t Pointer to the I-node table
+ * @param idx Index of the I-node to look for
+ * @return MY_OK is returned on success and MY_ERR otherwise
  */
-int32_t *inode_get_block_list(const inode_t p, uint32_t *size);
+int32_t inode_remove(inode_table_t *t, int32_t idx);
 
 /**
- * @brief Sets a list of blocks associated with an I-node.
- * @param p Pointer to the I-node
- * @param block_list List of blocks to set
+ * @brief Takes a reference on an I-node for a new file descriptor.
+ * @param t Pointer to the I-node table
+ * @param idx Index of the I-node
  * @return MY_OK is returned on success and MY_ERR otherwise
  */
-int32_t inode_set_block_list(inode_t *p, int32_t *block_list);
+int32_t inode_ref(inode_table_t *t, int32_t idx);
 
 /**
- * @brief Frees memory allocated by 'inode_get_block_list' call.
- * @param block_list Pointer to the block list
+ * @brief Drops a reference taken by 'inode_ref'. The I-node is destroyed when
+ * the last reference goes if its file was removed.
+ * @param t Pointer to the I-node table
+ * @param idx Index of the I-node
  * @return MY_OK is returned on success and MY_ERR otherwise
  */
-int32_t inode_free_block_list(int32_t *block_list);
+int32_t inode_unref(inode_table_t *t, int32_t idx);
 
-// - ssfs
+/**
+ * @brief Gives the published size of an I-node.
+ * @param state Pointer to the state of the I-node
+ * @return Size of the file
+ */
+int32_t inode_state_size(const inode_state_t *state);
 
 /**
- * @brief Creates a new file system or opens an existing one.
- * @param fresh If 'fresh' is non zero, then a new file system is created.
- * Otherwise, an existing one is opened.
+ * @brief Marks the file of an I-node as removed. The I-node is destroyed at
+ * once if no file descriptor refers to it.
+ * @param t Pointer to the I-node table
+ * @param idx Index of the I-node
+ * @return MY_OK is returned on success and MY_ERR otherwise
  */
-void mkssfs(int fresh);
+int32_t inode_unlink(inode_table_t *t, int32_t idx);
 
 /**
- * @brief Opens a file specified by 'name'. If a file exists, then, it is opened
- * in append mode. Otherwise, a new file is created if there is a free entry in
- * the directory table. If the file is already opened and thus located in file
- * descriptor table, an old file handle is returned.
- * @param name File name
- * @return -1 on error or a file handle on success
+ * @brief Publishes the size and the block map of an I-node for lock-free
+ * readers. Nothing is done if they are already published.
+ * @param t Pointer to the I-node table
+ * @param idx Index of the I-node
+ * @return MY_OK is returned on success and MY_ERR otherwise
  */
-int ssfs_fopen(char *name);
+int32_t inode_load(inode_table_t *t, int32_t idx);
 
 /**
- * @brief Closes a file and frees a space in the file descriptor table.
- * @param fileID File handle given by a call to 'ssfs_fopen'
- * @return -1 on error or 0 on success
+ * @brief Obtains the published size of a file.
+ * @param t Pointer to the I-node table
+ * @param idx Index of the I-node
+ * @return Size of the file on success and MY_ERR otherwise
  */
-int ssfs_fclose(int fileID);
+int32_t inode_size(inode_table_t *t, int32_t idx);
 
 /**
- * @brief Repositions the read pointer.
- * @param fileID File handle given by a call to 'ssfs_fopen'
- * @param loc Absolute position within the file on [0, size]
- * @return -1 on error or 0 on success
+ * @brief Starts a lock-free read of the published state of an I-node.
+ * @param state Pointer to the state of the I-node
+ * @return Sequence count to pass to 'inode_read_retry'
  */
-int ssfs_frseek(int fileID, int loc);
+uint32_t inode_read_begin(const inode_state_t *state);
 
 /**
- * @brief Repositions the write pointer.
- * @param fileID File handle given by a call to 'ssfs_fopen'
- * @param loc Absolute position within the file on [0, size]
- * @return -1 on error or 0 on success
+ * @brief Checks whether a lock-free read has to be retried because a writer
+ * changed the file meanwhile.
+ * @param state Pointer to the state of the I-node
+ * @param seq Sequence count returned by 'inode_read_begin'
+ * @return Non zero if the data read is not consistent and zero otherwise
  */
-int ssfs_fwseek(int fileID, int loc);
+int inode_read_retry(const inode_state_t *state, uint32_t seq);
+
+/**
+ * @brief Starts a change of the published state of an I-node. The I-node lock
+ * must be held exclusively.
+ * @param state Pointer to the state of the I-node
+ */
+void inode_write_begin(inode_state_t *state);
+
+/**
+ * @brief Ends a change started by 'inode_write_begin'.
+ * @param state Pointer to the state of the I-node
+ */
+void inode_write_end(inode_state_t *state);
+
+/**
+ * @brief Frees the blocks of a file, removes its I-node from the I-node table
+ * and updates the I-node on disk. It waits for I/O in flight on the I-node.
+ * @param t Pointer to the I-node table
+ * @param idx Index of the I-node to destroy
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t inode_destroy(inode_table_t *t, int32_t idx);
+
+/**
+ * @brief Allocates a new I-node to the I-node table. A new I-node block is
+ * allocated if all I-nodes are taken.
+ * @param t Pointer to the I-node table
+ * @return Index of I-node in the table on success and MY_ERR otherwise
+ */
+int32_t inode_allocate(inode_table_t *t);
+
+/**
+ * @brief Initialises an empty I-node table in memory.
+ * @param t Pointer to the I-node table
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t inode_init(inode_table_t *t);
+
+/**
+ * @brief Opens the I-node table on disk. Its blocks are read on first use.
+ * @param t Pointer to the I-node table
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t inode_read(inode_table_t *t);
+
+/**
+ * @brief Updates the I-node block holding an I-node on disk.
+ * @param t Pointer to the I-node table
+ * @param idx Index of the I-node or ENTRY_INVALID to update every cached
+ * block
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t inode_update(inode_table_t *t, int32_t idx);
+
+/**
+ * @brief Frees memory held by the I-node table.
+ * @param t Pointer to the I-node table
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t inode_release(inode_table_t *t);
+
+/**
+ * @brief Frees the I-nodes which no directory entry links. A file removed
+ * while still open keeps its I-node until it is closed, which a crash never
+ * does.
+ * @param t Pointer to the I-node table
+ * @param d Pointer to the directory table
+ * @return Number of I-nodes freed or MY_ERR otherwise
+ */
+int32_t inode_reclaim(inode_table_t *t, dir_table_t *d);
+
+/**
+ * @brief Obtains a list of blocks associated with an I-node.
+ * @param p I-node
+ * @param size Size of the block table
+ * @return Address of the block table is returned on success and NULL otherwise
+ */
+int32_t *inode_get_block_list(const inode_t p, uint32_t *size);
+
+/**
+ * @brief Sets a list of blocks associated with an I-node. The indirect block
+ * is allocated once a block past the direct ones is set, released once none
+ * is, and moved first if it is shared with a snapshot. The blocks are recorded
+ * in the summary of the log.
+ * @param p Pointer to the I-node
+ * @param inode_idx Index of the I-node
+ * @param block_list List of blocks to set
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t inode_set_block_list(inode_t *p, int32_t inode_idx,
+                             int32_t *block_list);
+
+/**
+ * @brief Frees memory allocated by 'inode_get_block_list' call.
+ * @param block_list Pointer to the block list
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t inode_free_block_list(int32_t *block_list);
+
+// - File data management
+
+/**
+ * @brief Looks up a file by name, creating it if asked to, and takes a
+ * reference on its I-node, which 'inode_unref' drops. The reference keeps a
+ * concurrent remove from destroying the I-node. A journal handle has to be
+ * held.
+ * @param name Name of the file
+ * @param create Non zero to create the file if it does not exist
+ * @return Index of the I-node or MY_ERR otherwise
+ */
+int32_t file_lookup(const char *name, int create);
+
+/**
+ * @brief Reads a range of a file from its data blocks. Whole blocks which are
+ * contiguous on disk are read with a single call and holes read as zeros
+ * without touching the disk.
+ * @param block_list List of blocks of the file
+ * @param buf Pointer to the data to read
+ * @param len Length of the data to read
+ * @param off Absolute position within the file
+ * @param advice Access pattern, SSFS_FADV_NOREUSE keeps the blocks cold
+ * @return Number of bytes read or MY_ERR otherwise
+ */
+int32_t file_blocks_read(const int32_t *block_list, char *buf, int32_t len,
+                         int32_t off, int32_t advice);
+
+/**
+ * @brief Writes a range of a file to its data blocks. Whole blocks which are
+ * contiguous on disk are written with a single call.
+ * @param block_list List of blocks of the file
+ * @param buf Pointer to the data to write
+ * @param len Length of the data to write
+ * @param off Absolute position within the file
+ * @param valid Size of the file before the write. Partially written blocks past
+ * this size are not read back from disk.
+ * @return Number of bytes written or MY_ERR otherwise
+ */
+int32_t file_blocks_write(const int32_t *block_list, const char *buf,
+                          int32_t len, int32_t off, int32_t valid);
+
+/**
+ * @brief Copies the contents of a block into another one.
+ * @param src Index of the block to copy or ENTRY_INVALID to fill the other
+ * block with zeros
+ * @param dst Index of the block to overwrite
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t file_block_copy(int32_t src, int32_t dst);
+
+/**
+ * @brief Moves the data of a file held in its I-node to a data block, so that
+ * the file can grow past INODE_INLINE_MAX bytes. The I-node has to be locked
+ * exclusively.
+ * @param inode_idx I-node of the file
+ * @return MY_OK is returned on success or if the data is already in blocks
+ * and MY_ERR otherwise
+ */
+int32_t file_promote(int32_t inode_idx);
+
+/**
+ * @brief Reads data of a file at a given position into a list of buffers. The
+ * I-node is locked shared for the duration of the call. Data held in the
+ * I-node is copied without touching the disk.
+ * @param inode_idx I-node of the file
+ * @param iov List of buffers
+ * @param iovcnt Number of buffers
+ * @param off Absolute position within the file on [0, size)
+ * @param advice Access pattern of the caller, one of SSFS_FADV_*
+ * @return Number of bytes read or MY_ERR otherwise
+ */
+int32_t file_readv(int32_t inode_idx, const struct iovec *iov, int iovcnt,
+                   int32_t off, int32_t advice);
+
+/**
+ * @brief Reads the blocks of a range of a file which are not cached into the
+ * cache. Blocks which are contiguous on disk are read with a single call. The
+ * I-node is locked shared for the duration of the call.
+ * @param inode_idx I-node of the file
+ * @param off Absolute position within the file
+ * @param len Length of the range, which is cut at the end of the file
+ * @param ahead Non zero to do nothing when the block in the middle of the
+ * range is cached, which means the range was already read ahead
+ * @return Number of blocks read or MY_ERR otherwise
+ */
+int32_t file_prefetch(int32_t inode_idx, int32_t off, int32_t len, int ahead);
+
+/**
+ * @brief Queues a read ahead of a sequential reader, which the I/O engine runs
+ * in the background. Nothing is done for other access patterns. The range is
+ * read again once the reader passed its middle, so that the blocks are cached
+ * before they are needed.
+ * @param inode_idx I-node of the file
+ * @param advice Access pattern of the reader, one of SSFS_FADV_*
+ * @param off Position the reader reached
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t file_readahead(int32_t inode_idx, int32_t advice, int32_t off);
+
+/**
+ * @brief Drops the blocks of a range of a file from the cache.
+ * @param inode_idx I-node of the file
+ * @param off Absolute position within the file
+ * @param len Length of the range
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t file_evict(int32_t inode_idx, int32_t off, int32_t len);
+
+/**
+ * @brief Pins the cached blocks covering a range of a file. Holes point to
+ * zeros and data held in the I-node is copied into the view. The I-node is
+ * locked shared for the duration of the call.
+ * @param inode_idx I-node of the file
+ * @param off Absolute position within the file on [0, size)
+ * @param len Length of the range, which is cut at the end of the file
+ * @param view View filled with the pieces of the range
+ * @return Number of bytes covered or MY_ERR otherwise
+ */
+int32_t file_view(int32_t inode_idx, int32_t off, int32_t len,
+                  ssfs_view_t *view);
+
+/**
+ * @brief Writes data from a list of buffers to a file at a given position.
+ * Blocks are allocated as needed and the I-node is only updated on disk if
+ * its size or blocks changed. Blocks between the end of the file and the
+ * position are left as holes. Data which fits in the I-node is written there
+ * and moved to a block once it does not. The I-node is locked exclusively for
+ * the duration of the call.
+ * @param inode_idx I-node of the file
+ * @param iov List of buffers
+ * @param iovcnt Number of buffers
+ * @param off Absolute position within the file on [0, FILE_SIZE_MAX]
+ * @return Number of bytes written, which is smaller than requested if the
+ * file or the disk is full, or MY_ERR otherwise
+ */
+int32_t file_writev(int32_t inode_idx, const struct iovec *iov, int iovcnt,
+                    int32_t off);
+
+/**
+ * @brief Copies data between files through a buffer of COPY_CHUNK_BLOCKS
+ * blocks held by the library.
+ * @param in_idx I-node of the source file
+ * @param off_in Absolute position within the source file
+ * @param out_idx I-node of the destination file
+ * @param off_out Absolute position within the destination file
+ * @param len Number of bytes to copy
+ * @return Number of bytes copied or MY_ERR otherwise
+ */
+int32_t file_copy(int32_t in_idx, int32_t off_in, int32_t out_idx,
+                  int32_t off_out, int32_t len);
+
+/**
+ * @brief Makes whole blocks of a file refer to blocks of another file, which
+ * are shared until either file writes them. Holes stay holes and the blocks
+ * replaced in the destination file are released.
+ * @param in_idx I-node of the source file
+ * @param in_block First block of the source file
+ * @param out_idx I-node of the destination file
+ * @param out_block First block of the destination file
+ * @param num Number of blocks
+ * @return Number of bytes remapped or MY_ERR otherwise
+ */
+int32_t file_remap(int32_t in_idx, int32_t in_block, int32_t out_idx,
+                   int32_t out_block, int32_t num);
+
+/**
+ * @brief Allocates the holes of a range of a file as one run of blocks where
+ * possible and fills them with zeros. The size of the file is unchanged, so
+ * later writes within the range only fill the blocks. The I-node is locked
+ * exclusively for the duration of the call.
+ * @param inode_idx I-node of the file
+ * @param off Absolute position within the file
+ * @param len Length of the range
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t file_allocate(int32_t inode_idx, int32_t off, int32_t len);
+
+/**
+ * @brief Sets the size of a file. Blocks past the new size are released with
+ * a single update of the free bit map, and the rest of the last block is
+ * zeroed. Growing a file leaves a hole. The I-node is locked exclusively for
+ * the duration of the call.
+ * @param inode_idx I-node of the file
+ * @param len New size of the file on [0, FILE_SIZE_MAX]
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t file_truncate(int32_t inode_idx, int32_t len);
+
+// - Journal
+
+/**
+ * @brief Starts a journal handle. Metadata changed by the calling thread joins
+ * the running transaction until the handle ends. Handles nest, and must be
+ * started before any other lock is taken.
+ * @param j Pointer to the journal
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t journal_begin(journal_t *j);
+
+/**
+ * @brief Ends a journal handle. When the outermost handle ends, the call waits
+ * until the transaction holding its changes is committed. The last handle on a
+ * transaction commits it together with the changes of every other handle. In
+ * log-structured mode the commit is left to the cleaner of the log segment.
+ * @param j Pointer to the journal
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t journal_end(journal_t *j);
+
+/**
+ * @brief Commits the running transaction once the handles on it ended. The
+ * calling thread may not hold a handle.
+ * @param j Pointer to the journal
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t journal_sync(journal_t *j);
+
+/**
+ * @brief Makes room in the running transaction for another
+ * JOURNAL_HANDLE_BLOCKS blocks of the outermost handle of the calling thread,
+ * so that a handle may span many operations. If the transaction is full, then,
+ * the handle is ended and a new one is started, which commits the changes made
+ * so far.
+ * @param j Pointer to the journal
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t journal_extend(journal_t *j);
+
+/**
+ * @brief Writes a metadata block through the journal. A copy of the block is
+ * taken at once. Without a handle the write is a transaction of its own.
+ * @param j Pointer to the journal
+ * @param block Home location of the block
+ * @param data Contents of the block
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t journal_write(journal_t *j, int32_t block, const void *data);
+
+/**
+ * @brief Reads a metadata block, preferring images which are not yet at their
+ * home location.
+ * @param j Pointer to the journal
+ * @param block Home location of the block
+ * @param data Buffer for the contents of the block
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t journal_read(journal_t *j, int32_t block, void *data);
+
+/**
+ * @brief Revokes a freed block so that older images of it are neither
+ * checkpointed nor replayed over data later written to it.
+ * @param j Pointer to the journal
+ * @param block Freed block
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t journal_revoke(journal_t *j, int32_t block);
+
+/**
+ * @brief Writes the running transaction to the journal. The journal lock must
+ * be held, no handle may be open and no other commit may be in progress. The
+ * lock is released while the transaction is written.
+ * @param j Pointer to the journal
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t journal_commit(journal_t *j);
+
+/**
+ * @brief Writes committed images to their home locations and empties the
+ * journal.
+ * @param j Pointer to the journal
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t journal_checkpoint(journal_t *j);
+
+/**
+ * @brief Replays the committed transactions found in the journal and empties
+ * it. Called when a file system is mounted.
+ * @param j Pointer to the journal
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t journal_replay(journal_t *j);
+
+/**
+ * @brief Computes the checksum of a transaction.
+ * @param buf Descriptor followed by the block images
+ * @param size Size of the buffer
+ * @return Checksum of the buffer
+ */
+uint32_t journal_checksum(const char *buf, size_t size);
+
+/**
+ * @brief Initialises an empty journal and writes its header to disk.
+ * @param j Pointer to the journal
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t journal_init(journal_t *j);
+
+/**
+ * @brief Frees memory held by the journal.
+ * @param j Pointer to the journal
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t journal_release(journal_t *j);
+
+// - Log segment management
+
+/**
+ * @brief Sets up the log segment and starts the cleaner in log-structured
+ * mode.
+ * @param l Log segment
+ * @param enabled Non zero for log-structured mode
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t segment_init(segment_t *l, int enabled);
+
+/**
+ * @brief Stops the cleaner, commits a delayed transaction and writes the
+ * buffered blocks.
+ * @param l Log segment
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t segment_release(segment_t *l);
+
+/**
+ * @brief Allocates the next free block of the log.
+ * @param l Log segment
+ * @return Index of the block or MY_ERR otherwise
+ */
+int32_t segment_allocate(segment_t *l);
+
+/**
+ * @brief Delays the commit of the running transaction until the segment is
+ * full or SEGMENT_COMMIT_MS passed, and lets the cleaner write it then.
+ * @param l Log segment
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t segment_delay(segment_t *l);
+
+/**
+ * @brief Records the blocks of a file in the summary of the log. Nothing is
+ * recorded unless the file system is log-structured.
+ * @param l Log segment
+ * @param inode_idx I-node of the file
+ * @param block_list Blocks of the file
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t segment_summarize(segment_t *l, int32_t inode_idx,
+                          const int32_t *block_list);
+
+/**
+ * @brief Reads data blocks, which may still be buffered by the log segment.
+ * @param l Log segment
+ * @param block First block to read
+ * @param n Number of blocks to read
+ * @param buf Buffer of 'n' blocks
+ * @return Number of blocks read or MY_ERR otherwise
+ */
+int32_t segment_read(segment_t *l, int32_t block, int32_t n, void *buf);
+
+/**
+ * @brief Writes data blocks. In log-structured mode blocks which follow the
+ * buffered ones are added to the segment and written with it later.
+ * @param l Log segment
+ * @param block First block to write
+ * @param n Number of blocks to write
+ * @param buf Buffer of 'n' blocks
+ * @return Number of blocks written or MY_ERR otherwise
+ */
+int32_t segment_write(segment_t *l, int32_t block, int32_t n,
+                      const void *buf);
+
+/**
+ * @brief Writes the buffered blocks to disk. The lock of the segment has to be
+ * held. Every commit of the journal does this first, so data is on disk before
+ * the metadata referencing it.
+ * @param l Log segment
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t segment_flush(segment_t *l);
+
+/**
+ * @brief Moves the data blocks of a file which lie in a segment to the head
+ * of the log. Blocks shared with a snapshot are left in place.
+ * @param l Log segment
+ * @param inode_idx I-node of the file
+ * @param first First block of the segment
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t segment_relocate(segment_t *l, int32_t inode_idx, int32_t first);
+
+/**
+ * @brief Cleans the least used segments until SEGMENT_CLEAN_MIN segments are
+ * free or no segment is worth cleaning. Only the files the summary names as
+ * owners of the blocks of a segment are visited, except by the first cleaning
+ * after a mount, which visits every file to complete the summary.
+ * @param l Log segment
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t segment_clean(segment_t *l);
+
+/**
+ * @brief Cleaner thread. It runs 'segment_clean' whenever the log runs into
+ * taken blocks, and commits a delayed transaction when it is due.
+ * @param arg Log segment
+ * @return NULL
+ */
+void *segment_cleaner(void *arg);
+
+// - Asynchronous I/O engine
+
+/**
+ * @brief Accepts requests once the file system is mounted. Completions which
+ * were not reaped are kept.
+ * @param a I/O engine
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t aio_init(aio_t *a);
+
+/**
+ * @brief Starts the workers. The lock of the I/O engine is held by the
+ * caller.
+ * @param a I/O engine
+ * @return MY_OK is returned if at least one worker runs and MY_ERR otherwise
+ */
+int32_t aio_start(aio_t *a);
+
+/**
+ * @brief Runs the submitted requests to completion and stops the workers. A
+ * forked process, which has none of the workers, drops its requests instead.
+ * @param a I/O engine
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t aio_release(aio_t *a);
+
+/**
+ * @brief Queues a range of a file to be read into the block cache by a
+ * worker once no request is waiting. A range which starts within one already
+ * queued is dropped, as is any range once the queue is full, since the blocks
+ * are read when they are used anyway.
+ * @param a I/O engine
+ * @param inode_idx I-node of the file
+ * @param off Absolute position within the file
+ * @param len Length of the range
+ * @param ahead Non zero for a read ahead of a sequential reader
+ * @return MY_OK is returned on success and MY_ERR if no worker runs
+ */
+int32_t aio_prefetch(aio_t *a, int32_t inode_idx, int32_t off, int32_t len,
+                     int ahead);
+
+/**
+ * @brief Drops the queued reads ahead and waits for the ones being run, so
+ * that the tables of the file system may be reloaded.
+ * @param a I/O engine
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t aio_cancel(aio_t *a);
+
+/**
+ * @brief Worker thread. It runs the submitted requests one at a time and
+ * queues their completions, and reads ahead when no request is waiting.
+ * @param arg I/O engine
+ * @return NULL
+ */
+void *aio_worker(void *arg);
+
+// - Block cache
+
+/**
+ * @brief Empties the cache and allocates its slots. Pinned blocks stay valid
+ * until they are released.
+ * @param c Block cache
+ * @param capacity Number of slots on [1, NUM_BLOCKS]
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t bcache_init(bcache_t *c, int32_t capacity);
+
+/**
+ * @brief Empties the cache and frees its slots. The data of pinned blocks is
+ * freed once the last of them is released.
+ * @param c Block cache
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t bcache_release(bcache_t *c);
+
+/**
+ * @brief Gives the shard holding a block.
+ * @param c Block cache
+ * @param block Block
+ * @return Shard or NULL if the cache has no slots
+ */
+bcache_shard_t *bcache_shard(bcache_t *c, int32_t block);
+
+/**
+ * @brief Adds a slot or a ghost to a list of its shard. The shard is locked by
+ * the caller.
+ * @param c Block cache
+ * @param l List, one of BCACHE_*
+ * @param i Slot, or block for a ghost list
+ * @param tail Non zero to add it as the least recently used entry
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t bcache_link(bcache_t *c, int32_t l, int32_t i, int tail);
+
+/**
+ * @brief Removes a slot or a ghost from a list of its shard. The shard is
+ * locked by the caller.
+ * @param c Block cache
+ * @param l List holding the entry, one of BCACHE_*
+ * @param i Slot, or block for a ghost list
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t bcache_unlink(bcache_t *c, int32_t l, int32_t i);
+
+/**
+ * @brief Evicts the least recently used block which is not pinned, from T1
+ * when it is over its target size and from T2 otherwise. The slots passed
+ * which were used since are moved first, from T1 to T2 once used again and
+ * within T2 once used. The block becomes a ghost. The shard is locked by the
+ * caller.
+ * @param c Block cache
+ * @param h Shard
+ * @param b2 Non zero when the new block is a ghost of T2
+ * @return Slot freed or ENTRY_INVALID if every block is pinned
+ */
+int32_t bcache_replace(bcache_t *c, bcache_shard_t *h, int b2);
+
+/**
+ * @brief Gives a slot for a block missing from the cache. A ghost of the
+ * block adapts the target size of T1, and the ghost lists are trimmed to
+ * keep the history bounded. The shard is locked by the caller.
+ * @param c Block cache
+ * @param h Shard of the block
+ * @param block Block, or ENTRY_INVALID for a copy which is detached
+ * @param flags BCACHE_AHEAD for a block read ahead, which adapts nothing
+ * @return Slot, which is in no list, or ENTRY_INVALID if none is free
+ */
+int32_t bcache_slot(bcache_t *c, bcache_shard_t *h, int32_t block,
+                    int flags);
+
+/**
+ * @brief Records a use of a cached block in its references, without moving
+ * it. A block of T1 used again is moved to T2 by the next replacement, unless
+ * the uses follow each other as with small sequential reads. The shard is
+ * locked by the caller.
+ * @param c Block cache
+ * @param s Slot
+ * @param flags BCACHE_COLD to drop the references so that the block is reused
+ * once the replacement reaches it and BCACHE_AHEAD for a read ahead, which is
+ * not a use
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t bcache_touch(bcache_t *c, int32_t s, int flags);
+
+/**
+ * @brief Gives the generation of the cache, which is taken before reading
+ * blocks from the disk to insert them.
+ * @param c Block cache
+ * @return Generation of the cache
+ */
+uint32_t bcache_gen(bcache_t *c);
+
+/**
+ * @brief Pins a block if it is cached.
+ * @param c Block cache
+ * @param block Block
+ * @param flags BCACHE_COLD to make the block reused first and BCACHE_AHEAD
+ * for a read ahead, which is not a use
+ * @return Data of the block or NULL if it is not cached
+ */
+const char *bcache_get(bcache_t *c, int32_t block, int flags);
+
+/**
+ * @brief Inserts a copy of a block read from the disk. Blocks written since
+ * the generation was taken may be stale and are kept out of the cache.
+ * @param c Block cache
+ * @param block Block
+ * @param data Data of the block
+ * @param gen Generation taken before reading the block
+ * @param flags BCACHE_PIN to pin the block, even if it is kept out of the
+ * cache, BCACHE_COLD to make it the first one to be reused and BCACHE_AHEAD
+ * for a block read ahead
+ * @return Data of the pinned block or NULL otherwise
+ */
+const char *bcache_insert(bcache_t *c, int32_t block, const char *data,
+                          uint32_t gen, int flags);
+
+/**
+ * @brief Pins a block, which is read from the disk if it is not cached.
+ * @param c Block cache
+ * @param block Block
+ * @return Data of the block or NULL if no slot is free
+ */
+const char *bcache_load(bcache_t *c, int32_t block);
+
+/**
+ * @brief Releases a pinned block. Only a detached block, which is freed by
+ * its last user, takes a lock.
+ * @param c Block cache
+ * @param data Data of the block given by the cache
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t bcache_put(bcache_t *c, const char *data);
+
+/**
+ * @brief Drops blocks which were written from the cache.
+ * @param c Block cache
+ * @param block First block
+ * @param n Number of blocks
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t bcache_invalidate(bcache_t *c, int32_t block, int32_t n);
+
+/**
+ * @brief Lists the cached blocks, the ones used often first and the most
+ * recently added first within them, taking a block of each shard in turn.
+ * @param c Block cache
+ * @param hot Filled with at most HOT_BLOCKS_MAX blocks
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t bcache_save(bcache_t *c, hot_table_t *hot);
+
+// - Free space summary
+
+/**
+ * @brief Counts the free blocks and I-nodes. Every I-node block is read.
+ * @param s Free space summary
+ * @param t Pointer to the I-node table
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t space_count(space_t *s, inode_table_t *t);
+
+// - Cache warm start
+
+/**
+ * @brief Starts loading the I-node and directory blocks and reading the blocks
+ * of a hot block list into the cache. Blocks which are free by now are
+ * skipped.
+ * @param w Warm start reader
+ * @param hot Hot block list
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t warm_start(warm_t *w, const hot_table_t *hot);
+
+/**
+ * @brief Stops reading blocks and waits for the thread to be done. The thread
+ * is detached, so a process which exits while still mounted leaves nothing
+ * to join. A child process forgets the thread of its parent.
+ * @param w Warm start reader
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t warm_stop(warm_t *w);
+
+/**
+ * @brief Stops the background reads before a fork, so that the child does
+ * not inherit a lock held by the thread, including the reads ahead.
+ */
+void warm_fork(void);
+
+/**
+ * @brief Thread reading the blocks, with one disk call per run of blocks
+ * which follow each other.
+ * @param arg Warm start reader
+ * @return NULL
+ */
+void *warm_worker(void *arg);
+
+// - Snapshot management
+
+/**
+ * @brief Finds a snapshot by the number returned by 'ssfs_commit'.
+ * @param cnum Number of the snapshot
+ * @return Index of the snapshot in the super-block or MY_ERR otherwise
+ */
+int32_t snapshot_find(int cnum);
+
+/**
+ * @brief Deletes a snapshot and frees its root and the blocks that neither the
+ * file system nor another snapshot references. These are found in the epoch
+ * map alone, as they were released after the snapshot and no later than the
+ * next one, and allocated after the previous one.
+ * @param k Index of the snapshot in the super-block
+ * @return MY_OK is returned on success and MY_ERR otherwise
+ */
+int32_t snapshot_drop(int32_t k);
+
+// - ssfs
+
+/**
+ * @brief Creates a new file system or opens an existing one. It must not run
+ * concurrently with any other call, while every other 'ssfs' call is safe to
+ * use from several threads. A file system which was not unmounted is checked
+ * when it is opened, while one which was trusts the counts saved in its
+ * super-block.
+ * @param fresh If 'fresh' is non zero, then a new file system is created.
+ * Otherwise, an existing one is opened.
+ */
+void mkssfs(int fresh);
+
+/**
+ * @brief Creates a new file system or opens an existing one with options.
+ * @param fresh If 'fresh' is non zero, then a new file system is created.
+ * Otherwise, an existing one is opened.
+ * @param flags Zero or SSFS_MOUNT_LOG to append every data write to a log,
+ * combined with SSFS_MOUNT_CACHE to cap the block cache. The cache holds
+ * BCACHE_BLOCKS blocks by default. In log-structured mode a crash loses the
+ * calls made in the last SEGMENT_COMMIT_MS.
+ */
+void mkssfs_ex(int fresh, int flags);
+
+/**
+ * @brief Unmounts the file system. Open files are closed and the blocks in
+ * the cache are recorded so that the next mount reads them ahead. The free
+ * space is saved and the file system is marked clean before the disk is
+ * closed. It must not run concurrently with any other call, and only
+ * 'mkssfs' may follow it.
+ * @return -1 on error or 0 on success
+ */
+int ssfs_unmount(void);
+
+/**
+ * @brief Opens a file specified by 'name'. If a file exists, then, it is opened
+ * in append mode. Otherwise, a new file is created if there is a free entry in
+ * the directory table. Every call returns a new file handle with its own read
+ * and write pointers, even if the file is already open.
+ * @param name File name
+ * @return -1 on error or a file handle on success
+ */
+int ssfs_fopen(char *name);
+
+/**
+ * @brief Closes a file and frees a space in the file descriptor table. If the
+ * file was removed while open, then, its blocks are freed by the last close.
+ * @param fileID File handle given by a call to 'ssfs_fopen'
+ * @return -1 on error or 0 on success
+ */
+int ssfs_fclose(int fileID);
+
+/**
+ * @brief Repositions the read pointer.
+ * @param fileID File handle given by a call to 'ssfs_fopen'
+ * @param loc Absolute position within the file on [0, size]
+ * @return -1 on error or 0 on success
+ */
+int ssfs_frseek(int fileID, int loc);
+
+/**
+ * @brief Repositions the write pointer. Writing past the end of the file
+ * leaves a hole which reads as zeros and takes no blocks.
+ * @param fileID File handle given by a call to 'ssfs_fopen'
+ * @param loc Absolute position within the file on [0, FILE_SIZE_MAX]
+ * @return -1 on error or 0 on success
+ */
+int ssfs_fwseek(int fileID, int loc);
 
 /**
  * @brief Writes a given amount of data to the file.
@@ -428,12 +2053,254 @@ int ssfs_fwrite(int fileID, char *buf, int length);
 int ssfs_fread(int fileID, char *buf, int length);
 
 /**
- * @brief Removes a file from the file system.
+ * @brief Writes a given amount of data to the file at a given position. The
+ * read and write pointers are left untouched.
+ * @param fileID File handle given by a call to 'ssfs_fopen'
+ * @param buf Pointer to the data to write
+ * @param length Length of the data to write
+ * @param offset Absolute position within the file on [0, FILE_SIZE_MAX]. A
+ * position past the end of the file leaves a hole.
+ * @return Number of bytes written or -1 on error. If all data cannot be
+ * written, then, the data that could fit is written and -1 is returned.
+ */
+int ssfs_pwrite(int fileID, const char *buf, int length, int offset);
+
+/**
+ * @brief Reads a given amount of data from the file at a given position. The
+ * read and write pointers are left untouched.
+ * @param fileID File handle given by a call to 'ssfs_fopen'
+ * @param buf Pointer to the data to read
+ * @param length Length of the data to read
+ * @param offset Absolute position within the file on [0, size)
+ * @return Number of bytes read or -1 on error.
+ */
+int ssfs_pread(int fileID, char *buf, int length, int offset);
+
+/**
+ * @brief Writes data gathered from a list of buffers to the file at a given
+ * position. The read and write pointers are left untouched.
+ * @param fileID File handle given by a call to 'ssfs_fopen'
+ * @param iov List of buffers to write
+ * @param iovcnt Number of buffers
+ * @param offset Absolute position within the file on [0, FILE_SIZE_MAX]. A
+ * position past the end of the file leaves a hole.
+ * @return Number of bytes written or -1 on error. If all data cannot be
+ * written, then, the data that could fit is written and -1 is returned.
+ */
+int ssfs_pwritev(int fileID, const struct iovec *iov, int iovcnt, int offset);
+
+/**
+ * @brief Reads data from the file at a given position and scatters it to a
+ * list of buffers. The read and write pointers are left untouched.
+ * @param fileID File handle given by a call to 'ssfs_fopen'
+ * @param iov List of buffers to fill
+ * @param iovcnt Number of buffers
+ * @param offset Absolute position within the file on [0, size)
+ * @return Number of bytes read or -1 on error.
+ */
+int ssfs_preadv(int fileID, const struct iovec *iov, int iovcnt, int offset);
+
+/**
+ * @brief Describes how the file is going to be read. SSFS_FADV_SEQUENTIAL,
+ * SSFS_FADV_RANDOM and SSFS_FADV_NOREUSE replace the access pattern of the
+ * file handle for every later read, whatever the range. SSFS_FADV_WILLNEED
+ * queues the range to be read into the block cache in the background and
+ * SSFS_FADV_DONTNEED drops it.
+ * @param fileID File handle given by a call to 'ssfs_fopen'
+ * @param offset Absolute position within the file
+ * @param length Length of the range
+ * @param advice Combination of SSFS_FADV_* or SSFS_FADV_NORMAL to go back to
+ * the default access pattern
+ * @return -1 on error or 0 on success
+ */
+int ssfs_fadvise(int fileID, int offset, int length, int advice);
+
+/**
+ * @brief Gives statistics of the block cache.
+ * @param stats Filled with the statistics
+ * @return -1 on error or 0 on success
+ */
+int ssfs_cache_stats(ssfs_cache_stats_t *stats);
+
+/**
+ * @brief Gives the free space of the file system.
+ * @param stats Filled with the free space
+ * @return -1 on error or 0 on success
+ */
+int ssfs_space_stats(ssfs_space_stats_t *stats);
+
+/**
+ * @brief Gives a range of the file without copying it. The pieces of the view
+ * point to blocks pinned in the cache, which keep the data they had when the
+ * view was taken until 'ssfs_release_view' is called.
+ * @param fileID File handle given by a call to 'ssfs_fopen'
+ * @param offset Absolute position within the file on [0, size)
+ * @param length Length of the range, which is cut at the end of the file
+ * @param view View filled with the pieces of the range
+ * @return Number of bytes covered or -1 on error
+ */
+int ssfs_read_view(int fileID, int offset, int length, ssfs_view_t *view);
+
+/**
+ * @brief Releases the blocks pinned by a view.
+ * @param view View given by 'ssfs_read_view'
+ * @return -1 on error or 0 on success
+ */
+int ssfs_release_view(ssfs_view_t *view);
+
+/**
+ * @brief Removes a file from the file system. The name is removed at once,
+ * but the blocks of a file that is still open are only freed by the last call
+ * to 'ssfs_fclose' on it.
  * @param file Name of the file to be removed
  * @return -1 on error or 0 on success
  */
 int ssfs_remove(char *file);
 
+/**
+ * @brief Creates a file 'dst' holding the data of the file 'src'. Both files
+ * share the data blocks, which are copied when either file writes them.
+ * @param src Name of the file to clone
+ * @param dst Name of the new file, which must not exist
+ * @return -1 on error or 0 on success
+ */
+int ssfs_clone(char *src, char *dst);
+
+/**
+ * @brief Copies data from one file to another without passing it through
+ * the caller. Whole blocks are shared instead of copied when both positions
+ * are equally aligned to blocks. The read and write pointers are left
+ * untouched.
+ * @param fd_in File handle of the source given by a call to 'ssfs_fopen'
+ * @param off_in Absolute position within the source on [0, size)
+ * @param fd_out File handle of the destination given by a call to 'ssfs_fopen'
+ * @param off_out Absolute position within the destination, where a position
+ * past its end leaves a hole
+ * @param len Number of bytes to copy
+ * @return Number of bytes copied, which is smaller than 'len' at the end of
+ * the source or if the disk is full, or -1 on error
+ */
+int ssfs_copy_range(int fd_in, int off_in, int fd_out, int off_out, int len);
+
+/**
+ * @brief Reserves the blocks of a range of the file up front, as one
+ * contiguous run where the disk allows. Writes within the range then need no
+ * allocation. The size of the file and the read and write pointers are left
+ * untouched.
+ * @param fileID File handle given by a call to 'ssfs_fopen'
+ * @param offset Absolute position within the file
+ * @param length Length of the range
+ * @return -1 on error or 0 on success
+ */
+int ssfs_fallocate(int fileID, int offset, int length);
+
+/**
+ * @brief Shrinks or extends the file to a given size. The blocks past the new
+ * size are freed and an extended file reads as zeros. The read and write
+ * pointers are left untouched.
+ * @param fileID File handle given by a call to 'ssfs_fopen'
+ * @param length New size of the file on [0, FILE_SIZE_MAX]
+ * @return -1 on error or 0 on success
+ */
+int ssfs_ftruncate(int fileID, int length);
+
+/**
+ * @brief Gives the size of the file.
+ * @param fileID File handle given by a call to 'ssfs_fopen'
+ * @return Size of the file or -1 on error
+ */
+int ssfs_fsize(int fileID);
+
+/**
+ * @brief Stores a whole object under a name, replacing the previous contents
+ * of the file or creating it. Lookup, allocation, data and metadata are all
+ * handled by one call which flushes its metadata at once and takes no file
+ * handle.
+ * @param name Name of the file
+ * @param buf Pointer to the data of the object
+ * @param length Length of the object on [0, FILE_SIZE_MAX]
+ * @return Number of bytes written or -1 on error. If all data cannot be
+ * written, then, the data that could fit is written and -1 is returned.
+ */
+int ssfs_put(char *name, const char *buf, int length);
+
+/**
+ * @brief Reads a whole object stored under a name without taking a file
+ * handle.
+ * @param name Name of the file
+ * @param buf Pointer to the buffer receiving the object
+ * @param length Capacity of the buffer
+ * @return Number of bytes read, which is smaller than the object if the
+ * buffer is, or -1 on error
+ */
+int ssfs_get(char *name, char *buf, int length);
+
+/**
+ * @brief Applies a list of operations in order. They share journal
+ * transactions, so every metadata block they change is written once per
+ * transaction rather than once per operation. Each operation reports its
+ * result as the single call would: 0 or -1 for creates and removes, and the
+ * number of bytes written or -1 for writes.
+ * @param ops List of operations
+ * @param num Number of operations
+ * @return Number of operations which succeeded or -1 on error
+ */
+int ssfs_batch(ssfs_op_t *ops, int num);
+
+/**
+ * @brief Creates many files at once through 'ssfs_batch'. Files which
+ * already exist are left as they are.
+ * @param names List of names
+ * @param num Number of names
+ * @return Number of files created or found or -1 on error
+ */
+int ssfs_create_many(char **names, int num);
+
+/**
+ * @brief Removes many files at once through 'ssfs_batch'.
+ * @param names List of names
+ * @param num Number of names
+ * @return Number of files removed or -1 on error
+ */
+int ssfs_remove_many(char **names, int num);
+
+/**
+ * @brief Submits requests to the I/O engine without waiting for them. Up to
+ * AIO_QUEUE_MAX requests may be submitted and not reaped at any time. The
+ * buffers have to stay valid until the requests are reaped.
+ * @param sqes List of requests
+ * @param num Number of requests
+ * @return Number of requests accepted, which is less than 'num' when the
+ * queue is full, or -1 on error
+ */
+int ssfs_submit(const ssfs_sqe_t *sqes, int num);
+
+/**
+ * @brief Takes the completions of finished requests without waiting for the
+ * others. Requests complete in any order.
+ * @param cqes Room for the completions
+ * @param max Maximum number of completions to take
+ * @return Number of completions taken or -1 on error
+ */
+int ssfs_reap(ssfs_cqe_t *cqes, int max);
+
 // - Bonus
+
+/**
+ * @brief Takes a snapshot of the file system. Blocks are shared with the
+ * snapshot and copied on the next write, so this costs a single block. When
+ * SNAPSHOTS_MAX snapshots exist, then, the oldest one is deleted first, which
+ * only reads the epoch map. This must not run concurrently with other calls.
+ * @return -1 on error or the number of the snapshot on success
+ */
 int ssfs_commit(void);
+
+/**
+ * @brief Restores the file system to a snapshot. The snapshots taken after it
+ * are deleted and every open file handle is closed. The tables are found from
+ * the root of the snapshot and the epoch map, so no I-node is read. This must
+ * not run concurrently with other calls.
+ * @param cnum Number of the snapshot given by a call to 'ssfs_commit'
+ * @return -1 on error or 0 on success
+ */
 int ssfs_restore(int cnum);
@@ -1,28 +1,54 @@
 #include <disk_emu.h>
+#include <pthread.h>
 #include <stdio.h>
 
 static FILE *fp = NULL;
 static i64 BLOCK_SIZE = 0;
 static i64 MAX_BLOCK = 0;
 
-i64 close_disk(void) { return vl_close_disk(fp); }
+// - Seeking and transferring must happen as one step on the shared stream
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+i64 close_disk(void) {
+  pthread_mutex_lock(&disk_lock);
+  i64 r = vl_close_disk(fp);
+  pthread_mutex_unlock(&disk_lock);
+
+  return r;
+}
 
 i64 init_fresh_disk(char *filename, i64 block_size, i64 num_blocks) {
-  return vl_init_fresh_disk(&fp, filename, block_size, num_blocks, &BLOCK_SIZE,
-                            &MAX_BLOCK);
+  pthread_mutex_lock(&disk_lock);
+  i64 r = vl_init_fresh_disk(&fp, filename, block_size, num_blocks,
+                             &BLOCK_SIZE, &MAX_BLOCK);
+  pthread_mutex_unlock(&disk_lock);
+
+  return r;
 }
 
 i64 init_disk(char *filename, i64 block_size, i64 num_blocks) {
-  return vl_init_disk(&fp, filename, block_size, num_blocks, &BLOCK_SIZE,
-                      &MAX_BLOCK);
+  pthread_mutex_lock(&disk_lock);
+  i64 r = vl_init_disk(&fp, filename, block_size, num_blocks, &BLOCK_SIZE,
+                       &MAX_BLOCK);
+  pthread_mutex_unlock(&disk_lock);
+
+  return r;
 }
 
 i64 read_blocks(i64 start_address, i64 nblocks, void *buffer) {
-  return vl_read_blocks(fp, start_address, nblocks, BLOCK_SIZE, MAX_BLOCK,
-                        buffer);
+  pthread_mutex_lock(&disk_lock);
+  i64 r = vl_read_blocks(fp, start_address, nblocks, BLOCK_SIZE, MAX_BLOCK,
+                         buffer);
+  pthread_mutex_unlock(&disk_lock);
+
+  return r;
 }
 
 i64 write_blocks(i64 start_address, i64 nblocks, const void *buffer) {
-  return vl_write_blocks(fp, start_address, nblocks, BLOCK_SIZE, MAX_BLOCK,
-                         buffer);
+  pthread_mutex_lock(&disk_lock);
+  i64 r = vl_write_blocks(fp, start_address, nblocks, BLOCK_SIZE, MAX_BLOCK,
+                          buffer);
+  pthread_mutex_unlock(&disk_lock);
+
+  return r;
 }
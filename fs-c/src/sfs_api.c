@@ -3,9 +3,44 @@
 // - File system cached state
 static super_block_t sb;
 static fbm_table_t fbm_table;
-static dir_entry_t dir_table[MAX_FILES];
-static inode_t inode_table[MAX_FILES];
-static file_entry_t file_entry_table[MAX_OPEN_FILES];
+static epoch_map_t epoch_map;
+static rc_table_t rc_table;
+static dir_table_t dir_table;
+static inode_table_t inode_table;
+static file_entry_table_t file_entry_table;
+static journal_t journal = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                            .cond = PTHREAD_COND_INITIALIZER};
+static segment_t segment = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                             .clean_lock = PTHREAD_MUTEX_INITIALIZER,
+                             .cond = PTHREAD_COND_INITIALIZER};
+static aio_t aio = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                    .cond = PTHREAD_COND_INITIALIZER};
+static bcache_t bcache = {.lock = PTHREAD_MUTEX_INITIALIZER};
+static warm_t warm = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                      .cond = PTHREAD_COND_INITIALIZER};
+static space_t space;
+static const char zero_block[BLOCK_SIZE];
+static int mounted = 0;
+static int opened = 0;
+
+// - Journal handle of the calling thread
+static _Thread_local uint32_t journal_depth = 0;
+static _Thread_local int journal_dirtied = 0;
+
+// - Locks guarding the cached state. When several are held, they are taken in
+// the following order: file descriptor entry, directory, I-node, I-node table,
+// I-node block, free bit map, super-block, table loading, journal, log segment
+// and finally the disk. A journal handle is started before any of them and
+// ended after all of them, while the cleaner of the log takes its lock before
+// the handle. The locks of the I/O engine and of the block cache are never
+// held with any other, except for the shards of the cache, which are taken in
+// order after the lock of the cache.
+static pthread_rwlock_t dir_lock = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_mutex_t inode_table_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t fbm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t sb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t fdt_table_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // - Super block management
 
@@ -19,7 +54,7 @@ int32_t sb_read(super_block_t *sb_) {
     return MY_ERR;
   }
 
-  if (read_blocks(SB_BLOCK, SB_BLOCK_NUM, mem) != SB_BLOCK_NUM) {
+  if (journal_read(&journal, SB_BLOCK, mem) == MY_ERR) {
     free(mem);
     return MY_ERR;
   }
@@ -38,8 +73,7 @@ int32_t sb_update(const super_block_t sb_) {
 
   memcpy(mem, &sb, sizeof(sb_));
 
-  if (write_blocks(sb_.sb_block_idx, sb_.sb_block_num, mem) !=
-      sb_.sb_block_num) {
+  if (journal_write(&journal, sb_.sb_block_idx, mem) == MY_ERR) {
     free(mem);
     return MY_ERR;
   }
@@ -56,14 +90,57 @@ int32_t sb_init(super_block_t *sb_) {
   sb_->magic = MAGIC;
   sb_->blocks = NUM_BLOCKS;
   sb_->blocks_size = BLOCK_SIZE;
-  sb_->dir_block_idx = DIR_BLOCK;
-  sb_->dir_block_num = DIR_BLOCK_NUM;
+  sb_->dir_block_num = 0;
+  sb_->em_block_idx = EM_BLOCK;
+  sb_->em_block_num = EM_BLOCK_NUM;
+  sb_->rc_block_idx = RC_BLOCK;
+  sb_->rc_block_num = RC_BLOCK_NUM;
+  sb_->hot_block_idx = HOT_BLOCK;
+  sb_->hot_block_num = HOT_BLOCK_NUM;
+  sb_->epoch = 1;
   sb_->fbm_block_idx = FBM_BLOCK;
   sb_->fbm_block_num = FBM_BLOCK_NUM;
-  sb_->inode_block_idx = INODE_BLOCK;
-  sb_->inode_block_num = INODE_BLOCK_NUM;
+  sb_->inode_block_num = 0;
+  sb_->journal_block_idx = JOURNAL_BLOCK;
+  sb_->journal_block_num = JOURNAL_BLOCK_NUM;
   sb_->sb_block_idx = SB_BLOCK;
   sb_->sb_block_num = SB_BLOCK_NUM;
+  sb_->snapshot_num = 0;
+  sb_->clean = 0;
+  sb_->free_blocks = 0;
+  sb_->free_inodes = 0;
+
+  for (size_t i = 0; i < DIR_BLOCKS_MAX; i++) {
+    sb_->dir_blocks[i] = ENTRY_INVALID;
+  }
+
+  for (size_t i = 0; i < INODE_BLOCKS_MAX; i++) {
+    sb_->inode_blocks[i] = ENTRY_INVALID;
+  }
+
+  for (int32_t i = 0; i < RC_BLOCKS_MAX; i++) {
+    sb_->rc_blocks[i] = sb_->rc_block_idx + i;
+  }
+
+  for (size_t i = 0; i < SNAPSHOTS_MAX; i++) {
+    sb_->snapshots[i].root = ENTRY_INVALID;
+    sb_->snapshots[i].epoch = 0;
+  }
+
+  return MY_OK;
+}
+
+int32_t sb_check(const super_block_t *sb_) {
+  if (sb_ == NULL || sb_->magic != MAGIC || sb_->blocks != NUM_BLOCKS ||
+      sb_->blocks_size != BLOCK_SIZE ||
+      sb_->journal_block_num != JOURNAL_BLOCK_NUM) {
+    return MY_ERR;
+  }
+
+  if (sb_->inode_block_num < 0 || sb_->inode_block_num > INODE_BLOCKS_MAX ||
+      sb_->dir_block_num < 0 || sb_->dir_block_num > DIR_BLOCKS_MAX) {
+    return MY_ERR;
+  }
 
   return MY_OK;
 }
@@ -80,8 +157,7 @@ int32_t fbm_read(fbm_table_t *fbm_table_) {
     return MY_ERR;
   }
 
-  if (read_blocks(sb.fbm_block_idx, sb.fbm_block_num, mem) !=
-      sb.fbm_block_num) {
+  if (journal_read(&journal, sb.fbm_block_idx, mem) == MY_ERR) {
     free(mem);
     return MY_ERR;
   }
@@ -100,8 +176,7 @@ int32_t fbm_update(const fbm_table_t fbm_table_) {
 
   memcpy(mem, &fbm_table, sizeof(fbm_table_));
 
-  if (write_blocks(sb.fbm_block_idx, sb.fbm_block_num, mem) !=
-      sb.fbm_block_num) {
+  if (journal_write(&journal, sb.fbm_block_idx, mem) == MY_ERR) {
     free(mem);
     return MY_ERR;
   }
@@ -122,706 +197,5482 @@ int32_t fbm_init(fbm_table_t *fbm_table_) {
   return MY_OK;
 }
 
-// - Block management (updates the free bit map table)
+// - Epoch map management
 
-int32_t block_allocate(fbm_table_t *fbm_table_, int32_t idx) {
-  if (fbm_table_ == NULL) {
+int32_t em_read(epoch_map_t *em) {
+  if (em == NULL) {
     return MY_ERR;
   }
 
-  if (idx >= 0 && (uint32_t)idx < sb.blocks &&
-      fbm_table_->block[idx] == ENTRY_FREE) {
-    fbm_table_->block[idx] = ENTRY_TAKEN;
-    if (fbm_update(*fbm_table_) == MY_ERR) {
+  for (int32_t i = 0; i < sb.em_block_num; i++) {
+    if (journal_read(&journal, sb.em_block_idx + i,
+                     (char *)em + i * BLOCK_SIZE) == MY_ERR) {
       return MY_ERR;
     }
+  }
 
-    return idx;
+  return MY_OK;
+}
+
+int32_t em_update(const epoch_map_t *em, int32_t idx) {
+  if (em == NULL || (idx != ENTRY_INVALID && (idx < 0 || idx >= NUM_BLOCKS))) {
+    return MY_ERR;
   }
 
-  int32_t r = 0;
-  for (size_t i = 0; i < sb.blocks; i++) {
-    if (fbm_table_->block[i] == ENTRY_FREE) {
-      fbm_table_->block[i] = ENTRY_TAKEN;
-      // TODO(vl): Add an assert
-      r = (int32_t)i;
-      break;
+  int32_t per_block = BLOCK_SIZE / (int32_t)sizeof(em->block[0]);
+  for (int32_t i = 0; i < sb.em_block_num; i++) {
+    if (idx != ENTRY_INVALID && i != idx / per_block) {
+      continue;
     }
-  }
 
-  if (r > 0) {
-    if (fbm_update(*fbm_table_) == MY_ERR) {
+    if (journal_write(&journal, sb.em_block_idx + i,
+                      (const char *)em + i * BLOCK_SIZE) == MY_ERR) {
       return MY_ERR;
     }
   }
 
-  return r;
+  return MY_OK;
 }
 
-int32_t block_deallocate(fbm_table_t *fbm_table_, int32_t idx) {
-  if (fbm_table_ == NULL || idx < 0) {
+int32_t em_init(epoch_map_t *em) {
+  if (em == NULL) {
     return MY_ERR;
   }
 
-  if ((uint32_t)idx < sb.blocks) {
-    if (fbm_table_->block[idx] == ENTRY_TAKEN) {
-      fbm_table_->block[idx] = ENTRY_FREE;
-
-      if (fbm_update(*fbm_table_) == MY_ERR) {
-        return MY_ERR;
-      }
-    }
-  }
+  memset(em, 0, sizeof(epoch_map_t));
 
   return MY_OK;
 }
 
-// - Directory management
-
-int32_t dir_find(dir_entry_t *d, uint32_t size, const char *name) {
-  assert(size == MAX_FILES);
+// - Reference count management
 
-  if (d == NULL || name == NULL) {
+int32_t rc_read(rc_table_t *rc) {
+  if (rc == NULL) {
     return MY_ERR;
   }
 
-  int32_t r = MY_ERR;
-  for (size_t i = 0; i < size; i++) {
-    if (d[i].free == ENTRY_TAKEN && strncmp(d[i].fn, name, MAX_FN_LEN) == 0) {
-      // TODO(vl): Add an assert for the cast
-      r = (int32_t)i;
-      break;
+  for (int32_t i = 0; i < sb.rc_block_num; i++) {
+    if (journal_read(&journal, sb.rc_blocks[i], (char *)rc + i * BLOCK_SIZE) ==
+        MY_ERR) {
+      return MY_ERR;
     }
   }
 
-  return r;
+  return MY_OK;
 }
 
-int32_t dir_remove(dir_entry_t *d, uint32_t size, const char *name) {
-  assert(size == MAX_FILES);
-
-  int32_t r = dir_find(d, size, name);
-  if (r != MY_ERR && r >= 0) {
-    d[r].free = ENTRY_FREE;
-    d[r].linked_inode = ENTRY_INVALID;
-    memset(d[r].fn, 0, MAX_FN_LEN);
+int32_t rc_update(const rc_table_t *rc, int32_t idx) {
+  if (rc == NULL || (idx != ENTRY_INVALID && (idx < 0 || idx >= NUM_BLOCKS))) {
+    return MY_ERR;
   }
 
-  return r;
-}
+  int32_t per_block = BLOCK_SIZE / (int32_t)sizeof(rc->count[0]);
+  for (int32_t i = 0; i < sb.rc_block_num; i++) {
+    if (idx != ENTRY_INVALID && i != idx / per_block) {
+      continue;
+    }
 
-int32_t dir_add(dir_entry_t *d, uint32_t size, const char *name,
-                uint32_t node) {
-  assert(size == MAX_FILES);
+    // - The table is restored with a snapshot, so it is copied like the
+    // directory and the old block is released to the snapshot
+    int32_t block = sb.rc_blocks[i];
+    if (block_shared(block)) {
+      block = block_take(&fbm_table, block);
+      if (block == MY_ERR) {
+        return MY_ERR;
+      }
 
-  int32_t r = MY_ERR;
-  for (size_t i = 0; i < size; i++) {
-    if (d[i].free == ENTRY_FREE) {
-      d[i].free = ENTRY_TAKEN;
-      d[i].linked_inode = (int32_t)node;
-      strncpy(d[i].fn, name, MAX_FN_LEN);
-      d[i].fn[MAX_FN_LEN - 1] = '\0';
-      r = MY_OK;
+      epoch_map.block[sb.rc_blocks[i]].death = sb.epoch;
+      if (em_update(&epoch_map, sb.rc_blocks[i]) == MY_ERR) {
+        return MY_ERR;
+      }
 
-      break;
+      assert(pthread_mutex_lock(&sb_lock) == 0);
+      sb.rc_blocks[i] = block;
+      int32_t u = sb_update(sb);
+      assert(pthread_mutex_unlock(&sb_lock) == 0);
+
+      if (u == MY_ERR) {
+        return MY_ERR;
+      }
+    }
+
+    if (journal_write(&journal, block, (const char *)rc + i * BLOCK_SIZE) ==
+        MY_ERR) {
+      return MY_ERR;
     }
   }
 
-  return r;
+  return MY_OK;
 }
 
-int32_t dir_read(dir_entry_t *d, uint32_t size) {
-  assert(size == MAX_FILES);
-
-  if (d == NULL ||
-      read_blocks(sb.dir_block_idx, sb.dir_block_num, d) != sb.dir_block_num) {
+int32_t rc_init(rc_table_t *rc) {
+  if (rc == NULL) {
     return MY_ERR;
   }
 
+  memset(rc, 0, sizeof(rc_table_t));
+
   return MY_OK;
 }
 
-int32_t dir_update(const dir_entry_t *d, uint32_t size) {
-  assert(size == MAX_FILES);
+// - Hot block list management
 
-  if (d == NULL ||
-      write_blocks(sb.dir_block_idx, sb.dir_block_num, d) != sb.dir_block_num) {
+int32_t hot_read(hot_table_t *hot) {
+  if (hot == NULL) {
     return MY_ERR;
   }
 
-  return MY_OK;
-}
-
-int32_t dir_init(dir_entry_t *d, uint32_t size) {
-  assert(size == MAX_FILES);
+  hot->num = 0;
+  hot->frequent = 0;
+  if (sb.hot_block_num == 0) {
+    return MY_OK;
+  }
 
-  if (d == NULL) {
+  if (journal_read(&journal, sb.hot_block_idx, hot) == MY_ERR) {
     return MY_ERR;
   }
 
-  for (size_t i = 0; i < size; i++) {
-    d[i].free = ENTRY_FREE;
-    d[i].linked_inode = ENTRY_INVALID;
-    memset(d[i].fn, 0, MAX_FN_LEN);
+  // - The list is only a hint, so a damaged one is dropped
+  if (hot->num < 0 || hot->num > HOT_BLOCKS_MAX || hot->frequent < 0 ||
+      hot->frequent > hot->num) {
+    hot->num = 0;
+    hot->frequent = 0;
   }
 
   return MY_OK;
 }
 
-// - File descriptor management
-
-int32_t fdt_remove(file_entry_t *f, uint32_t size, int fd) {
-  if (f == NULL) {
+int32_t hot_update(const hot_table_t *hot) {
+  if (hot == NULL) {
     return MY_ERR;
   }
 
-  int32_t r = MY_ERR;
-  if (fd >= 0 && (uint32_t)fd < size) {
-    if (f[fd].free == ENTRY_FREE) {
-      return MY_ERR;
-    }
+  if (sb.hot_block_num == 0) {
+    return MY_OK;
+  }
 
-    f[fd].free = ENTRY_FREE;
-    f[fd].linked_inode = ENTRY_INVALID;
-    f[fd].ptr_read = 0;
-    f[fd].ptr_write = 0;
-    r = MY_OK;
+  return journal_write(&journal, sb.hot_block_idx, hot);
+}
+
+// - Block management (updates the free bit map table)
+
+int32_t block_allocate(fbm_table_t *fbm_table_, int32_t idx) {
+  if (fbm_table_ == NULL) {
+    return MY_ERR;
   }
 
+  assert(pthread_mutex_lock(&fbm_lock) == 0);
+  int32_t r = block_take(fbm_table_, idx);
+  assert(pthread_mutex_unlock(&fbm_lock) == 0);
+
   return r;
 }
 
-int32_t fdt_add(file_entry_t *f, uint32_t size, uint32_t inode_idx) {
-  if (f == NULL) {
+int32_t block_take(fbm_table_t *fbm_table_, int32_t idx) {
+  if (fbm_table_ == NULL) {
     return MY_ERR;
   }
 
   int32_t r = MY_ERR;
-  for (size_t i = 0; i < size; i++) {
-    if (f[i].free == ENTRY_FREE) {
-      f[i].free = ENTRY_TAKEN;
-      // TODO(vl): Add an assert for the cast
-      f[i].linked_inode = (int32_t)inode_idx;
-      f[i].ptr_read = 0;
-      f[i].ptr_write = 0;
-      // TODO(vl): Add an assert for the cast
-      r = (int32_t)i;
+  if (block_available(fbm_table_, idx)) {
+    fbm_table_->block[idx] = ENTRY_TAKEN;
+    r = idx;
+  } else {
+    size_t from = idx >= 0 && (uint32_t)idx < sb.blocks ? (size_t)idx : 0;
+    for (size_t n = 0; n < sb.blocks; n++) {
+      size_t i = (from + n) % sb.blocks;
+      if (block_available(fbm_table_, (int32_t)i)) {
+        fbm_table_->block[i] = ENTRY_TAKEN;
+        assert(i < NUM_BLOCKS);
+        r = (int32_t)i;
+        break;
+      }
+    }
+  }
 
-      break;
+  if (r != MY_ERR) {
+    atomic_fetch_sub(&space.free_blocks, 1);
+    epoch_map.block[r].birth = sb.epoch;
+    if (fbm_update(*fbm_table_) == MY_ERR ||
+        em_update(&epoch_map, r) == MY_ERR) {
+      r = MY_ERR;
     }
   }
 
   return r;
 }
 
-int32_t fdt_init(file_entry_t *f, uint32_t size) {
-  if (f == NULL) {
+int32_t block_allocate_run(fbm_table_t *fbm_table_, int32_t idx, int32_t num,
+                           int32_t *block_list) {
+  if (fbm_table_ == NULL || block_list == NULL || num <= 0) {
     return MY_ERR;
   }
 
-  for (size_t i = 0; i < size; i++) {
-    file_entry_table[i].free = ENTRY_FREE;
-    file_entry_table[i].linked_inode = ENTRY_INVALID;
-    file_entry_table[i].ptr_read = 0;
-    file_entry_table[i].ptr_write = 0;
-  }
+  assert(pthread_mutex_lock(&fbm_lock) == 0);
+
+  size_t from = idx >= 0 && (uint32_t)idx < sb.blocks ? (size_t)idx : 0;
+  size_t start = sb.blocks;
+  size_t run = 0;
+  int32_t free_num = 0;
+  for (size_t n = 0; n < sb.blocks && start == sb.blocks; n++) {
+    size_t i = (from + n) % sb.blocks;
+    if (!block_available(fbm_table_, (int32_t)i)) {
+      run = 0;
+      continue;
+    }
 
-  return MY_OK;
-}
+    // - Runs do not wrap around the end of the disk
+    run = i == 0 ? 1 : run + 1;
+    free_num++;
+    if (run == (size_t)num) {
+      start = i + 1 - run;
+    }
+  }
 
-// I-node management
+  int32_t r = MY_ERR;
+  if (start != sb.blocks || free_num >= num) {
+    r = 0;
+    for (size_t n = 0; n < sb.blocks && r < num; n++) {
+      size_t i = start != sb.blocks ? start + n : (from + n) % sb.blocks;
+      if (block_available(fbm_table_, (int32_t)i)) {
+        fbm_table_->block[i] = ENTRY_TAKEN;
+        assert(i < NUM_BLOCKS);
+        epoch_map.block[i].birth = sb.epoch;
+        block_list[r++] = (int32_t)i;
+      }
+    }
 
-int32_t inode_find(inode_t *p, uint32_t size, int32_t idx) {
-  assert(size == MAX_FILES);
+    atomic_fetch_sub(&space.free_blocks, r);
+  }
 
-  if (p == NULL && idx < 0) {
-    return MY_ERR;
+  if (r != MY_ERR && fbm_update(*fbm_table_) == MY_ERR) {
+    r = MY_ERR;
   }
 
-  if ((size_t)idx < size) {
-    return idx;
+  // - Only the blocks of the map holding the run are written
+  for (int32_t i = 0; i < r; i++) {
+    if (em_update(&epoch_map, block_list[i]) == MY_ERR) {
+      r = MY_ERR;
+    }
   }
 
-  return MY_ERR;
-}
+  assert(pthread_mutex_unlock(&fbm_lock) == 0);
 
-int32_t inode_remove(inode_t *p, uint32_t size, int32_t idx) {
-  assert(size == MAX_FILES);
+  return r;
+}
 
-  if (p == NULL || idx < 0) {
+int32_t block_deallocate(fbm_table_t *fbm_table_, int32_t idx) {
+  if (fbm_table_ == NULL || idx < 0) {
     return MY_ERR;
   }
 
-  if ((size_t)idx < size) {
-    p[idx].next = ENTRY_INVALID;
-    p[idx].free = ENTRY_FREE;
-    p[idx].size = 0;
+  int32_t r = MY_OK;
+  assert(pthread_mutex_lock(&fbm_lock) == 0);
 
-    for (size_t j = 0; j < BLOCKS_PER_INODE; j++) {
-      p[idx].ptr[j] = ENTRY_INVALID;
-    }
+  // - A block of other files only loses a reference
+  if ((uint32_t)idx < sb.blocks && rc_table.count[idx] > 0) {
+    rc_table.count[idx]--;
+    r = rc_update(&rc_table, idx);
+  } else if ((uint32_t)idx < sb.blocks && !block_shared(idx)) {
+    if (fbm_table_->block[idx] == ENTRY_TAKEN) {
+      fbm_table_->block[idx] = ENTRY_FREE;
+      journal.released[idx] = atomic_load(&journal.tid);
+      atomic_fetch_add(&space.free_blocks, 1);
 
-    return MY_OK;
+      if (journal_revoke(&journal, idx) == MY_ERR ||
+          fbm_update(*fbm_table_) == MY_ERR) {
+        r = MY_ERR;
+      }
+    }
+  } else if ((uint32_t)idx < sb.blocks) {
+    // - Blocks shared with a snapshot are freed once it is deleted
+    epoch_map.block[idx].death = sb.epoch;
+    r = em_update(&epoch_map, idx);
   }
 
-  return MY_ERR;
-}
+  assert(pthread_mutex_unlock(&fbm_lock) == 0);
 
-int32_t inode_allocate(inode_t *p, uint32_t size) {
-  assert(size == MAX_FILES);
+  return r;
+}
 
-  if (p == NULL) {
+int32_t block_deallocate_list(fbm_table_t *fbm_table_,
+                              const int32_t *block_list, int32_t num) {
+  if (fbm_table_ == NULL || block_list == NULL || num < 0) {
     return MY_ERR;
   }
 
-  int32_t r = MY_ERR;
-  for (size_t i = 0; i < size; i++) {
-    if (p[i].free == ENTRY_FREE) {
-      p[i].free = ENTRY_TAKEN;
-      // TODO(vl): Add an assert for the cast
-      r = (int32_t)i;
-      break;
+  int32_t r = MY_OK;
+  int fbm_changed = 0;
+  int rc_changed = 0;
+  assert(pthread_mutex_lock(&fbm_lock) == 0);
+
+  // - A block listed twice loses a reference and is then freed
+  for (int32_t i = 0; i < num; i++) {
+    int32_t idx = block_list[i];
+    if (idx < 0 || (uint32_t)idx >= sb.blocks) {
+      continue;
+    }
+
+    if (rc_table.count[idx] > 0) {
+      rc_table.count[idx]--;
+      rc_changed = 1;
+    } else if (!block_shared(idx) && fbm_table_->block[idx] == ENTRY_TAKEN) {
+      fbm_table_->block[idx] = ENTRY_FREE;
+      journal.released[idx] = atomic_load(&journal.tid);
+      atomic_fetch_add(&space.free_blocks, 1);
+      fbm_changed = 1;
+
+      if (journal_revoke(&journal, idx) == MY_ERR) {
+        r = MY_ERR;
+      }
+    } else if (block_shared(idx)) {
+      epoch_map.block[idx].death = sb.epoch;
+      if (em_update(&epoch_map, idx) == MY_ERR) {
+        r = MY_ERR;
+      }
     }
   }
 
+  if ((rc_changed && rc_update(&rc_table, ENTRY_INVALID) == MY_ERR) ||
+      (fbm_changed && fbm_update(*fbm_table_) == MY_ERR)) {
+    r = MY_ERR;
+  }
+
+  assert(pthread_mutex_unlock(&fbm_lock) == 0);
+
   return r;
 }
 
-int32_t inode_init(inode_t *p, uint32_t size) {
-  assert(size == MAX_FILES);
-
-  if (p == NULL) {
-    return MY_ERR;
+int block_available(const fbm_table_t *fbm_table_, int32_t idx) {
+  if (fbm_table_ == NULL || idx < 0 || (uint32_t)idx >= sb.blocks) {
+    return 0;
   }
 
-  for (size_t i = 0; i < size; i++) {
-    p[i].next = ENTRY_INVALID;
-    p[i].free = ENTRY_FREE;
-    p[i].size = 0;
+  return fbm_table_->block[idx] == ENTRY_FREE &&
+         journal.released[idx] <= atomic_load(&journal.committed);
+}
 
-    for (size_t j = 0; j < BLOCKS_PER_INODE; j++) {
-      p[i].ptr[j] = ENTRY_INVALID;
-    }
+int block_shared(int32_t idx) {
+  if (idx < 0 || (uint32_t)idx >= sb.blocks) {
+    return 0;
   }
 
-  return MY_OK;
+  // - Snapshots are only taken while no other call runs
+  return rc_table.count[idx] > 0 ||
+         (sb.snapshot_num > 0 &&
+          epoch_map.block[idx].birth <=
+              sb.snapshots[sb.snapshot_num - 1].epoch);
 }
 
-int32_t inode_read(inode_t *p, uint32_t size) {
-  assert(size == MAX_FILES);
-  assert(size / INODE_BLOCK_NUM * sizeof(inode_t) == BLOCK_SIZE);
-
-  if (p == NULL || read_blocks(sb.inode_block_idx, sb.inode_block_num, p) !=
-                       sb.inode_block_num) {
+int32_t block_cow(fbm_table_t *fbm_table_, int32_t idx) {
+  if (fbm_table_ == NULL || idx < 0) {
     return MY_ERR;
   }
 
-  return MY_OK;
-}
+  assert(pthread_mutex_lock(&fbm_lock) == 0);
+  int shared = block_shared(idx);
+  assert(pthread_mutex_unlock(&fbm_lock) == 0);
 
-int32_t inode_update(const inode_t *p, uint32_t size) {
-  assert(size == MAX_FILES);
-  assert(size / INODE_BLOCK_NUM * sizeof(inode_t) == BLOCK_SIZE);
-
-  if (p == NULL || write_blocks(sb.inode_block_idx, sb.inode_block_num, p) !=
-                       sb.inode_block_num) {
-    return MY_ERR;
+  if (!shared) {
+    return idx;
   }
 
-  return MY_OK;
+  return block_allocate(fbm_table_, -1);
 }
 
-int32_t *inode_get_block_list(const inode_t p, uint32_t *size) {
-  if (size == NULL) {
-    return NULL;
-  }
+// - Directory management
 
-  int32_t *ptr = calloc(MAX_BLOCKS_PER_FILE, sizeof(int32_t));
-  if (ptr == NULL) {
+dir_entry_t *dir_get(dir_table_t *t, int32_t idx) {
+  if (t == NULL || idx < 0 || (uint32_t)idx >= t->size ||
+      dir_load_block(t, idx / DIR_ENTRIES_PER_BLOCK) == MY_ERR) {
     return NULL;
   }
 
-  *size = MAX_BLOCKS_PER_FILE;
+  return &t->block[idx / DIR_ENTRIES_PER_BLOCK][idx % DIR_ENTRIES_PER_BLOCK];
+}
 
-  for (size_t i = 0; i < BLOCKS_PER_INODE; i++) {
-    ptr[i] = p.ptr[i];
+int32_t dir_load_block(dir_table_t *t, int32_t i) {
+  if (t == NULL || i < 0 || i >= DIR_BLOCKS_MAX) {
+    return MY_ERR;
   }
 
-  int32_t *iptr = (int32_t *)malloc(sb.blocks_size);
+  if (atomic_load_explicit(&t->loaded[i], memory_order_acquire)) {
+    return MY_OK;
+  }
 
-  assert(p.next != ENTRY_INVALID);
-  assert(read_blocks(p.next, 1, iptr) == 1);
+  assert(pthread_mutex_lock(&load_lock) == 0);
 
-  for (size_t i = BLOCKS_PER_INODE, j = 0; i < *size; i++, j++) {
-    ptr[i] = iptr[j];
+  int32_t r = MY_OK;
+  if (!atomic_load_explicit(&t->loaded[i], memory_order_relaxed)) {
+    dir_entry_t *d = calloc(DIR_ENTRIES_PER_BLOCK, sizeof(dir_entry_t));
+    r = d == NULL ? MY_ERR : journal_read(&journal, sb.dir_blocks[i], d);
+
+    if (r == MY_OK) {
+      t->block[i] = d;
+      atomic_store_explicit(&t->loaded[i], 1, memory_order_release);
+    } else {
+      free(d);
+    }
   }
 
-  free(iptr);
+  assert(pthread_mutex_unlock(&load_lock) == 0);
 
-  return ptr;
+  return r;
 }
 
-int32_t inode_set_block_list(inode_t *p, int32_t *block_list) {
-  if (p == NULL || block_list == NULL) {
+int32_t dir_find(dir_table_t *t, const char *name) {
+  if (t == NULL || name == NULL) {
     return MY_ERR;
   }
 
-  for (size_t i = 0; i < BLOCKS_PER_INODE; i++) {
-    p->ptr[i] = block_list[i];
+  int32_t r = MY_ERR;
+  for (uint32_t i = 0; i < t->size; i++) {
+    assert(i < MAX_FILES);
+    dir_entry_t *d = dir_get(t, (int32_t)i);
+    if (d->free == ENTRY_TAKEN && strncmp(d->fn, name, MAX_FN_LEN) == 0) {
+      r = (int32_t)i;
+      break;
+    }
   }
 
-  assert(p->next != ENTRY_INVALID);
-  assert(write_blocks(p->next, 1, &block_list[BLOCKS_PER_INODE]) == 1);
-
-  return MY_OK;
+  return r;
 }
 
-int32_t inode_free_block_list(int32_t *block_list) {
-  if (block_list == NULL) {
-    return MY_ERR;
+int32_t dir_remove(dir_table_t *t, const char *name) {
+  int32_t r = dir_find(t, name);
+  if (r != MY_ERR && r >= 0) {
+    dir_entry_t *d = dir_get(t, r);
+    d->free = ENTRY_FREE;
+    d->linked_inode = ENTRY_INVALID;
+    memset(d->fn, 0, MAX_FN_LEN);
   }
 
-  free(block_list);
-
-  return MY_OK;
+  return r;
 }
 
-// - ssfs
-
-void mkssfs(int fresh) {
-  if (fresh) {
-    assert(sb_init(&sb) == MY_OK);
-    assert(inode_init(inode_table, MAX_FILES) == MY_OK);
-    assert(dir_init(dir_table, MAX_FILES) == MY_OK);
-    assert(fdt_init(file_entry_table, MAX_OPEN_FILES) == MY_OK);
-    assert(fbm_init(&fbm_table) == MY_OK);
-
-    assert(init_fresh_disk(MY_NAME, sb.blocks_size, sb.blocks) == 0);
-
-    // TODO(vl): Add an assert for the cast
-    assert(block_allocate(&fbm_table, sb.fbm_block_idx) ==
-           (int32_t)sb.fbm_block_idx);
-    // TODO(vl): Add an assert for the cast
-    assert(block_allocate(&fbm_table, sb.sb_block_idx) ==
-           (int32_t)sb.sb_block_idx);
+int32_t dir_add(dir_table_t *t, const char *name, uint32_t node) {
+  if (t == NULL || name == NULL) {
+    return MY_ERR;
+  }
 
-    for (int32_t i = sb.dir_block_idx; i < sb.dir_block_idx + sb.dir_block_num;
-         i++) {
-      assert(block_allocate(&fbm_table, i) == i);
+  int32_t r = MY_ERR;
+  for (uint32_t i = 0; i < t->size; i++) {
+    if (dir_get(t, (int32_t)i)->free == ENTRY_FREE) {
+      r = (int32_t)i;
+      break;
     }
+  }
 
-    for (int32_t i = sb.inode_block_idx;
-         i < sb.inode_block_idx + sb.inode_block_num; i++) {
-      assert(block_allocate(&fbm_table, i) == i);
+  if (r == MY_ERR) {
+    if (sb.dir_block_num >= DIR_BLOCKS_MAX) {
+      return MY_ERR;
     }
 
-    assert(sb_update(sb) == MY_OK);
-    assert(inode_update(inode_table, MAX_FILES) == MY_OK);
-    assert(dir_update(dir_table, MAX_FILES) == MY_OK);
-    assert(fbm_update(fbm_table) == MY_OK);
-  } else {
-    assert(init_disk(MY_NAME, sizeof(super_block_t), 1) == 0);
-    assert(sb_init(&sb) == MY_OK);
-    assert(read_blocks(0, 1, &sb) == 1);
-    assert(close_disk() == 0);
-    assert(sb.magic == MAGIC);
-
-    assert(init_disk(MY_NAME, sb.blocks_size, sb.blocks) == 0);
-    assert(sb_read(&sb) == MY_OK);
-    assert(sb.magic == MAGIC);
-    assert(inode_read(inode_table, MAX_FILES) == MY_OK);
-    assert(dir_read(dir_table, MAX_FILES) == MY_OK);
-    assert(fbm_read(&fbm_table) == MY_OK);
-  }
-}
-
-int ssfs_fopen(char *name) {
-  int32_t dir_idx = dir_find(dir_table, MAX_FILES, name);
-  if (dir_idx == MY_ERR) {
-    int32_t inode_idx = inode_allocate(inode_table, MAX_FILES);
-    if (inode_idx == MY_ERR) {
-      return -1;
+    dir_entry_t *d = calloc(DIR_ENTRIES_PER_BLOCK, sizeof(dir_entry_t));
+    if (d == NULL) {
+      return MY_ERR;
     }
 
-    inode_t *p = &inode_table[inode_idx];
-    // TODO(vl): Add an assert for the cast
-    p->next = (int16_t)block_allocate(&fbm_table, -1);
-    if (p->next == MY_ERR) {
-      p->next = ENTRY_INVALID;
-      return -1;
+    int32_t block = block_allocate(&fbm_table, -1);
+    if (block == MY_ERR) {
+      free(d);
+      return MY_ERR;
     }
 
-    int32_t *iptr = (int32_t *)calloc(sb.blocks_size, 1);
-    // TODO(vl): Runtime check instead of assert
-    assert(iptr != NULL);
-    assert(sb.blocks_size == INDIRECT_BLOCKS * INDIRECT_BLOCK_ENTRY_SIZE);
+    for (size_t i = 0; i < DIR_ENTRIES_PER_BLOCK; i++) {
+      d[i].free = ENTRY_FREE;
+      d[i].linked_inode = ENTRY_INVALID;
+    }
 
-    for (size_t i = 0; i < INDIRECT_BLOCKS; i++) {
-      iptr[i] = ENTRY_INVALID;
+    if (journal_write(&journal, block, d) == MY_ERR) {
+      free(d);
+      return MY_ERR;
     }
 
-    assert(write_blocks(p->next, 1, iptr) == 1);
+    assert(pthread_mutex_lock(&sb_lock) == 0);
 
-    free(iptr);
+    t->block[sb.dir_block_num] = d;
+    atomic_store_explicit(&t->loaded[sb.dir_block_num], 1,
+                          memory_order_release);
+    sb.dir_blocks[sb.dir_block_num] = block;
+    r = (int32_t)t->size;
+    t->size += DIR_ENTRIES_PER_BLOCK;
+    sb.dir_block_num++;
 
-    assert(inode_update(inode_table, MAX_FILES) == MY_OK);
-    assert(inode_idx >= 0);
-    assert(dir_add(dir_table, MAX_FILES, name, (uint32_t)inode_idx) == MY_OK);
-    assert(dir_update(dir_table, MAX_FILES) == MY_OK);
+    int32_t u = sb_update(sb);
+    assert(pthread_mutex_unlock(&sb_lock) == 0);
 
-    return fdt_add(file_entry_table, MAX_OPEN_FILES, (uint32_t)inode_idx);
+    if (u == MY_ERR) {
+      return MY_ERR;
+    }
   }
 
-  int32_t inode_idx = dir_table[dir_idx].linked_inode;
-  if (inode_idx == MY_ERR) {
-    return -1;
-  }
+  dir_entry_t *d = dir_get(t, r);
+  d->free = ENTRY_TAKEN;
+  d->linked_inode = (int32_t)node;
+  strncpy(d->fn, name, MAX_FN_LEN);
+  d->fn[MAX_FN_LEN - 1] = '\0';
 
-  for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-    if (file_entry_table[i].linked_inode ==
-        inode_idx) { // TODO(vl): add an assert for the cast
-      return (int32_t)i;
-    }
-  }
+  return r;
+}
 
-  assert(inode_idx >= 0);
-  int32_t fd = fdt_add(file_entry_table, MAX_OPEN_FILES, (uint32_t)inode_idx);
-  if (fd == MY_ERR) {
-    return -1;
+int32_t dir_read(dir_table_t *t) {
+  if (t == NULL) {
+    return MY_ERR;
   }
 
-  file_entry_table[fd].ptr_read = 0;
-  // TODO(vl): add an assert to avoid overflow
-  file_entry_table[fd].ptr_write = (int32_t)inode_table[inode_idx].size;
+  // - The blocks are read on first use, so mounting does not depend on the
+  // size of the directory
+  assert(sb.dir_block_num >= 0 && sb.dir_block_num <= DIR_BLOCKS_MAX);
+  t->size = (uint32_t)sb.dir_block_num * DIR_ENTRIES_PER_BLOCK;
 
-  return fd;
+  return MY_OK;
+}
+
+int32_t dir_update(dir_table_t *t, int32_t idx) {
+  if (t == NULL || (idx != ENTRY_INVALID && dir_get(t, idx) == NULL)) {
+    return MY_ERR;
+  }
+
+  // - Blocks which were never read did not change
+  for (int32_t i = 0; i < sb.dir_block_num; i++) {
+    if ((idx != ENTRY_INVALID && i != idx / DIR_ENTRIES_PER_BLOCK) ||
+        !atomic_load_explicit(&t->loaded[i], memory_order_acquire)) {
+      continue;
+    }
+
+    int32_t block = block_cow(&fbm_table, sb.dir_blocks[i]);
+    if (block == MY_ERR ||
+        journal_write(&journal, block, t->block[i]) == MY_ERR) {
+      return MY_ERR;
+    }
+
+    if (block != sb.dir_blocks[i]) {
+      int32_t old = sb.dir_blocks[i];
+
+      assert(pthread_mutex_lock(&sb_lock) == 0);
+      sb.dir_blocks[i] = block;
+      int32_t u = sb_update(sb);
+      assert(pthread_mutex_unlock(&sb_lock) == 0);
+
+      if (u == MY_ERR || block_deallocate(&fbm_table, old) == MY_ERR) {
+        return MY_ERR;
+      }
+    }
+  }
+
+  return MY_OK;
+}
+
+int32_t dir_init(dir_table_t *t) {
+  if (t == NULL) {
+    return MY_ERR;
+  }
+
+  t->size = 0;
+  for (size_t i = 0; i < DIR_BLOCKS_MAX; i++) {
+    t->block[i] = NULL;
+    atomic_init(&t->loaded[i], 0);
+  }
+
+  return MY_OK;
+}
+
+int32_t dir_release(dir_table_t *t) {
+  if (t == NULL) {
+    return MY_ERR;
+  }
+
+  for (size_t i = 0; i < DIR_BLOCKS_MAX; i++) {
+    free(t->block[i]);
+  }
+
+  return dir_init(t);
+}
+
+// - File descriptor management
+
+file_entry_t *fdt_get(const file_entry_table_t *t, int fd) {
+  if (t == NULL || fd < 0 || (uint32_t)fd >= t->size) {
+    return NULL;
+  }
+
+  return &t->chunk[fd / FDT_CHUNK_SIZE][fd % FDT_CHUNK_SIZE];
+}
+
+file_entry_t *fdt_lock(const file_entry_table_t *t, int fd, int exclusive) {
+  file_entry_t *f = fdt_get(t, fd);
+  if (f == NULL) {
+    return NULL;
+  }
+
+  if (exclusive) {
+    assert(pthread_rwlock_wrlock(&f->lock) == 0);
+  } else {
+    assert(pthread_rwlock_rdlock(&f->lock) == 0);
+  }
+
+  if (f->free == ENTRY_FREE) {
+    assert(pthread_rwlock_unlock(&f->lock) == 0);
+    return NULL;
+  }
+
+  return f;
+}
+
+int32_t fdt_unlock(file_entry_t *f) {
+  if (f == NULL) {
+    return MY_ERR;
+  }
+
+  assert(pthread_rwlock_unlock(&f->lock) == 0);
+
+  return MY_OK;
+}
+
+int32_t fdt_remove(file_entry_table_t *t, int fd) {
+  file_entry_t *f = fdt_get(t, fd);
+  if (f == NULL || f->free == ENTRY_FREE) {
+    return MY_ERR;
+  }
+
+  f->linked_inode = ENTRY_INVALID;
+  f->ptr_read = 0;
+  f->ptr_write = 0;
+  f->advice = SSFS_FADV_NORMAL;
+  f->free = ENTRY_FREE;
+
+  return MY_OK;
+}
+
+int32_t fdt_add(file_entry_table_t *t, uint32_t inode_idx) {
+  if (t == NULL) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&fdt_table_lock) == 0);
+
+  int32_t r = MY_ERR;
+  for (uint32_t i = 0; i < t->size; i++) {
+    if (fdt_get(t, (int)i)->free == ENTRY_FREE) {
+      assert(i < FDT_CHUNKS_MAX * FDT_CHUNK_SIZE);
+      r = (int32_t)i;
+      break;
+    }
+  }
+
+  if (r == MY_ERR) {
+    uint32_t c = t->size / FDT_CHUNK_SIZE;
+    file_entry_t *f = NULL;
+    if (c < FDT_CHUNKS_MAX) {
+      f = calloc(FDT_CHUNK_SIZE, sizeof(file_entry_t));
+    }
+
+    if (f == NULL) {
+      assert(pthread_mutex_unlock(&fdt_table_lock) == 0);
+      return MY_ERR;
+    }
+
+    for (size_t i = 0; i < FDT_CHUNK_SIZE; i++) {
+      f[i].free = ENTRY_FREE;
+      f[i].linked_inode = ENTRY_INVALID;
+      assert(pthread_rwlock_init(&f[i].lock, NULL) == 0);
+    }
+
+    t->chunk[c] = f;
+    r = (int32_t)t->size;
+    t->size += FDT_CHUNK_SIZE;
+  }
+
+  file_entry_t *f = fdt_get(t, r);
+  assert(inode_idx < MAX_FILES);
+  f->linked_inode = (int32_t)inode_idx;
+  f->ptr_read = 0;
+  f->ptr_write = 0;
+  f->advice = SSFS_FADV_NORMAL;
+  f->free = ENTRY_TAKEN;
+
+  assert(pthread_mutex_unlock(&fdt_table_lock) == 0);
+
+  return r;
+}
+
+int32_t fdt_init(file_entry_table_t *t) {
+  if (t == NULL) {
+    return MY_ERR;
+  }
+
+  t->size = 0;
+  for (size_t i = 0; i < FDT_CHUNKS_MAX; i++) {
+    t->chunk[i] = NULL;
+  }
+
+  return MY_OK;
+}
+
+int32_t fdt_release(file_entry_table_t *t) {
+  if (t == NULL) {
+    return MY_ERR;
+  }
+
+  for (size_t i = 0; i < FDT_CHUNKS_MAX && t->chunk[i] != NULL; i++) {
+    for (size_t j = 0; j < FDT_CHUNK_SIZE; j++) {
+      assert(pthread_rwlock_destroy(&t->chunk[i][j].lock) == 0);
+    }
+
+    free(t->chunk[i]);
+  }
+
+  return fdt_init(t);
+}
+
+// I-node management
+
+inode_t *inode_get(inode_table_t *t, int32_t idx) {
+  if (t == NULL || idx < 0 || (uint32_t)idx >= t->size ||
+      inode_load_block(t, idx / INODES_PER_BLOCK) == MY_ERR) {
+    return NULL;
+  }
+
+  return &t->block[idx / INODES_PER_BLOCK][idx % INODES_PER_BLOCK];
+}
+
+inode_state_t *inode_get_state(inode_table_t *t, int32_t idx) {
+  if (t == NULL || idx < 0 || (uint32_t)idx >= t->size ||
+      inode_load_block(t, idx / INODES_PER_BLOCK) == MY_ERR) {
+    return NULL;
+  }
+
+  return &t->state[idx / INODES_PER_BLOCK][idx % INODES_PER_BLOCK];
+}
+
+int32_t inode_load_block(inode_table_t *t, int32_t i) {
+  if (t == NULL || i < 0 || i >= INODE_BLOCKS_MAX) {
+    return MY_ERR;
+  }
+
+  if (atomic_load_explicit(&t->loaded[i], memory_order_acquire)) {
+    return MY_OK;
+  }
+
+  assert(pthread_mutex_lock(&load_lock) == 0);
+
+  int32_t r = MY_OK;
+  if (!atomic_load_explicit(&t->loaded[i], memory_order_relaxed)) {
+    inode_t *p = calloc(INODES_PER_BLOCK, sizeof(inode_t));
+    inode_state_t *state = calloc(INODES_PER_BLOCK, sizeof(inode_state_t));
+    r = p == NULL || state == NULL
+            ? MY_ERR
+            : journal_read(&journal, sb.inode_blocks[i], p);
+
+    if (r == MY_OK) {
+      for (size_t j = 0; j < INODES_PER_BLOCK; j++) {
+        assert(pthread_rwlock_init(&state[j].lock, NULL) == 0);
+      }
+
+      t->block[i] = p;
+      t->state[i] = state;
+      atomic_store_explicit(&t->loaded[i], 1, memory_order_release);
+    } else {
+      free(p);
+      free(state);
+    }
+  }
+
+  assert(pthread_mutex_unlock(&load_lock) == 0);
+
+  return r;
+}
+
+int32_t inode_lock_block(inode_table_t *t, int32_t idx) {
+  if (inode_get(t, idx) == NULL) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&t->lock[idx / INODES_PER_BLOCK]) == 0);
+
+  return MY_OK;
+}
+
+int32_t inode_unlock_block(inode_table_t *t, int32_t idx) {
+  if (inode_get(t, idx) == NULL) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_unlock(&t->lock[idx / INODES_PER_BLOCK]) == 0);
+
+  return MY_OK;
+}
+
+int32_t inode_find(inode_table_t *t, int32_t idx) {
+  if (inode_get(t, idx) == NULL) {
+    return MY_ERR;
+  }
+
+  return sb.inode_blocks[idx / INODES_PER_BLOCK];
+}
+
+int32_t inode_remove(inode_table_t *t, int32_t idx) {
+  inode_t *p = inode_get(t, idx);
+  if (p == NULL) {
+    return MY_ERR;
+  }
+
+  assert(inode_lock_block(t, idx) == MY_OK);
+
+  if (p->free == ENTRY_TAKEN) {
+    atomic_fetch_add(&space.free_inodes, 1);
+  }
+
+  p->next = ENTRY_INVALID;
+  p->free = ENTRY_FREE;
+  p->flags = 0;
+  p->size = 0;
+
+  for (size_t j = 0; j < BLOCKS_PER_INODE; j++) {
+    p->ptr[j] = ENTRY_INVALID;
+  }
+
+  assert(inode_unlock_block(t, idx) == MY_OK);
+
+  return MY_OK;
+}
+
+int32_t inode_ref(inode_table_t *t, int32_t idx) {
+  inode_state_t *state = inode_get_state(t, idx);
+  if (state == NULL) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&inode_table_lock) == 0);
+  state->refs++;
+  assert(pthread_mutex_unlock(&inode_table_lock) == 0);
+
+  return MY_OK;
+}
+
+int32_t inode_unref(inode_table_t *t, int32_t idx) {
+  inode_state_t *state = inode_get_state(t, idx);
+  if (state == NULL) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&inode_table_lock) == 0);
+  assert(state->refs > 0);
+  state->refs--;
+  int destroy = state->refs == 0 && state->unlinked;
+  assert(pthread_mutex_unlock(&inode_table_lock) == 0);
+
+  if (destroy) {
+    return inode_destroy(t, idx);
+  }
+
+  return MY_OK;
+}
+
+int32_t inode_unlink(inode_table_t *t, int32_t idx) {
+  inode_state_t *state = inode_get_state(t, idx);
+  if (state == NULL) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&inode_table_lock) == 0);
+  state->unlinked = 1;
+  int destroy = state->refs == 0;
+  assert(pthread_mutex_unlock(&inode_table_lock) == 0);
+
+  if (destroy) {
+    return inode_destroy(t, idx);
+  }
+
+  return MY_OK;
+}
+
+int32_t inode_load(inode_table_t *t, int32_t idx) {
+  inode_t *p = inode_get(t, idx);
+  inode_state_t *state = inode_get_state(t, idx);
+  if (p == NULL) {
+    return MY_ERR;
+  }
+
+  if (atomic_load_explicit(&state->map, memory_order_acquire) != NULL) {
+    return MY_OK;
+  }
+
+  assert(inode_lock_block(t, idx) == MY_OK);
+
+  int32_t r = MY_OK;
+  if (atomic_load_explicit(&state->map, memory_order_relaxed) == NULL) {
+    uint32_t block_list_size = 0;
+    int32_t *block_list = inode_get_block_list(*p, &block_list_size);
+    _Atomic int32_t *map = calloc(MAX_BLOCKS_PER_FILE, sizeof(*map));
+
+    if (block_list != NULL && map != NULL) {
+      for (size_t i = 0; i < block_list_size; i++) {
+        atomic_init(&map[i], block_list[i]);
+      }
+
+      atomic_store_explicit(&state->size, p->size, memory_order_relaxed);
+      atomic_store_explicit(&state->inlined, p->flags & INODE_INLINE,
+                            memory_order_relaxed);
+      atomic_store_explicit(&state->map, map, memory_order_release);
+    } else {
+      free(map);
+      r = MY_ERR;
+    }
+
+    if (block_list != NULL) {
+      assert(inode_free_block_list(block_list) == MY_OK);
+    }
+  }
+
+  assert(inode_unlock_block(t, idx) == MY_OK);
+
+  return r;
+}
+
+int32_t inode_size(inode_table_t *t, int32_t idx) {
+  if (inode_load(t, idx) == MY_ERR) {
+    return MY_ERR;
+  }
+
+  return inode_state_size(inode_get_state(t, idx));
+}
+
+int32_t inode_state_size(const inode_state_t *state) {
+  uint32_t size = atomic_load_explicit(&state->size, memory_order_relaxed);
+  assert(size <= FILE_SIZE_MAX);
+
+  return (int32_t)size;
+}
+
+uint32_t inode_read_begin(const inode_state_t *state) {
+  return atomic_load_explicit(&state->seq, memory_order_acquire);
+}
+
+int inode_read_retry(const inode_state_t *state, uint32_t seq) {
+  atomic_thread_fence(memory_order_acquire);
+
+  return (seq & 1) ||
+         atomic_load_explicit(&state->seq, memory_order_relaxed) != seq;
+}
+
+void inode_write_begin(inode_state_t *state) {
+  uint32_t seq = atomic_load_explicit(&state->seq, memory_order_relaxed);
+  atomic_store_explicit(&state->seq, seq + 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+}
+
+void inode_write_end(inode_state_t *state) {
+  uint32_t seq = atomic_load_explicit(&state->seq, memory_order_relaxed);
+  atomic_store_explicit(&state->seq, seq + 1, memory_order_release);
+}
+
+int32_t inode_destroy(inode_table_t *t, int32_t idx) {
+  inode_t *p = inode_get(t, idx);
+  inode_state_t *state = inode_get_state(t, idx);
+  if (p == NULL || p->free == ENTRY_FREE) {
+    return MY_ERR;
+  }
+
+  assert(pthread_rwlock_wrlock(&state->lock) == 0);
+  inode_write_begin(state);
+
+  uint32_t block_list_size = 0;
+  int32_t *block_list = inode_get_block_list(*p, &block_list_size);
+  if (block_list == NULL) {
+    inode_write_end(state);
+    assert(pthread_rwlock_unlock(&state->lock) == 0);
+    return MY_ERR;
+  }
+
+  assert(block_list_size <= MAX_BLOCKS_PER_FILE);
+  assert(block_deallocate_list(&fbm_table, block_list,
+                               (int32_t)block_list_size) == MY_OK);
+
+  assert(inode_free_block_list(block_list) == MY_OK);
+  if (p->next != ENTRY_INVALID) {
+    assert(block_deallocate(&fbm_table, p->next) == MY_OK);
+  }
+
+  assert(pthread_mutex_lock(&inode_table_lock) == 0);
+  state->refs = 0;
+  state->unlinked = 0;
+  int32_t r = inode_remove(t, idx);
+  assert(pthread_mutex_unlock(&inode_table_lock) == 0);
+
+  // - No file descriptor is left, so nobody can be reading the old map
+  free(atomic_exchange_explicit(&state->map, NULL, memory_order_relaxed));
+  atomic_store_explicit(&state->size, 0, memory_order_relaxed);
+  inode_write_end(state);
+
+  if (r == MY_OK) {
+    r = inode_update(t, idx);
+  }
+
+  assert(pthread_rwlock_unlock(&state->lock) == 0);
+
+  return r;
+}
+
+int32_t inode_allocate(inode_table_t *t) {
+  if (t == NULL) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&inode_table_lock) == 0);
+
+  int32_t r = MY_ERR;
+  for (uint32_t i = 0; i < t->size; i++) {
+    if (inode_get(t, (int32_t)i)->free == ENTRY_FREE) {
+      assert(i < MAX_FILES);
+      r = (int32_t)i;
+      break;
+    }
+  }
+
+  if (r == MY_ERR && sb.inode_block_num < INODE_BLOCKS_MAX) {
+    inode_t *p = calloc(INODES_PER_BLOCK, sizeof(inode_t));
+    inode_state_t *state = calloc(INODES_PER_BLOCK, sizeof(inode_state_t));
+    int32_t block = MY_ERR;
+    if (p != NULL && state != NULL) {
+      block = block_allocate(&fbm_table, -1);
+    }
+
+    if (block == MY_ERR) {
+      free(p);
+      free(state);
+      assert(pthread_mutex_unlock(&inode_table_lock) == 0);
+      return MY_ERR;
+    }
+
+    for (size_t i = 0; i < INODES_PER_BLOCK; i++) {
+      p[i].next = ENTRY_INVALID;
+      p[i].free = ENTRY_FREE;
+
+      for (size_t j = 0; j < BLOCKS_PER_INODE; j++) {
+        p[i].ptr[j] = ENTRY_INVALID;
+      }
+
+      assert(pthread_rwlock_init(&state[i].lock, NULL) == 0);
+    }
+
+    assert(pthread_mutex_lock(&sb_lock) == 0);
+
+    t->block[sb.inode_block_num] = p;
+    t->state[sb.inode_block_num] = state;
+    atomic_store_explicit(&t->loaded[sb.inode_block_num], 1,
+                          memory_order_release);
+    sb.inode_blocks[sb.inode_block_num] = block;
+    r = (int32_t)t->size;
+    sb.inode_block_num++;
+    t->size += INODES_PER_BLOCK;
+    atomic_fetch_add(&space.free_inodes, INODES_PER_BLOCK);
+
+    int32_t u = MY_ERR;
+    if (journal_write(&journal, block, p) == MY_OK) {
+      u = sb_update(sb);
+    }
+
+    assert(pthread_mutex_unlock(&sb_lock) == 0);
+
+    if (u == MY_ERR) {
+      assert(pthread_mutex_unlock(&inode_table_lock) == 0);
+      return MY_ERR;
+    }
+  }
+
+  // - New files keep their data in the I-node until it outgrows it
+  if (r != MY_ERR) {
+    assert(inode_lock_block(t, r) == MY_OK);
+    inode_t *p = inode_get(t, r);
+    atomic_fetch_sub(&space.free_inodes, 1);
+    p->free = ENTRY_TAKEN;
+    p->flags = INODE_INLINE;
+    memset(p->data, 0, sizeof(p->data));
+    assert(inode_unlock_block(t, r) == MY_OK);
+  }
+
+  assert(pthread_mutex_unlock(&inode_table_lock) == 0);
+
+  return r;
+}
+
+int32_t inode_init(inode_table_t *t) {
+  if (t == NULL) {
+    return MY_ERR;
+  }
+
+  t->size = 0;
+  for (size_t i = 0; i < INODE_BLOCKS_MAX; i++) {
+    t->block[i] = NULL;
+    t->state[i] = NULL;
+    atomic_init(&t->loaded[i], 0);
+    assert(pthread_mutex_init(&t->lock[i], NULL) == 0);
+  }
+
+  return MY_OK;
+}
+
+int32_t inode_read(inode_table_t *t) {
+  assert(INODES_PER_BLOCK * sizeof(inode_t) == BLOCK_SIZE);
+
+  if (t == NULL) {
+    return MY_ERR;
+  }
+
+  // - The blocks are read on first use, so mounting does not depend on the
+  // number of I-nodes
+  assert(sb.inode_block_num >= 0 && sb.inode_block_num <= INODE_BLOCKS_MAX);
+  atomic_store(&t->size, (uint32_t)sb.inode_block_num * INODES_PER_BLOCK);
+
+  return MY_OK;
+}
+
+int32_t inode_update(inode_table_t *t, int32_t idx) {
+  assert(INODES_PER_BLOCK * sizeof(inode_t) == BLOCK_SIZE);
+
+  if (t == NULL || (idx != ENTRY_INVALID && inode_get(t, idx) == NULL)) {
+    return MY_ERR;
+  }
+
+  int32_t first = 0;
+  int32_t last = sb.inode_block_num - 1;
+  if (idx != ENTRY_INVALID) {
+    first = idx / INODES_PER_BLOCK;
+    last = first;
+  }
+
+  // - Blocks which were never read did not change
+  int32_t r = MY_OK;
+  for (int32_t i = first; i <= last && r == MY_OK; i++) {
+    if (!atomic_load_explicit(&t->loaded[i], memory_order_acquire)) {
+      continue;
+    }
+
+    assert(pthread_mutex_lock(&t->lock[i]) == 0);
+
+    int32_t block = block_cow(&fbm_table, sb.inode_blocks[i]);
+    if (block == MY_ERR ||
+        journal_write(&journal, block, t->block[i]) == MY_ERR) {
+      r = MY_ERR;
+    } else if (block != sb.inode_blocks[i]) {
+      int32_t old = sb.inode_blocks[i];
+
+      assert(pthread_mutex_lock(&sb_lock) == 0);
+      sb.inode_blocks[i] = block;
+      r = sb_update(sb);
+      assert(pthread_mutex_unlock(&sb_lock) == 0);
+
+      if (r == MY_OK) {
+        r = block_deallocate(&fbm_table, old);
+      }
+    }
+
+    assert(pthread_mutex_unlock(&t->lock[i]) == 0);
+  }
+
+  return r;
+}
+
+int32_t inode_release(inode_table_t *t) {
+  if (t == NULL) {
+    return MY_ERR;
+  }
+
+  for (size_t i = 0; i < INODE_BLOCKS_MAX; i++) {
+    for (size_t j = 0; t->state[i] != NULL && j < INODES_PER_BLOCK; j++) {
+      assert(pthread_rwlock_destroy(&t->state[i][j].lock) == 0);
+      free(atomic_load_explicit(&t->state[i][j].map, memory_order_relaxed));
+    }
+
+    assert(pthread_mutex_destroy(&t->lock[i]) == 0);
+    free(t->block[i]);
+    free(t->state[i]);
+  }
+
+  return inode_init(t);
+}
+
+int32_t inode_reclaim(inode_table_t *t, dir_table_t *d) {
+  if (t == NULL || d == NULL) {
+    return MY_ERR;
+  }
+
+  uint8_t *linked = calloc(t->size + 1, sizeof(uint8_t));
+  if (linked == NULL) {
+    return MY_ERR;
+  }
+
+  for (uint32_t i = 0; i < d->size; i++) {
+    assert(i < MAX_FILES);
+    dir_entry_t *e = dir_get(d, (int32_t)i);
+    if (e == NULL) {
+      free(linked);
+      return MY_ERR;
+    }
+
+    if (e->free == ENTRY_TAKEN && e->linked_inode >= 0 &&
+        (uint32_t)e->linked_inode < t->size) {
+      linked[e->linked_inode] = 1;
+    }
+  }
+
+  int32_t r = 0;
+  for (uint32_t i = 0; i < t->size && r != MY_ERR; i++) {
+    assert(i < MAX_FILES);
+    inode_t *p = inode_get(t, (int32_t)i);
+    if (p == NULL) {
+      r = MY_ERR;
+    } else if (p->free == ENTRY_TAKEN && !linked[i]) {
+      r = inode_destroy(t, (int32_t)i) == MY_OK ? r + 1 : MY_ERR;
+    }
+  }
+
+  free(linked);
+
+  return r;
+}
+
+int32_t *inode_get_block_list(const inode_t p, uint32_t *size) {
+  if (size == NULL) {
+    return NULL;
+  }
+
+  int32_t *ptr = calloc(MAX_BLOCKS_PER_FILE, sizeof(int32_t));
+  if (ptr == NULL) {
+    return NULL;
+  }
+
+  *size = MAX_BLOCKS_PER_FILE;
+
+  // - Data held in the I-node takes no block
+  for (size_t i = 0; i < BLOCKS_PER_INODE; i++) {
+    ptr[i] = p.flags & INODE_INLINE ? ENTRY_INVALID : p.ptr[i];
+  }
+
+  // - Files which never grew past the direct blocks have no indirect block
+  if (p.next == ENTRY_INVALID) {
+    for (size_t i = BLOCKS_PER_INODE; i < *size; i++) {
+      ptr[i] = ENTRY_INVALID;
+    }
+
+    return ptr;
+  }
+
+  int32_t *iptr = (int32_t *)malloc(sb.blocks_size);
+
+  assert(journal_read(&journal, p.next, iptr) == MY_OK);
+
+  for (size_t i = BLOCKS_PER_INODE, j = 0; i < *size; i++, j++) {
+    ptr[i] = iptr[j];
+  }
+
+  free(iptr);
+
+  return ptr;
+}
+
+int32_t inode_set_block_list(inode_t *p, int32_t inode_idx,
+                             int32_t *block_list) {
+  if (p == NULL || block_list == NULL) {
+    return MY_ERR;
+  }
+
+  int indirect = 0;
+  for (size_t i = BLOCKS_PER_INODE; i < MAX_BLOCKS_PER_FILE; i++) {
+    indirect |= block_list[i] != ENTRY_INVALID;
+  }
+
+  // - The indirect block is allocated once a file grows past the direct
+  // blocks and released once it shrinks back
+  int32_t next = ENTRY_INVALID;
+  if (indirect) {
+    next = p->next == ENTRY_INVALID ? block_allocate(&fbm_table, -1)
+                                    : block_cow(&fbm_table, p->next);
+    if (next == MY_ERR) {
+      return MY_ERR;
+    }
+  } else if (p->next != ENTRY_INVALID) {
+    assert(block_deallocate(&fbm_table, p->next) == MY_OK);
+  }
+
+  p->flags = (uint8_t)(p->flags & ~INODE_INLINE);
+  for (size_t i = 0; i < BLOCKS_PER_INODE; i++) {
+    p->ptr[i] = block_list[i];
+  }
+
+  // - A copied indirect block is released to the snapshot
+  if (indirect && next != p->next && p->next != ENTRY_INVALID) {
+    assert(block_deallocate(&fbm_table, p->next) == MY_OK);
+  }
+
+  assert(next < NUM_BLOCKS);
+  p->next = (int16_t)next;
+  if (indirect) {
+    assert(journal_write(&journal, p->next, &block_list[BLOCKS_PER_INODE]) ==
+           MY_OK);
+  }
+
+  assert(segment_summarize(&segment, inode_idx, block_list) == MY_OK);
+
+  return MY_OK;
+}
+
+int32_t inode_free_block_list(int32_t *block_list) {
+  if (block_list == NULL) {
+    return MY_ERR;
+  }
+
+  free(block_list);
+
+  return MY_OK;
+}
+
+// - File data management
+
+int32_t file_lookup(const char *name, int create) {
+  if (name == NULL) {
+    return MY_ERR;
+  }
+
+  assert(pthread_rwlock_rdlock(&dir_lock) == 0);
+
+  int32_t dir_idx = dir_find(&dir_table, name);
+  if (dir_idx == MY_ERR && create) {
+    // - Creating needs the directory exclusively, so look again in case the
+    // file was created while the lock was not held
+    assert(pthread_rwlock_unlock(&dir_lock) == 0);
+    assert(pthread_rwlock_wrlock(&dir_lock) == 0);
+    dir_idx = dir_find(&dir_table, name);
+  }
+
+  int32_t inode_idx = MY_ERR;
+  if (dir_idx == MY_ERR && create) {
+    inode_idx = inode_allocate(&inode_table);
+    if (inode_idx != MY_ERR) {
+      // - The indirect block is only allocated once the file needs it
+      assert(inode_update(&inode_table, inode_idx) == MY_OK);
+      dir_idx = dir_add(&dir_table, name, (uint32_t)inode_idx);
+      if (dir_idx == MY_ERR) {
+        assert(inode_destroy(&inode_table, inode_idx) == MY_OK);
+        inode_idx = MY_ERR;
+      } else {
+        assert(dir_update(&dir_table, dir_idx) == MY_OK);
+      }
+    }
+  } else if (dir_idx != MY_ERR) {
+    inode_idx = dir_get(&dir_table, dir_idx)->linked_inode;
+  }
+
+  // - The reference is taken before the directory is unlocked so that a
+  // concurrent remove cannot destroy the I-node in between
+  if (inode_idx != MY_ERR && inode_ref(&inode_table, inode_idx) == MY_ERR) {
+    inode_idx = MY_ERR;
+  }
+
+  assert(pthread_rwlock_unlock(&dir_lock) == 0);
+
+  return inode_idx;
+}
+
+int32_t file_blocks_read(const int32_t *block_list, char *buf, int32_t len,
+                         int32_t off, int32_t advice) {
+  if (block_list == NULL || buf == NULL || len < 0 || off < 0) {
+    return MY_ERR;
+  }
+
+  int32_t bs = BLOCK_SIZE;
+  char *block_buf = NULL;
+  int32_t done = 0;
+  // - Blocks read once are the first ones to be reused
+  int cold = advice & SSFS_FADV_NOREUSE ? BCACHE_COLD : 0;
+
+  while (done < len) {
+    int32_t i = (off + done) / bs;
+    int32_t in = (off + done) % bs;
+    int32_t chunk = bs - in < len - done ? bs - in : len - done;
+
+    // - Holes read as zeros without touching the disk
+    if (block_list[i] == ENTRY_INVALID) {
+      memset(buf + done, 0, (size_t)chunk);
+      done += chunk;
+      continue;
+    }
+
+    const char *cached = bcache_get(&bcache, block_list[i], cold);
+    if (cached != NULL) {
+      memcpy(buf + done, cached + in, (size_t)chunk);
+      assert(bcache_put(&bcache, cached) == MY_OK);
+      done += chunk;
+      continue;
+    }
+
+    uint32_t gen = bcache_gen(&bcache);
+    if (chunk == bs) {
+      // - Whole blocks which are contiguous on disk are read at once
+      int32_t n = 1;
+      while (done + (n + 1) * bs <= len &&
+             block_list[i + n] == block_list[i] + n) {
+        n++;
+      }
+
+      if (segment_read(&segment, block_list[i], n, buf + done) != n) {
+        free(block_buf);
+        return MY_ERR;
+      }
+
+      for (int32_t k = 0; k < n; k++) {
+        bcache_insert(&bcache, block_list[i] + k, buf + done + k * bs, gen,
+                      cold);
+      }
+
+      done += n * bs;
+      continue;
+    }
+
+    if (block_buf == NULL && (block_buf = malloc(sb.blocks_size)) == NULL) {
+      return MY_ERR;
+    }
+
+    if (segment_read(&segment, block_list[i], 1, block_buf) != 1) {
+      free(block_buf);
+      return MY_ERR;
+    }
+
+    bcache_insert(&bcache, block_list[i], block_buf, gen, cold);
+    memcpy(buf + done, block_buf + in, (size_t)chunk);
+    done += chunk;
+  }
+
+  free(block_buf);
+
+  return done;
+}
+
+int32_t file_blocks_write(const int32_t *block_list, const char *buf,
+                          int32_t len, int32_t off, int32_t valid) {
+  if (block_list == NULL || buf == NULL || len < 0 || off < 0) {
+    return MY_ERR;
+  }
+
+  int32_t bs = BLOCK_SIZE;
+  char *block_buf = NULL;
+  int32_t done = 0;
+
+  while (done < len) {
+    int32_t i = (off + done) / bs;
+    int32_t in = (off + done) % bs;
+    int32_t chunk = bs - in < len - done ? bs - in : len - done;
+
+    assert(block_list[i] != ENTRY_INVALID);
+
+    if (chunk == bs) {
+      // - Whole blocks which are contiguous on disk are written at once
+      int32_t n = 1;
+      while (done + (n + 1) * bs <= len &&
+             block_list[i + n] == block_list[i] + n) {
+        n++;
+      }
+
+      if (segment_write(&segment, block_list[i], n, buf + done) != n) {
+        free(block_buf);
+        return MY_ERR;
+      }
+
+      done += n * bs;
+      continue;
+    }
+
+    if (block_buf == NULL && (block_buf = malloc(sb.blocks_size)) == NULL) {
+      return MY_ERR;
+    }
+
+    // - Blocks past the end of the file hold no data worth preserving
+    if (i * bs < valid) {
+      if (segment_read(&segment, block_list[i], 1, block_buf) != 1) {
+        free(block_buf);
+        return MY_ERR;
+      }
+    } else {
+      memset(block_buf, 0, sb.blocks_size);
+    }
+
+    memcpy(block_buf + in, buf + done, (size_t)chunk);
+
+    if (segment_write(&segment, block_list[i], 1, block_buf) != 1) {
+      free(block_buf);
+      return MY_ERR;
+    }
+
+    done += chunk;
+  }
+
+  free(block_buf);
+
+  return done;
+}
+
+int32_t file_block_copy(int32_t src, int32_t dst) {
+  char *block_buf = calloc(sb.blocks_size, sizeof(char));
+  if (block_buf == NULL) {
+    return MY_ERR;
+  }
+
+  int32_t r = MY_OK;
+  if ((src != ENTRY_INVALID &&
+       segment_read(&segment, src, 1, block_buf) != 1) ||
+      segment_write(&segment, dst, 1, block_buf) != 1) {
+    r = MY_ERR;
+  }
+
+  free(block_buf);
+
+  return r;
+}
+
+int32_t file_promote(int32_t inode_idx) {
+  inode_t *node = inode_get(&inode_table, inode_idx);
+  inode_state_t *state = inode_get_state(&inode_table, inode_idx);
+  if (node == NULL || inode_load(&inode_table, inode_idx) == MY_ERR) {
+    return MY_ERR;
+  }
+
+  if (!atomic_load_explicit(&state->inlined, memory_order_relaxed)) {
+    return MY_OK;
+  }
+
+  int32_t *block_list = calloc(MAX_BLOCKS_PER_FILE, sizeof(int32_t));
+  char *block_buf = calloc(sb.blocks_size, sizeof(char));
+  if (block_list == NULL || block_buf == NULL) {
+    free(block_list);
+    free(block_buf);
+    return MY_ERR;
+  }
+
+  for (size_t i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    block_list[i] = ENTRY_INVALID;
+  }
+
+  // - An empty file has nothing to move
+  int32_t r = MY_OK;
+  if (node->size > 0) {
+    int32_t block = MY_ERR;
+    if (segment.enabled) {
+      block = segment_allocate(&segment);
+    }
+
+    if (block == MY_ERR) {
+      block = block_allocate(&fbm_table, -1);
+    }
+
+    block_list[0] = block;
+    memcpy(block_buf, node->data, node->size);
+    if (block == MY_ERR ||
+        segment_write(&segment, block_list[0], 1, block_buf) != 1) {
+      r = MY_ERR;
+    }
+  }
+
+  if (r == MY_OK) {
+    _Atomic int32_t *map =
+        atomic_load_explicit(&state->map, memory_order_relaxed);
+
+    inode_write_begin(state);
+    assert(inode_lock_block(&inode_table, inode_idx) == MY_OK);
+
+    r = inode_set_block_list(node, inode_idx, block_list);
+    if (r == MY_OK) {
+      atomic_store_explicit(&map[0], block_list[0], memory_order_relaxed);
+      atomic_store_explicit(&state->inlined, 0, memory_order_relaxed);
+    }
+
+    assert(inode_unlock_block(&inode_table, inode_idx) == MY_OK);
+    inode_write_end(state);
+  }
+
+  if (r == MY_OK) {
+    assert(inode_update(&inode_table, inode_idx) == MY_OK);
+  } else if (block_list[0] != ENTRY_INVALID) {
+    assert(block_deallocate(&fbm_table, block_list[0]) == MY_OK);
+  }
+
+  free(block_list);
+  free(block_buf);
+
+  return r;
+}
+
+int32_t file_readv(int32_t inode_idx, const struct iovec *iov, int iovcnt,
+                   int32_t off, int32_t advice) {
+  inode_t *node = inode_get(&inode_table, inode_idx);
+  inode_state_t *state = inode_get_state(&inode_table, inode_idx);
+  if (node == NULL || iov == NULL || iovcnt < 0 || off < 0 ||
+      inode_load(&inode_table, inode_idx) == MY_ERR) {
+    return MY_ERR;
+  }
+
+  _Atomic int32_t *map =
+      atomic_load_explicit(&state->map, memory_order_acquire);
+  int32_t *block_list = calloc(MAX_BLOCKS_PER_FILE, sizeof(int32_t));
+  if (block_list == NULL) {
+    return MY_ERR;
+  }
+
+  int32_t bs = BLOCK_SIZE;
+  int32_t read_bytes = MY_ERR;
+
+  // - Reads are optimistic: the snapshot is validated once the data is copied
+  // and the shared lock is only taken when writers keep interfering
+  for (int attempt = 0; attempt <= INODE_READ_RETRIES; attempt++) {
+    int locked = attempt == INODE_READ_RETRIES;
+    if (locked) {
+      assert(pthread_rwlock_rdlock(&state->lock) == 0);
+    }
+
+    uint32_t seq = inode_read_begin(state);
+    if ((seq & 1) && !locked) {
+      continue;
+    }
+
+    // - Data held in the I-node is only copied under the shared lock, which
+    // keeps writers from changing it meanwhile
+    int inlined = atomic_load_explicit(&state->inlined, memory_order_relaxed);
+    if (inlined && !locked) {
+      attempt = INODE_READ_RETRIES - 1;
+      continue;
+    }
+
+    int32_t avail = inode_state_size(state) - off;
+    for (int32_t i = off / bs; avail > 0 && i <= (off + avail - 1) / bs; i++) {
+      block_list[i] = atomic_load_explicit(&map[i], memory_order_relaxed);
+    }
+
+    read_bytes = avail > 0 ? 0 : MY_ERR;
+    for (int i = 0; i < iovcnt && read_bytes != MY_ERR && read_bytes < avail;
+         i++) {
+      int32_t len = avail - read_bytes;
+      if (iov[i].iov_len < (size_t)len) {
+        len = (int32_t)iov[i].iov_len;
+      }
+
+      if (inlined) {
+        memcpy(iov[i].iov_base, node->data + off + read_bytes, (size_t)len);
+      } else if (file_blocks_read(block_list, iov[i].iov_base, len,
+                                  off + read_bytes, advice) != len) {
+        read_bytes = MY_ERR;
+        break;
+      }
+
+      read_bytes += len;
+    }
+
+    if (locked) {
+      assert(pthread_rwlock_unlock(&state->lock) == 0);
+    } else if (inode_read_retry(state, seq)) {
+      continue;
+    }
+
+    break;
+  }
+
+  free(block_list);
+
+  return read_bytes;
+}
+
+int32_t file_view(int32_t inode_idx, int32_t off, int32_t len,
+                  ssfs_view_t *view) {
+  inode_t *node = inode_get(&inode_table, inode_idx);
+  inode_state_t *state = inode_get_state(&inode_table, inode_idx);
+  if (node == NULL || view == NULL || off < 0 || len < 0 ||
+      inode_load(&inode_table, inode_idx) == MY_ERR) {
+    return MY_ERR;
+  }
+
+  int32_t bs = BLOCK_SIZE;
+  int32_t r = MY_ERR;
+  view->iovcnt = 0;
+
+  assert(pthread_rwlock_rdlock(&state->lock) == 0);
+
+  int32_t avail = inode_state_size(state) - off;
+  if (len > avail) {
+    len = avail;
+  }
+
+  if (avail > 0 &&
+      atomic_load_explicit(&state->inlined, memory_order_relaxed)) {
+    memcpy(view->data, node->data + off, (size_t)len);
+    view->iov[0].iov_base = view->data;
+    view->iov[0].iov_len = (size_t)len;
+    view->pinned[0] = NULL;
+    view->iovcnt = 1;
+    r = len;
+  } else if (avail > 0) {
+    _Atomic int32_t *map =
+        atomic_load_explicit(&state->map, memory_order_acquire);
+
+    for (r = 0; r < len;) {
+      int32_t i = (off + r) / bs;
+      int32_t in = (off + r) % bs;
+      int32_t chunk = bs - in < len - r ? bs - in : len - r;
+      int32_t block = atomic_load_explicit(&map[i], memory_order_relaxed);
+
+      // - Holes point to zeros without touching the disk
+      const char *data = zero_block;
+      if (block != ENTRY_INVALID &&
+          (data = bcache_load(&bcache, block)) == NULL) {
+        assert(ssfs_release_view(view) == 0);
+        r = MY_ERR;
+        break;
+      }
+
+      view->pinned[view->iovcnt] = block != ENTRY_INVALID ? data : NULL;
+      // - The pieces are only read
+      view->iov[view->iovcnt].iov_base = (char *)data + in;
+      view->iov[view->iovcnt].iov_len = (size_t)chunk;
+      view->iovcnt++;
+      r += chunk;
+    }
+  }
+
+  assert(pthread_rwlock_unlock(&state->lock) == 0);
+
+  return r;
+}
+
+int32_t file_prefetch(int32_t inode_idx, int32_t off, int32_t len, int ahead) {
+  inode_state_t *state = inode_get_state(&inode_table, inode_idx);
+  if (state == NULL || off < 0 || len < 0 ||
+      inode_load(&inode_table, inode_idx) == MY_ERR) {
+    return MY_ERR;
+  }
+
+  int32_t bs = BLOCK_SIZE;
+  char *buf = malloc((size_t)(READAHEAD_BLOCKS * bs));
+  if (buf == NULL) {
+    return MY_ERR;
+  }
+
+  assert(pthread_rwlock_rdlock(&state->lock) == 0);
+
+  int32_t avail = inode_state_size(state) - off;
+  if (len > avail) {
+    len = avail;
+  }
+
+  int32_t r = 0;
+  if (len > 0 &&
+      !atomic_load_explicit(&state->inlined, memory_order_relaxed)) {
+    _Atomic int32_t *map =
+        atomic_load_explicit(&state->map, memory_order_acquire);
+    int32_t last = (off + len - 1) / bs;
+
+    // - A read ahead whose middle is cached was queued again before
+    int32_t middle = atomic_load_explicit(&map[(off / bs + last) / 2],
+                                          memory_order_relaxed);
+    const char *done =
+        ahead && middle != ENTRY_INVALID
+            ? bcache_get(&bcache, middle, BCACHE_AHEAD)
+            : NULL;
+    if (done != NULL) {
+      assert(bcache_put(&bcache, done) == MY_OK);
+    }
+
+    for (int32_t i = off / bs; i <= last && done == NULL;) {
+      int32_t block = atomic_load_explicit(&map[i], memory_order_relaxed);
+      const char *cached =
+          block != ENTRY_INVALID ? bcache_get(&bcache, block, BCACHE_AHEAD)
+                                 : NULL;
+      if (cached != NULL) {
+        assert(bcache_put(&bcache, cached) == MY_OK);
+      }
+
+      if (block == ENTRY_INVALID || cached != NULL) {
+        i++;
+        continue;
+      }
+
+      // - Blocks which follow each other on disk are read at once
+      int32_t n = 1;
+      while (i + n <= last && n < READAHEAD_BLOCKS &&
+             atomic_load_explicit(&map[i + n], memory_order_relaxed) ==
+                 block + n) {
+        n++;
+      }
+
+      uint32_t gen = bcache_gen(&bcache);
+      if (segment_read(&segment, block, n, buf) != n) {
+        r = MY_ERR;
+        break;
+      }
+
+      for (int32_t k = 0; k < n; k++) {
+        bcache_insert(&bcache, block + k, buf + k * bs, gen, BCACHE_AHEAD);
+      }
+
+      r += n;
+      i += n;
+    }
+  }
+
+  assert(pthread_rwlock_unlock(&state->lock) == 0);
+  free(buf);
+
+  return r;
+}
+
+int32_t file_readahead(int32_t inode_idx, int32_t advice, int32_t off) {
+  if (inode_idx < 0 || inode_idx >= MAX_FILES || off < 0) {
+    return MY_ERR;
+  }
+
+  if (!(advice & SSFS_FADV_SEQUENTIAL)) {
+    return MY_OK;
+  }
+
+  // - The block holding the position was just read, so the read-ahead starts
+  // at the next one
+  int32_t bs = BLOCK_SIZE;
+  int32_t start = (off + bs - 1) / bs * bs;
+
+  return aio_prefetch(&aio, inode_idx, start, READAHEAD_BLOCKS * bs, 1);
+}
+
+int32_t file_evict(int32_t inode_idx, int32_t off, int32_t len) {
+  inode_state_t *state = inode_get_state(&inode_table, inode_idx);
+  if (state == NULL || off < 0 || len < 0 ||
+      inode_load(&inode_table, inode_idx) == MY_ERR) {
+    return MY_ERR;
+  }
+
+  int32_t bs = BLOCK_SIZE;
+
+  assert(pthread_rwlock_rdlock(&state->lock) == 0);
+
+  int32_t avail = inode_state_size(state) - off;
+  if (len > avail) {
+    len = avail;
+  }
+
+  if (len > 0 &&
+      !atomic_load_explicit(&state->inlined, memory_order_relaxed)) {
+    _Atomic int32_t *map =
+        atomic_load_explicit(&state->map, memory_order_acquire);
+    for (int32_t i = off / bs; i <= (off + len - 1) / bs; i++) {
+      int32_t block = atomic_load_explicit(&map[i], memory_order_relaxed);
+      if (block != ENTRY_INVALID) {
+        assert(bcache_invalidate(&bcache, block, 1) == MY_OK);
+      }
+    }
+  }
+
+  assert(pthread_rwlock_unlock(&state->lock) == 0);
+
+  return MY_OK;
+}
+
+int32_t file_writev(int32_t inode_idx, const struct iovec *iov, int iovcnt,
+                    int32_t off) {
+  inode_t *node = inode_get(&inode_table, inode_idx);
+  inode_state_t *state = inode_get_state(&inode_table, inode_idx);
+  if (node == NULL || iov == NULL || iovcnt < 0 || off < 0 ||
+      inode_load(&inode_table, inode_idx) == MY_ERR) {
+    return MY_ERR;
+  }
+
+  int32_t avail = FILE_SIZE_MAX - off;
+  if (avail <= 0) {
+    return MY_ERR;
+  }
+
+  int32_t length = 0;
+  for (int i = 0; i < iovcnt && length < avail; i++) {
+    if (iov[i].iov_len >= (size_t)(avail - length)) {
+      length = avail;
+    } else {
+      length += (int32_t)iov[i].iov_len;
+    }
+  }
+
+  if (length == 0) {
+    return 0;
+  }
+
+  assert(pthread_rwlock_wrlock(&state->lock) == 0);
+
+  // - Writers are serialised by the lock, so relaxed loads see their own state
+  _Atomic int32_t *map =
+      atomic_load_explicit(&state->map, memory_order_relaxed);
+  int32_t valid = inode_state_size(state);
+
+  // - Data which still fits in the I-node is written there, which only costs
+  // the update of the I-node block
+  if (atomic_load_explicit(&state->inlined, memory_order_relaxed) &&
+      off + length <= INODE_INLINE_MAX) {
+    inode_write_begin(state);
+    assert(inode_lock_block(&inode_table, inode_idx) == MY_OK);
+
+    int32_t written_bytes = 0;
+    for (int i = 0; i < iovcnt && written_bytes < length; i++) {
+      int32_t len = length - written_bytes;
+      if (iov[i].iov_len < (size_t)len) {
+        len = (int32_t)iov[i].iov_len;
+      }
+
+      memcpy(node->data + off + written_bytes, iov[i].iov_base, (size_t)len);
+      written_bytes += len;
+    }
+
+    if (valid < off + length) {
+      node->size = (uint32_t)(off + length);
+      atomic_store_explicit(&state->size, node->size, memory_order_relaxed);
+    }
+
+    assert(inode_unlock_block(&inode_table, inode_idx) == MY_OK);
+    inode_write_end(state);
+
+    assert(inode_update(&inode_table, inode_idx) == MY_OK);
+    assert(pthread_rwlock_unlock(&state->lock) == 0);
+
+    return length;
+  }
+
+  if (file_promote(inode_idx) == MY_ERR) {
+    assert(pthread_rwlock_unlock(&state->lock) == 0);
+    return MY_ERR;
+  }
+  int32_t *block_list = calloc(MAX_BLOCKS_PER_FILE, sizeof(int32_t));
+  if (block_list == NULL) {
+    assert(pthread_rwlock_unlock(&state->lock) == 0);
+    return MY_ERR;
+  }
+
+  for (size_t i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    block_list[i] = atomic_load_explicit(&map[i], memory_order_relaxed);
+  }
+
+  int32_t bs = BLOCK_SIZE;
+  int32_t first = off / bs;
+  int32_t last = (off + length - 1) / bs;
+  int changed = 0;
+
+  // - Blocks shared with a snapshot are written to a copy instead, and in
+  // log-structured mode every block is, unless the disk is full
+  for (int32_t i = first; i <= last; i++) {
+    int32_t block = MY_ERR;
+    if (segment.enabled) {
+      block = segment_allocate(&segment);
+    }
+
+    if (block == MY_ERR) {
+      block = block_list[i] == ENTRY_INVALID
+                  ? block_allocate(&fbm_table, -1)
+                  : block_cow(&fbm_table, block_list[i]);
+    }
+
+    if (block == MY_ERR) {
+      last = i - 1;
+      break;
+    }
+
+    changed |= block != block_list[i];
+    block_list[i] = block;
+  }
+
+  if ((last + 1) * bs - off < length) {
+    length = (last + 1) * bs - off;
+  }
+
+  // - Copies of blocks which are only partly overwritten keep the rest, while
+  // holes which are partly filled keep reading as zeros
+  int32_t copied = 0;
+  for (int32_t i = first; i <= last && copied != MY_ERR; i++) {
+    int32_t old = atomic_load_explicit(&map[i], memory_order_relaxed);
+    int partial = i * bs < off || (i + 1) * bs > off + length;
+    if (old != block_list[i] && partial && i * bs < valid) {
+      copied = file_block_copy(old, block_list[i]);
+    }
+  }
+
+  inode_write_begin(state);
+
+  int32_t written_bytes = 0;
+  for (int i = 0; i < iovcnt && written_bytes < length; i++) {
+    int32_t len = length - written_bytes;
+    if (iov[i].iov_len < (size_t)len) {
+      len = (int32_t)iov[i].iov_len;
+    }
+
+    // - Blocks filled by an earlier buffer are read back like the old data
+    int32_t filled = valid;
+    if (written_bytes > 0 && off + written_bytes > valid) {
+      filled = off + written_bytes;
+    }
+
+    if (copied == MY_ERR ||
+        file_blocks_write(block_list, iov[i].iov_base, len,
+                          off + written_bytes, filled) != len) {
+      written_bytes = MY_ERR;
+      break;
+    }
+
+    written_bytes += len;
+  }
+
+  // - Data is on disk before the I-node that makes it reachable
+  assert(inode_lock_block(&inode_table, inode_idx) == MY_OK);
+
+  if (changed && inode_set_block_list(node, inode_idx, block_list) == MY_ERR) {
+    // - Nothing references the new blocks, so the write did not happen
+    for (int32_t i = first; i <= last; i++) {
+      if (block_list[i] != atomic_load_explicit(&map[i], memory_order_relaxed)) {
+        assert(block_deallocate(&fbm_table, block_list[i]) == MY_OK);
+      }
+    }
+
+    changed = 0;
+    written_bytes = MY_ERR;
+  } else if (changed) {
+    for (int32_t i = first; i <= last; i++) {
+      int32_t old = atomic_load_explicit(&map[i], memory_order_relaxed);
+      atomic_store_explicit(&map[i], block_list[i], memory_order_relaxed);
+
+      // - Readers holding the old map retry once the sequence count moves
+      if (old != ENTRY_INVALID && old != block_list[i]) {
+        assert(block_deallocate(&fbm_table, old) == MY_OK);
+      }
+    }
+  }
+
+  if (written_bytes > 0 && valid < off + written_bytes) {
+    node->size = (uint32_t)(off + written_bytes);
+    atomic_store_explicit(&state->size, node->size, memory_order_relaxed);
+    changed = 1;
+  }
+
+  assert(inode_unlock_block(&inode_table, inode_idx) == MY_OK);
+  inode_write_end(state);
+
+  if (changed) {
+    assert(inode_update(&inode_table, inode_idx) == MY_OK);
+  }
+
+  assert(pthread_rwlock_unlock(&state->lock) == 0);
+  free(block_list);
+
+  return written_bytes;
+}
+
+int32_t file_copy(int32_t in_idx, int32_t off_in, int32_t out_idx,
+                  int32_t off_out, int32_t len) {
+  if (off_in < 0 || off_out < 0 || len < 0) {
+    return MY_ERR;
+  }
+
+  char *buf = malloc(COPY_CHUNK_BLOCKS * BLOCK_SIZE);
+  if (buf == NULL) {
+    return MY_ERR;
+  }
+
+  int32_t done = 0;
+  while (done < len) {
+    int32_t n = len - done;
+    if (n > COPY_CHUNK_BLOCKS * BLOCK_SIZE) {
+      n = COPY_CHUNK_BLOCKS * BLOCK_SIZE;
+    }
+
+    struct iovec iov = {buf, (size_t)n};
+    int32_t r =
+        file_readv(in_idx, &iov, 1, off_in + done, SSFS_FADV_NORMAL);
+    if (r <= 0) {
+      break;
+    }
+
+    iov.iov_len = (size_t)r;
+    int32_t w = file_writev(out_idx, &iov, 1, off_out + done);
+    if (w > 0) {
+      done += w;
+    }
+
+    if (w != r) {
+      break;
+    }
+  }
+
+  free(buf);
+
+  return done > 0 || len == 0 ? done : MY_ERR;
+}
+
+int32_t file_remap(int32_t in_idx, int32_t in_block, int32_t out_idx,
+                   int32_t out_block, int32_t num) {
+  inode_state_t *in = inode_get_state(&inode_table, in_idx);
+  inode_t *node = inode_get(&inode_table, out_idx);
+  inode_state_t *state = inode_get_state(&inode_table, out_idx);
+  if (in == NULL || node == NULL || in_block < 0 || out_block < 0 ||
+      num <= 0 || in_block + num > MAX_BLOCKS_PER_FILE ||
+      out_block + num > MAX_BLOCKS_PER_FILE ||
+      inode_load(&inode_table, in_idx) == MY_ERR ||
+      inode_load(&inode_table, out_idx) == MY_ERR) {
+    return MY_ERR;
+  }
+
+  int32_t *shared = calloc((size_t)num, sizeof(int32_t));
+  int32_t *block_list = calloc(MAX_BLOCKS_PER_FILE, sizeof(int32_t));
+  int32_t *old_list = calloc(MAX_BLOCKS_PER_FILE, sizeof(int32_t));
+  if (shared == NULL || block_list == NULL || old_list == NULL) {
+    free(shared);
+    free(block_list);
+    free(old_list);
+    return MY_ERR;
+  }
+
+  // - The blocks gain a reference while writers of the source are kept out,
+  // so they copy the blocks before changing them from then on
+  assert(pthread_rwlock_rdlock(&in->lock) == 0);
+
+  _Atomic int32_t *map = atomic_load_explicit(&in->map, memory_order_acquire);
+  // - Data held in the I-node has no blocks to share
+  int32_t r = atomic_load_explicit(&in->inlined, memory_order_relaxed)
+                  ? MY_ERR
+                  : MY_OK;
+  for (int32_t i = 0; i < num; i++) {
+    shared[i] = atomic_load_explicit(&map[in_block + i], memory_order_relaxed);
+  }
+
+  assert(pthread_mutex_lock(&fbm_lock) == 0);
+
+  // - Holes are mapped as holes
+  for (int32_t i = 0; i < num && r == MY_OK; i++) {
+    if (shared[i] != ENTRY_INVALID &&
+        rc_table.count[shared[i]] == UINT16_MAX) {
+      r = MY_ERR;
+    }
+  }
+
+  for (int32_t i = 0; i < num && r == MY_OK; i++) {
+    if (shared[i] != ENTRY_INVALID) {
+      rc_table.count[shared[i]]++;
+    }
+  }
+
+  if (r == MY_OK) {
+    r = rc_update(&rc_table, ENTRY_INVALID);
+  }
+
+  assert(pthread_mutex_unlock(&fbm_lock) == 0);
+  assert(pthread_rwlock_unlock(&in->lock) == 0);
+
+  if (r == MY_ERR) {
+    free(shared);
+    free(block_list);
+    free(old_list);
+    return MY_ERR;
+  }
+
+  assert(pthread_rwlock_wrlock(&state->lock) == 0);
+
+  r = file_promote(out_idx);
+  map = atomic_load_explicit(&state->map, memory_order_relaxed);
+  int32_t bs = BLOCK_SIZE;
+  uint32_t valid = atomic_load_explicit(&state->size, memory_order_relaxed);
+  for (size_t i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    old_list[i] = atomic_load_explicit(&map[i], memory_order_relaxed);
+    block_list[i] = old_list[i];
+  }
+
+  for (int32_t i = 0; i < num; i++) {
+    block_list[out_block + i] = shared[i];
+  }
+
+  if (r == MY_OK) {
+    inode_write_begin(state);
+    assert(inode_lock_block(&inode_table, out_idx) == MY_OK);
+
+    r = inode_set_block_list(node, out_idx, block_list);
+    if (r == MY_OK) {
+      for (int32_t i = 0; i < num; i++) {
+        atomic_store_explicit(&map[out_block + i], shared[i],
+                              memory_order_relaxed);
+      }
+
+      uint32_t end = (uint32_t)((out_block + num) * bs);
+      if (valid < end) {
+        node->size = end;
+        atomic_store_explicit(&state->size, end, memory_order_relaxed);
+      }
+    }
+
+    assert(inode_unlock_block(&inode_table, out_idx) == MY_OK);
+    inode_write_end(state);
+  }
+
+  if (r == MY_OK) {
+    assert(inode_update(&inode_table, out_idx) == MY_OK);
+  }
+
+  // - On failure the references taken above are dropped instead
+  for (int32_t i = 0; i < num; i++) {
+    int32_t b = r == MY_OK ? old_list[out_block + i] : shared[i];
+    if (b != ENTRY_INVALID) {
+      assert(block_deallocate(&fbm_table, b) == MY_OK);
+    }
+  }
+
+  assert(pthread_rwlock_unlock(&state->lock) == 0);
+  free(shared);
+  free(block_list);
+  free(old_list);
+
+  return r == MY_OK ? num * bs : MY_ERR;
+}
+
+int32_t file_allocate(int32_t inode_idx, int32_t off, int32_t len) {
+  inode_t *node = inode_get(&inode_table, inode_idx);
+  inode_state_t *state = inode_get_state(&inode_table, inode_idx);
+  if (node == NULL || off < 0 || len <= 0 || len > FILE_SIZE_MAX - off ||
+      inode_load(&inode_table, inode_idx) == MY_ERR) {
+    return MY_ERR;
+  }
+
+  int32_t *block_list = calloc(MAX_BLOCKS_PER_FILE, sizeof(int32_t));
+  int32_t *fresh = calloc(MAX_BLOCKS_PER_FILE, sizeof(int32_t));
+  if (block_list == NULL || fresh == NULL) {
+    free(block_list);
+    free(fresh);
+    return MY_ERR;
+  }
+
+  assert(pthread_rwlock_wrlock(&state->lock) == 0);
+
+  if (file_promote(inode_idx) == MY_ERR) {
+    assert(pthread_rwlock_unlock(&state->lock) == 0);
+    free(block_list);
+    free(fresh);
+    return MY_ERR;
+  }
+
+  _Atomic int32_t *map =
+      atomic_load_explicit(&state->map, memory_order_relaxed);
+  int32_t bs = BLOCK_SIZE;
+  int32_t first = off / bs;
+  int32_t last = (off + len - 1) / bs;
+  int32_t num = 0;
+  for (int32_t i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    block_list[i] = atomic_load_explicit(&map[i], memory_order_relaxed);
+    if (i >= first && i <= last && block_list[i] == ENTRY_INVALID) {
+      num++;
+    }
+  }
+
+  // - The run follows the block before the range where possible
+  int32_t hint = -1;
+  if (first > 0 && block_list[first - 1] != ENTRY_INVALID) {
+    hint = block_list[first - 1] + 1;
+  }
+
+  int32_t r = MY_OK;
+  if (num > 0) {
+    r = block_allocate_run(&fbm_table, hint, num, fresh) == num ? MY_OK
+                                                                 : MY_ERR;
+  }
+
+  // - Stale data of the blocks must not show through holes or a later
+  // truncate that grows the file
+  char *zero = num > 0 && r == MY_OK ? calloc((size_t)num, sb.blocks_size)
+                                     : NULL;
+  if (num > 0 && r == MY_OK && zero == NULL) {
+    r = MY_ERR;
+  }
+
+  for (int32_t k = 0; k < num && r == MY_OK;) {
+    int32_t n = 1;
+    while (k + n < num && fresh[k + n] == fresh[k] + n) {
+      n++;
+    }
+
+    if (segment_write(&segment, fresh[k], n, zero) != n) {
+      r = MY_ERR;
+    }
+
+    k += n;
+  }
+
+  free(zero);
+
+  for (int32_t i = first, k = 0; i <= last && r == MY_OK; i++) {
+    if (block_list[i] == ENTRY_INVALID) {
+      block_list[i] = fresh[k++];
+    }
+  }
+
+  if (num > 0) {
+    inode_write_begin(state);
+    assert(inode_lock_block(&inode_table, inode_idx) == MY_OK);
+
+    if (r == MY_OK &&
+        inode_set_block_list(node, inode_idx, block_list) == MY_OK) {
+      for (int32_t i = first; i <= last; i++) {
+        atomic_store_explicit(&map[i], block_list[i], memory_order_relaxed);
+      }
+    } else if (r == MY_OK) {
+      // - Nothing references the new blocks
+      assert(block_deallocate_list(&fbm_table, fresh, num) == MY_OK);
+      r = MY_ERR;
+    }
+
+    assert(inode_unlock_block(&inode_table, inode_idx) == MY_OK);
+    inode_write_end(state);
+
+    if (r == MY_OK) {
+      assert(inode_update(&inode_table, inode_idx) == MY_OK);
+    }
+  }
+
+  assert(pthread_rwlock_unlock(&state->lock) == 0);
+  free(block_list);
+  free(fresh);
+
+  return r;
+}
+
+int32_t file_truncate(int32_t inode_idx, int32_t len) {
+  inode_t *node = inode_get(&inode_table, inode_idx);
+  inode_state_t *state = inode_get_state(&inode_table, inode_idx);
+  if (node == NULL || len < 0 || len > FILE_SIZE_MAX ||
+      inode_load(&inode_table, inode_idx) == MY_ERR) {
+    return MY_ERR;
+  }
+
+  int32_t *block_list = calloc(MAX_BLOCKS_PER_FILE, sizeof(int32_t));
+  int32_t *old_list = calloc(MAX_BLOCKS_PER_FILE, sizeof(int32_t));
+  char *block_buf = malloc(sb.blocks_size);
+  if (block_list == NULL || old_list == NULL || block_buf == NULL) {
+    free(block_list);
+    free(old_list);
+    free(block_buf);
+    return MY_ERR;
+  }
+
+  assert(pthread_rwlock_wrlock(&state->lock) == 0);
+
+  _Atomic int32_t *map =
+      atomic_load_explicit(&state->map, memory_order_relaxed);
+  int32_t bs = BLOCK_SIZE;
+  int32_t valid = inode_state_size(state);
+
+  // - Data held in the I-node is cut in place, or moved to a block first if
+  // the file grows past it
+  if (atomic_load_explicit(&state->inlined, memory_order_relaxed) &&
+      len <= INODE_INLINE_MAX) {
+    inode_write_begin(state);
+    assert(inode_lock_block(&inode_table, inode_idx) == MY_OK);
+
+    if (len < valid) {
+      memset(node->data + len, 0, (size_t)(valid - len));
+    }
+
+    node->size = (uint32_t)len;
+    atomic_store_explicit(&state->size, node->size, memory_order_relaxed);
+
+    assert(inode_unlock_block(&inode_table, inode_idx) == MY_OK);
+    inode_write_end(state);
+
+    assert(inode_update(&inode_table, inode_idx) == MY_OK);
+    assert(pthread_rwlock_unlock(&state->lock) == 0);
+    free(block_list);
+    free(old_list);
+    free(block_buf);
+    return MY_OK;
+  }
+
+  if (file_promote(inode_idx) == MY_ERR) {
+    assert(pthread_rwlock_unlock(&state->lock) == 0);
+    free(block_list);
+    free(old_list);
+    free(block_buf);
+    return MY_ERR;
+  }
+  int32_t keep = (len + bs - 1) / bs;
+  int changed = 0;
+  for (int32_t i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    old_list[i] = atomic_load_explicit(&map[i], memory_order_relaxed);
+    block_list[i] = i < keep ? old_list[i] : ENTRY_INVALID;
+    changed |= block_list[i] != old_list[i];
+  }
+
+  inode_write_begin(state);
+
+  // - The rest of the last block is zeroed, so growing the file again reads
+  // zeros. It is written to a copy like any other write.
+  int32_t r = MY_OK;
+  int32_t tail = len / bs;
+  if (len < valid && len % bs != 0 && old_list[tail] != ENTRY_INVALID) {
+    int32_t block = MY_ERR;
+    if (segment.enabled) {
+      block = segment_allocate(&segment);
+    }
+
+    if (block == MY_ERR) {
+      block = block_cow(&fbm_table, old_list[tail]);
+    }
+
+    if (block == MY_ERR ||
+        segment_read(&segment, old_list[tail], 1, block_buf) != 1) {
+      r = MY_ERR;
+    } else {
+      memset(block_buf + len % bs, 0, (size_t)(bs - len % bs));
+      if (segment_write(&segment, block, 1, block_buf) != 1) {
+        r = MY_ERR;
+      }
+    }
+
+    if (block != MY_ERR) {
+      block_list[tail] = block;
+      changed |= block != old_list[tail];
+    }
+  }
+
+  assert(inode_lock_block(&inode_table, inode_idx) == MY_OK);
+
+  if (r == MY_OK && changed) {
+    r = inode_set_block_list(node, inode_idx, block_list);
+  }
+
+  if (r == MY_OK) {
+    for (int32_t i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+      atomic_store_explicit(&map[i], block_list[i], memory_order_relaxed);
+    }
+
+    node->size = (uint32_t)len;
+    atomic_store_explicit(&state->size, node->size, memory_order_relaxed);
+  }
+
+  assert(inode_unlock_block(&inode_table, inode_idx) == MY_OK);
+  inode_write_end(state);
+
+  if (r == MY_OK && (changed || len != valid)) {
+    assert(inode_update(&inode_table, inode_idx) == MY_OK);
+  }
+
+  // - The blocks no longer referenced are released at once, which are the
+  // old ones on success and the new copy otherwise
+  for (int32_t i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    int32_t released = r == MY_OK ? old_list[i] : block_list[i];
+    int32_t kept = r == MY_OK ? block_list[i] : old_list[i];
+    old_list[i] = released != kept ? released : ENTRY_INVALID;
+  }
+
+  assert(block_deallocate_list(&fbm_table, old_list, MAX_BLOCKS_PER_FILE) ==
+         MY_OK);
+
+  assert(pthread_rwlock_unlock(&state->lock) == 0);
+  free(block_list);
+  free(old_list);
+  free(block_buf);
+
+  return r;
+}
+
+// - Journal
+
+int32_t journal_begin(journal_t *j) {
+  if (j == NULL) {
+    return MY_ERR;
+  }
+
+  if (journal_depth++ > 0) {
+    return MY_OK;
+  }
+
+  assert(pthread_mutex_lock(&j->lock) == 0);
+
+  // - Every handle may add a few blocks, so a full transaction is committed
+  // before a new handle joins the next one
+  int32_t r = MY_OK;
+  uint32_t used = j->count + j->revoked;
+  while (r == MY_OK &&
+         used + (j->updates + 1) * JOURNAL_HANDLE_BLOCKS > JOURNAL_TX_MAX) {
+    if (j->updates == 0 && !j->committing) {
+      r = journal_commit(j);
+    } else {
+      assert(pthread_cond_wait(&j->cond, &j->lock) == 0);
+    }
+
+    used = j->count + j->revoked;
+  }
+
+  if (r == MY_OK) {
+    j->updates++;
+  } else {
+    journal_depth--;
+  }
+
+  assert(pthread_mutex_unlock(&j->lock) == 0);
+
+  return r;
+}
+
+int32_t journal_end(journal_t *j) {
+  if (j == NULL || journal_depth == 0) {
+    return MY_ERR;
+  }
+
+  if (--journal_depth > 0) {
+    return MY_OK;
+  }
+
+  assert(pthread_mutex_lock(&j->lock) == 0);
+
+  j->updates--;
+  if (j->updates == 0) {
+    assert(pthread_cond_broadcast(&j->cond) == 0);
+  }
+
+  // - Transactions only advance once all their handles ended, so the running
+  // one holds the changes of this handle
+  int32_t r = MY_OK;
+  uint32_t tid = j->tid;
+  int delay = journal_dirtied && segment.enabled;
+  while (journal_dirtied && !delay && r == MY_OK && j->committed < tid) {
+    if (j->updates == 0 && !j->committing && j->tid == tid) {
+      r = journal_commit(j);
+    } else {
+      assert(pthread_cond_wait(&j->cond, &j->lock) == 0);
+    }
+  }
+
+  journal_dirtied = 0;
+  assert(pthread_mutex_unlock(&j->lock) == 0);
+
+  if (delay) {
+    r = segment_delay(&segment);
+  }
+
+  return r;
+}
+
+int32_t journal_sync(journal_t *j) {
+  if (j == NULL || journal_depth > 0) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&j->lock) == 0);
+
+  int32_t r = MY_OK;
+  uint32_t tid = j->tid;
+  while (r == MY_OK && j->committed < tid) {
+    if (j->updates == 0 && !j->committing && j->tid == tid) {
+      r = journal_commit(j);
+    } else {
+      assert(pthread_cond_wait(&j->cond, &j->lock) == 0);
+    }
+  }
+
+  assert(pthread_mutex_unlock(&j->lock) == 0);
+
+  return r;
+}
+
+int32_t journal_extend(journal_t *j) {
+  if (j == NULL || journal_depth != 1) {
+    return MY_ERR;
+  }
+
+  // - The handle keeps its share of the transaction as long as the blocks
+  // already in it leave a share to every open handle
+  assert(pthread_mutex_lock(&j->lock) == 0);
+  int room =
+      j->count + j->revoked + j->updates * JOURNAL_HANDLE_BLOCKS <=
+      JOURNAL_TX_MAX;
+  assert(pthread_mutex_unlock(&j->lock) == 0);
+
+  if (!room) {
+    assert(journal_end(j) == MY_OK);
+    assert(journal_begin(j) == MY_OK);
+  }
+
+  return MY_OK;
+}
+
+int32_t journal_write(journal_t *j, int32_t block, const void *data) {
+  if (j == NULL || data == NULL || block < 0 || block >= NUM_BLOCKS) {
+    return MY_ERR;
+  }
+
+  if (journal_depth == 0) {
+    int32_t r = journal_begin(j);
+    if (r == MY_OK) {
+      r = journal_write(j, block, data);
+      if (journal_end(j) == MY_ERR) {
+        r = MY_ERR;
+      }
+    }
+
+    return r;
+  }
+
+  assert(pthread_mutex_lock(&j->lock) == 0);
+
+  if (j->running[block] == NULL) {
+    char *image = NULL;
+    if (j->count + j->revoked < JOURNAL_TX_MAX) {
+      image = malloc(BLOCK_SIZE);
+    }
+
+    if (image == NULL) {
+      assert(pthread_mutex_unlock(&j->lock) == 0);
+      return MY_ERR;
+    }
+
+    // - A block written again after being freed is no longer revoked
+    for (uint32_t i = 0; i < j->revoked; i++) {
+      if (j->revoke[i] == block) {
+        j->revoke[i] = j->revoke[--j->revoked];
+        break;
+      }
+    }
+
+    j->running[block] = image;
+    j->block[j->count++] = block;
+  }
+
+  memcpy(j->running[block], data, BLOCK_SIZE);
+  journal_dirtied = 1;
+
+  assert(pthread_mutex_unlock(&j->lock) == 0);
+
+  return MY_OK;
+}
+
+int32_t journal_read(journal_t *j, int32_t block, void *data) {
+  if (j == NULL || data == NULL || block < 0 || block >= NUM_BLOCKS) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&j->lock) == 0);
+
+  const char *image = j->running[block];
+  if (image == NULL) {
+    image = j->pending[block];
+  }
+
+  if (image != NULL) {
+    memcpy(data, image, BLOCK_SIZE);
+  }
+
+  assert(pthread_mutex_unlock(&j->lock) == 0);
+
+  if (image == NULL && read_blocks(block, 1, data) != 1) {
+    return MY_ERR;
+  }
+
+  return MY_OK;
+}
+
+int32_t journal_revoke(journal_t *j, int32_t block) {
+  if (j == NULL || block < 0 || block >= NUM_BLOCKS) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&j->lock) == 0);
+
+  // - Only blocks which may still be replayed need a revoke record
+  int journaled = j->running[block] != NULL || j->pending[block] != NULL;
+
+  if (j->running[block] != NULL) {
+    for (uint32_t i = 0; i < j->count; i++) {
+      if (j->block[i] == block) {
+        j->block[i] = j->block[--j->count];
+        break;
+      }
+    }
+
+    free(j->running[block]);
+    j->running[block] = NULL;
+  }
+
+  free(j->pending[block]);
+  j->pending[block] = NULL;
+
+  assert(pthread_mutex_unlock(&j->lock) == 0);
+
+  if (!journaled) {
+    return MY_OK;
+  }
+
+  int32_t r = journal_begin(j);
+  if (r == MY_OK) {
+    assert(pthread_mutex_lock(&j->lock) == 0);
+
+    if (j->count + j->revoked < JOURNAL_TX_MAX) {
+      j->revoke[j->revoked++] = block;
+      journal_dirtied = 1;
+    } else {
+      r = MY_ERR;
+    }
+
+    assert(pthread_mutex_unlock(&j->lock) == 0);
+
+    if (journal_end(j) == MY_ERR) {
+      r = MY_ERR;
+    }
+  }
+
+  return r;
+}
+
+int32_t journal_commit(journal_t *j) {
+  if (j == NULL) {
+    return MY_ERR;
+  }
+
+  assert(j->updates == 0 && !j->committing);
+
+  if (j->count == 0 && j->revoked == 0) {
+    j->committed = j->tid++;
+    return MY_OK;
+  }
+
+  assert(j->count <= JOURNAL_TX_MAX);
+  int32_t num = (int32_t)j->count + 2;
+  if (j->head + num > sb.journal_block_num &&
+      journal_checkpoint(j) == MY_ERR) {
+    return MY_ERR;
+  }
+
+  char *buf = calloc((size_t)num, BLOCK_SIZE);
+  if (buf == NULL) {
+    return MY_ERR;
+  }
+
+  journal_record_t *d = (journal_record_t *)buf;
+  d->magic = JOURNAL_MAGIC;
+  d->type = JOURNAL_DESCRIPTOR;
+  d->tid = j->tid;
+  d->count = j->count;
+  d->revoked = j->revoked;
+
+  for (uint32_t i = 0; i < j->count; i++) {
+    int32_t block = j->block[i];
+    d->block[i] = block;
+    memcpy(buf + (i + 1) * BLOCK_SIZE, j->running[block], BLOCK_SIZE);
+
+    // - Committed images serve reads until they are checkpointed
+    free(j->pending[block]);
+    j->pending[block] = j->running[block];
+    j->running[block] = NULL;
+  }
+
+  for (uint32_t i = 0; i < j->revoked; i++) {
+    d->block[j->count + i] = j->revoke[i];
+  }
+
+  journal_record_t *c = (journal_record_t *)(buf + (num - 1) * BLOCK_SIZE);
+  c->magic = JOURNAL_MAGIC;
+  c->type = JOURNAL_COMMIT;
+  c->tid = j->tid;
+  c->checksum = journal_checksum(buf, (size_t)(num - 1) * BLOCK_SIZE);
+
+  uint32_t tid = j->tid++;
+  int32_t start = sb.journal_block_idx + j->head;
+  j->head += num;
+  j->count = 0;
+  j->revoked = 0;
+  j->committing = 1;
+
+  // - The next transaction gathers handles while this one is written, and
+  // the data it references is written first
+  assert(pthread_mutex_unlock(&j->lock) == 0);
+  assert(pthread_mutex_lock(&segment.lock) == 0);
+  int32_t r = segment_flush(&segment);
+  assert(pthread_mutex_unlock(&segment.lock) == 0);
+  if (r == MY_OK) {
+    r = write_blocks(start, num, buf) == num ? MY_OK : MY_ERR;
+  }
+  assert(pthread_mutex_lock(&j->lock) == 0);
+
+  j->committing = 0;
+  if (r == MY_OK) {
+    j->committed = tid;
+  }
+
+  assert(pthread_cond_broadcast(&j->cond) == 0);
+  free(buf);
+
+  return r;
+}
+
+int32_t journal_checkpoint(journal_t *j) {
+  if (j == NULL) {
+    return MY_ERR;
+  }
+
+  // - Buffered data never lands on top of a home location written here
+  assert(pthread_mutex_lock(&segment.lock) == 0);
+  int32_t flushed = segment_flush(&segment);
+  assert(pthread_mutex_unlock(&segment.lock) == 0);
+
+  // - Runs of adjacent blocks are written home at once
+  char *buf = malloc(NUM_BLOCKS * BLOCK_SIZE);
+  if (flushed == MY_ERR || buf == NULL) {
+    free(buf);
+    return MY_ERR;
+  }
+
+  for (int32_t i = 0; i < NUM_BLOCKS;) {
+    int32_t n = 0;
+    while (i + n < NUM_BLOCKS && j->pending[i + n] != NULL) {
+      memcpy(buf + n * BLOCK_SIZE, j->pending[i + n], BLOCK_SIZE);
+      n++;
+    }
+
+    if (n > 0 && write_blocks(i, n, buf) != n) {
+      free(buf);
+      return MY_ERR;
+    }
+
+    i += n + 1;
+  }
+
+  free(buf);
+
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    free(j->pending[i]);
+    j->pending[i] = NULL;
+  }
+
+  journal_record_t *h = calloc(1, BLOCK_SIZE);
+  if (h == NULL) {
+    return MY_ERR;
+  }
+
+  h->magic = JOURNAL_MAGIC;
+  h->type = JOURNAL_HEADER;
+  h->tid = j->tid;
+  j->head = 1;
+
+  int32_t r = write_blocks(sb.journal_block_idx, 1, h) == 1 ? MY_OK : MY_ERR;
+  free(h);
+
+  return r;
+}
+
+int32_t journal_replay(journal_t *j) {
+  if (j == NULL || sb.journal_block_num <= 0) {
+    return MY_ERR;
+  }
+
+  size_t size = JOURNAL_BLOCK_NUM * BLOCK_SIZE;
+  char *buf = malloc(size);
+  uint32_t *revoked_by = calloc(NUM_BLOCKS, sizeof(uint32_t));
+  if (buf == NULL || revoked_by == NULL ||
+      read_blocks(sb.journal_block_idx, sb.journal_block_num, buf) !=
+          sb.journal_block_num) {
+    free(buf);
+    free(revoked_by);
+    return MY_ERR;
+  }
+
+  journal_record_t *h = (journal_record_t *)buf;
+  if (h->magic != JOURNAL_MAGIC || h->type != JOURNAL_HEADER) {
+    free(buf);
+    free(revoked_by);
+    return MY_ERR;
+  }
+
+  // - Transactions are valid while their identifiers grow and their commit
+  // block matches. The first pass collects revoked blocks, the second one
+  // writes the images which are not revoked by a later transaction.
+  uint32_t tid = h->tid;
+  for (int pass = 0; pass < 2; pass++) {
+    int32_t pos = 1;
+    tid = h->tid;
+
+    while (pos + 2 <= sb.journal_block_num) {
+      journal_record_t *d = (journal_record_t *)(buf + pos * BLOCK_SIZE);
+      if (d->magic != JOURNAL_MAGIC || d->type != JOURNAL_DESCRIPTOR ||
+          d->tid < tid || d->count + d->revoked > 2 * JOURNAL_TX_MAX ||
+          pos + (int32_t)d->count + 2 > sb.journal_block_num) {
+        break;
+      }
+
+      int32_t num = (int32_t)d->count + 2;
+      journal_record_t *c =
+          (journal_record_t *)(buf + (pos + num - 1) * BLOCK_SIZE);
+      if (c->magic != JOURNAL_MAGIC || c->type != JOURNAL_COMMIT ||
+          c->tid != d->tid ||
+          c->checksum != journal_checksum(buf + pos * BLOCK_SIZE,
+                                          (size_t)(num - 1) * BLOCK_SIZE)) {
+        break;
+      }
+
+      for (uint32_t i = 0; pass == 0 && i < d->revoked; i++) {
+        int32_t block = d->block[d->count + i];
+        if (block >= 0 && block < NUM_BLOCKS) {
+          revoked_by[block] = d->tid;
+        }
+      }
+
+      for (uint32_t i = 0; pass == 1 && i < d->count; i++) {
+        int32_t block = d->block[i];
+        if (block >= 0 && block < NUM_BLOCKS && revoked_by[block] < d->tid &&
+            write_blocks(block, 1, buf + (pos + 1 + (int32_t)i) * BLOCK_SIZE) !=
+                1) {
+          free(buf);
+          free(revoked_by);
+          return MY_ERR;
+        }
+      }
+
+      tid = d->tid + 1;
+      pos += num;
+    }
+  }
+
+  free(buf);
+  free(revoked_by);
+
+  j->tid = tid;
+  j->committed = tid - 1;
+  memset(j->released, 0, sizeof(j->released));
+
+  return journal_checkpoint(j);
+}
+
+uint32_t journal_checksum(const char *buf, size_t size) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < size; i++) {
+    h = (h ^ (uint8_t)buf[i]) * 16777619u;
+  }
+
+  return h;
+}
+
+int32_t journal_init(journal_t *j) {
+  if (j == NULL) {
+    return MY_ERR;
+  }
+
+  j->tid = 1;
+  j->committed = 0;
+  memset(j->released, 0, sizeof(j->released));
+
+  return journal_checkpoint(j);
+}
+
+int32_t journal_release(journal_t *j) {
+  if (j == NULL) {
+    return MY_ERR;
+  }
+
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    free(j->running[i]);
+    free(j->pending[i]);
+    j->running[i] = NULL;
+    j->pending[i] = NULL;
+  }
+
+  j->updates = 0;
+  j->committing = 0;
+  j->count = 0;
+  j->revoked = 0;
+  j->head = 1;
+
+  return MY_OK;
+}
+
+// - Log segment management
+
+int32_t segment_init(segment_t *l, int enabled) {
+  if (l == NULL) {
+    return MY_ERR;
+  }
+
+  l->enabled = enabled != 0;
+  l->wake = 0;
+  l->stop = 0;
+  l->delayed = 0;
+  l->full = 0;
+  l->start = 0;
+  l->count = 0;
+  l->summarized = 0;
+  atomic_store(&l->head, 0);
+
+  for (size_t i = 0; i < NUM_BLOCKS; i++) {
+    l->summary[i].inode = ENTRY_INVALID;
+    l->summary[i].index = ENTRY_INVALID;
+  }
+
+  if (l->enabled &&
+      pthread_create(&l->cleaner, NULL, segment_cleaner, l) != 0) {
+    l->enabled = 0;
+    return MY_ERR;
+  }
+
+  return MY_OK;
+}
+
+int32_t segment_release(segment_t *l) {
+  if (l == NULL) {
+    return MY_ERR;
+  }
+
+  if (l->enabled) {
+    assert(pthread_mutex_lock(&l->lock) == 0);
+    l->stop = 1;
+    assert(pthread_cond_signal(&l->cond) == 0);
+    assert(pthread_mutex_unlock(&l->lock) == 0);
+    assert(pthread_join(l->cleaner, NULL) == 0);
+  }
+
+  int32_t r = journal_sync(&journal);
+
+  assert(pthread_mutex_lock(&l->lock) == 0);
+  l->delayed = 0;
+  l->full = 0;
+  if (segment_flush(l) == MY_ERR) {
+    r = MY_ERR;
+  }
+  l->enabled = 0;
+  assert(pthread_mutex_unlock(&l->lock) == 0);
+
+  return r;
+}
+
+int32_t segment_allocate(segment_t *l) {
+  if (l == NULL || !l->enabled) {
+    return MY_ERR;
+  }
+
+  // - Concurrent writers may interleave in the log, which costs contiguity
+  // but nothing else
+  int32_t head = atomic_load(&l->head);
+  int32_t r = block_allocate(&fbm_table, head);
+  if (r == MY_ERR) {
+    return MY_ERR;
+  }
+
+  atomic_store(&l->head, (r + 1) % NUM_BLOCKS);
+
+  if (r != head) {
+    assert(pthread_mutex_lock(&l->lock) == 0);
+    l->wake = 1;
+    assert(pthread_cond_signal(&l->cond) == 0);
+    assert(pthread_mutex_unlock(&l->lock) == 0);
+  }
+
+  return r;
+}
+
+int32_t segment_delay(segment_t *l) {
+  if (l == NULL) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&l->lock) == 0);
+
+  if (!l->delayed) {
+    assert(clock_gettime(CLOCK_REALTIME, &l->due) == 0);
+    l->due.tv_nsec += SEGMENT_COMMIT_MS * 1000000L;
+    l->due.tv_sec += l->due.tv_nsec / 1000000000L;
+    l->due.tv_nsec %= 1000000000L;
+    l->delayed = 1;
+    assert(pthread_cond_signal(&l->cond) == 0);
+  }
+
+  assert(pthread_mutex_unlock(&l->lock) == 0);
+
+  return MY_OK;
+}
+
+int32_t segment_summarize(segment_t *l, int32_t inode_idx,
+                          const int32_t *block_list) {
+  if (l == NULL || block_list == NULL || inode_idx < 0 ||
+      inode_idx >= MAX_FILES) {
+    return MY_ERR;
+  }
+
+  if (!l->enabled) {
+    return MY_OK;
+  }
+
+  assert(pthread_mutex_lock(&l->lock) == 0);
+  for (int16_t i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    int32_t b = block_list[i];
+    if (b >= 0 && b < NUM_BLOCKS) {
+      l->summary[b].inode = (int16_t)inode_idx;
+      l->summary[b].index = i;
+    }
+  }
+  assert(pthread_mutex_unlock(&l->lock) == 0);
+
+  return MY_OK;
+}
+
+int32_t segment_read(segment_t *l, int32_t block, int32_t n, void *buf) {
+  if (l == NULL || buf == NULL || n <= 0) {
+    return MY_ERR;
+  }
+
+  if (!l->enabled) {
+    return read_blocks(block, n, buf) == n ? n : MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&l->lock) == 0);
+
+  int32_t r = n;
+  if (block + n <= l->start || block >= l->start + l->count) {
+    r = read_blocks(block, n, buf) == n ? n : MY_ERR;
+  } else {
+    for (int32_t i = 0; i < n && r == n; i++) {
+      char *dst = (char *)buf + i * BLOCK_SIZE;
+      int32_t b = block + i;
+      if (b >= l->start && b < l->start + l->count) {
+        memcpy(dst, l->buf + (b - l->start) * BLOCK_SIZE, BLOCK_SIZE);
+      } else if (read_blocks(b, 1, dst) != 1) {
+        r = MY_ERR;
+      }
+    }
+  }
+
+  assert(pthread_mutex_unlock(&l->lock) == 0);
+
+  return r;
+}
+
+int32_t segment_write(segment_t *l, int32_t block, int32_t n,
+                      const void *buf) {
+  if (l == NULL || buf == NULL || n <= 0) {
+    return MY_ERR;
+  }
+
+  // - Cached copies are dropped once the new data can be read
+  if (!l->enabled) {
+    int32_t r = write_blocks(block, n, buf) == n ? n : MY_ERR;
+    assert(bcache_invalidate(&bcache, block, n) == MY_OK);
+    return r;
+  }
+
+  assert(pthread_mutex_lock(&l->lock) == 0);
+
+  int32_t r = n;
+  for (int32_t i = 0; i < n && r == n; i++) {
+    const char *src = (const char *)buf + i * BLOCK_SIZE;
+    int32_t b = block + i;
+
+    // - A block written elsewhere starts a new segment
+    if ((b < l->start || b > l->start + l->count ||
+         b - l->start == SEGMENT_BLOCKS) &&
+        segment_flush(l) == MY_ERR) {
+      r = MY_ERR;
+      break;
+    }
+
+    if (l->count == 0) {
+      l->start = b;
+    }
+
+    memcpy(l->buf + (b - l->start) * BLOCK_SIZE, src, BLOCK_SIZE);
+    if (b == l->start + l->count) {
+      l->count++;
+    }
+  }
+
+  // - A delayed commit is written as soon as the segment is full
+  if (l->count == SEGMENT_BLOCKS && l->delayed && !l->full) {
+    l->full = 1;
+    assert(pthread_cond_signal(&l->cond) == 0);
+  }
+
+  assert(pthread_mutex_unlock(&l->lock) == 0);
+  assert(bcache_invalidate(&bcache, block, n) == MY_OK);
+
+  return r;
+}
+
+int32_t segment_flush(segment_t *l) {
+  if (l == NULL) {
+    return MY_ERR;
+  }
+
+  if (l->count > 0 && write_blocks(l->start, l->count, l->buf) != l->count) {
+    return MY_ERR;
+  }
+
+  l->count = 0;
+
+  return MY_OK;
+}
+
+int32_t segment_relocate(segment_t *l, int32_t inode_idx, int32_t first) {
+  inode_t *node = inode_get(&inode_table, inode_idx);
+  inode_state_t *state = inode_get_state(&inode_table, inode_idx);
+  if (l == NULL || node == NULL) {
+    return MY_ERR;
+  }
+
+  // - The exclusive lock keeps the I-node from being destroyed meanwhile
+  assert(journal_begin(&journal) == MY_OK);
+  assert(pthread_rwlock_wrlock(&state->lock) == 0);
+
+  assert(inode_lock_block(&inode_table, inode_idx) == MY_OK);
+  int live = node->free == ENTRY_TAKEN;
+  assert(inode_unlock_block(&inode_table, inode_idx) == MY_OK);
+
+  int32_t *block_list = calloc(MAX_BLOCKS_PER_FILE, sizeof(int32_t));
+  int32_t *old_list = calloc(MAX_BLOCKS_PER_FILE, sizeof(int32_t));
+  if (!live || block_list == NULL || old_list == NULL ||
+      inode_load(&inode_table, inode_idx) == MY_ERR) {
+    free(block_list);
+    free(old_list);
+    assert(pthread_rwlock_unlock(&state->lock) == 0);
+    assert(journal_end(&journal) == MY_OK);
+    return live ? MY_ERR : MY_OK;
+  }
+
+  _Atomic int32_t *map =
+      atomic_load_explicit(&state->map, memory_order_relaxed);
+  int32_t r = MY_OK;
+  int moved = 0;
+
+  for (size_t i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    old_list[i] = atomic_load_explicit(&map[i], memory_order_relaxed);
+  }
+
+  // - Recorded even if nothing moves, which completes the summary
+  assert(segment_summarize(l, inode_idx, old_list) == MY_OK);
+
+  for (size_t i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    block_list[i] = old_list[i];
+
+    int32_t b = old_list[i];
+    if (r == MY_ERR || b < first || b >= first + SEGMENT_BLOCKS) {
+      continue;
+    }
+
+    assert(pthread_mutex_lock(&fbm_lock) == 0);
+    int shared = block_shared(b);
+    assert(pthread_mutex_unlock(&fbm_lock) == 0);
+
+    if (shared) {
+      continue;
+    }
+
+    int32_t block = segment_allocate(l);
+    if (block == MY_ERR || file_block_copy(b, block) == MY_ERR) {
+      if (block != MY_ERR) {
+        assert(block_deallocate(&fbm_table, block) == MY_OK);
+      }
+
+      r = MY_ERR;
+      continue;
+    }
+
+    block_list[i] = block;
+    moved = 1;
+  }
+
+  if (moved) {
+    inode_write_begin(state);
+    assert(inode_lock_block(&inode_table, inode_idx) == MY_OK);
+
+    if (inode_set_block_list(node, inode_idx, block_list) == MY_ERR) {
+      for (size_t i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+        if (block_list[i] != old_list[i]) {
+          assert(block_deallocate(&fbm_table, block_list[i]) == MY_OK);
+        }
+      }
+
+      moved = 0;
+      r = MY_ERR;
+    } else {
+      for (size_t i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+        atomic_store_explicit(&map[i], block_list[i], memory_order_relaxed);
+      }
+    }
+
+    assert(inode_unlock_block(&inode_table, inode_idx) == MY_OK);
+    inode_write_end(state);
+  }
+
+  if (moved) {
+    assert(inode_update(&inode_table, inode_idx) == MY_OK);
+
+    for (size_t i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+      if (block_list[i] != old_list[i]) {
+        assert(block_deallocate(&fbm_table, old_list[i]) == MY_OK);
+      }
+    }
+  }
+
+  assert(pthread_rwlock_unlock(&state->lock) == 0);
+  assert(journal_end(&journal) == MY_OK);
+  free(block_list);
+  free(old_list);
+
+  return r;
+}
+
+int32_t segment_clean(segment_t *l) {
+  if (l == NULL) {
+    return MY_ERR;
+  }
+
+  int32_t num = NUM_BLOCKS / SEGMENT_BLOCKS;
+  uint8_t *tried = calloc((size_t)num, sizeof(uint8_t));
+  int32_t *taken = calloc((size_t)num, sizeof(int32_t));
+  uint8_t *owner = calloc(MAX_FILES, sizeof(uint8_t));
+  if (tried == NULL || taken == NULL || owner == NULL) {
+    free(tried);
+    free(taken);
+    free(owner);
+    return MY_ERR;
+  }
+
+  int32_t r = MY_OK;
+  while (r == MY_OK) {
+    memset(taken, 0, (size_t)num * sizeof(int32_t));
+
+    assert(pthread_mutex_lock(&fbm_lock) == 0);
+    for (int32_t i = 0; i < num * SEGMENT_BLOCKS; i++) {
+      taken[i / SEGMENT_BLOCKS] += fbm_table.block[i] == ENTRY_TAKEN;
+    }
+    assert(pthread_mutex_unlock(&fbm_lock) == 0);
+
+    // - The emptiest segment which is at most half used is cleaned, leaving
+    // alone the one the log is filling
+    int32_t head = atomic_load(&l->head) / SEGMENT_BLOCKS;
+    int32_t free_num = 0;
+    int32_t victim = ENTRY_INVALID;
+    for (int32_t i = 0; i < num; i++) {
+      free_num += taken[i] == 0;
+      if (taken[i] > 0 && taken[i] <= SEGMENT_BLOCKS / 2 && !tried[i] &&
+          i != head && (victim == ENTRY_INVALID || taken[i] < taken[victim])) {
+        victim = i;
+      }
+    }
+
+    if (free_num >= SEGMENT_CLEAN_MIN || victim == ENTRY_INVALID) {
+      break;
+    }
+
+    tried[victim] = 1;
+    atomic_store(&l->head, ((victim + 1) % num) * SEGMENT_BLOCKS);
+
+    // - Until every file was visited once the summary may miss owners
+    int32_t first = victim * SEGMENT_BLOCKS;
+    memset(owner, !l->summarized, MAX_FILES * sizeof(uint8_t));
+    if (l->summarized) {
+      assert(pthread_mutex_lock(&fbm_lock) == 0);
+      assert(pthread_mutex_lock(&l->lock) == 0);
+      for (int32_t i = first; i < first + SEGMENT_BLOCKS; i++) {
+        int16_t inode_idx = l->summary[i].inode;
+        if (fbm_table.block[i] == ENTRY_TAKEN && inode_idx >= 0) {
+          assert(inode_idx < MAX_FILES);
+          owner[inode_idx] = 1;
+        }
+      }
+      assert(pthread_mutex_unlock(&l->lock) == 0);
+      assert(pthread_mutex_unlock(&fbm_lock) == 0);
+    }
+
+    // - A stale owner no longer maps the block and is left as it is
+    uint32_t size = atomic_load(&inode_table.size);
+    for (uint32_t i = 0; i < size && r == MY_OK; i++) {
+      assert(i < MAX_FILES);
+      if (owner[i]) {
+        r = segment_relocate(l, (int32_t)i, first);
+      }
+    }
+
+    l->summarized = l->summarized || r == MY_OK;
+  }
+
+  free(tried);
+  free(taken);
+  free(owner);
+
+  return r;
+}
+
+void *segment_cleaner(void *arg) {
+  segment_t *l = arg;
+
+  assert(pthread_mutex_lock(&l->lock) == 0);
+
+  while (!l->stop) {
+    if (l->wake) {
+      l->wake = 0;
+      assert(pthread_mutex_unlock(&l->lock) == 0);
+
+      assert(pthread_mutex_lock(&l->clean_lock) == 0);
+      // - A full disk is not an error the cleaner can do anything about
+      segment_clean(l);
+      assert(pthread_mutex_unlock(&l->clean_lock) == 0);
+
+      assert(pthread_mutex_lock(&l->lock) == 0);
+      continue;
+    }
+
+    if (!l->delayed) {
+      assert(pthread_cond_wait(&l->cond, &l->lock) == 0);
+      continue;
+    }
+
+    if (!l->full) {
+      int e = pthread_cond_timedwait(&l->cond, &l->lock, &l->due);
+      assert(e == 0 || e == ETIMEDOUT);
+      if (e == 0) {
+        continue;
+      }
+    }
+
+    // - Handles ending from now on delay the next transaction
+    l->delayed = 0;
+    l->full = 0;
+    assert(pthread_mutex_unlock(&l->lock) == 0);
+
+    assert(journal_sync(&journal) == MY_OK);
+
+    assert(pthread_mutex_lock(&l->lock) == 0);
+  }
+
+  assert(pthread_mutex_unlock(&l->lock) == 0);
+
+  return NULL;
+}
+
+// - Asynchronous I/O engine
+
+int32_t aio_init(aio_t *a) {
+  if (a == NULL) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&a->lock) == 0);
+  a->enabled = 1;
+  a->stop = 0;
+  assert(pthread_mutex_unlock(&a->lock) == 0);
+
+  return MY_OK;
+}
+
+int32_t aio_start(aio_t *a) {
+  if (a == NULL) {
+    return MY_ERR;
+  }
+
+  // - The condition still counts the waiters of the parent in a forked process
+  if (a->owner != getpid()) {
+    assert(pthread_cond_init(&a->cond, NULL) == 0);
+    a->owner = getpid();
+  }
+
+  a->running = 0;
+  while (a->running < AIO_WORKERS &&
+         pthread_create(&a->workers[a->running], NULL, aio_worker, a) == 0) {
+    a->running++;
+  }
+
+  return a->running > 0 ? MY_OK : MY_ERR;
+}
+
+int32_t aio_release(aio_t *a) {
+  if (a == NULL) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&a->lock) == 0);
+  int32_t running = a->owner == getpid() ? a->running : 0;
+  a->enabled = 0;
+  a->running = 0;
+  a->stop = 1;
+  a->ahead_count = 0;
+  if (running == 0) {
+    assert(a->sq_count <= AIO_QUEUE_MAX);
+    a->pending -= (int32_t)a->sq_count;
+    a->sq_count = 0;
+  }
+  assert(pthread_cond_broadcast(&a->cond) == 0);
+  assert(pthread_mutex_unlock(&a->lock) == 0);
+
+  // - The workers drain the submitted requests before they exit
+  for (int32_t i = 0; i < running; i++) {
+    assert(pthread_join(a->workers[i], NULL) == 0);
+  }
+
+  return MY_OK;
+}
+
+int32_t aio_prefetch(aio_t *a, int32_t inode_idx, int32_t off, int32_t len,
+                     int ahead) {
+  if (a == NULL || off < 0 || len < 0) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&a->lock) == 0);
+  // - A forked process has none of the workers of its parent
+  if (a->owner != getpid()) {
+    a->running = 0;
+    a->ahead_count = 0;
+    a->ahead_running = 0;
+  }
+
+  if (!a->enabled || (a->running == 0 && aio_start(a) == MY_ERR)) {
+    assert(pthread_mutex_unlock(&a->lock) == 0);
+    return MY_ERR;
+  }
+
+  // - Readers of small pieces ask for the same read ahead several times
+  int queued = a->ahead_count >= AIO_AHEAD_MAX;
+  for (uint32_t i = 0; i < a->ahead_count && !queued; i++) {
+    aio_ahead_t *q = &a->ahead[(a->ahead_head + i) % AIO_AHEAD_MAX];
+    queued = q->inode == inode_idx && off >= q->offset &&
+             off - q->offset < (q->length > 0 ? q->length : 1);
+  }
+
+  if (!queued) {
+    aio_ahead_t *q =
+        &a->ahead[(a->ahead_head + a->ahead_count) % AIO_AHEAD_MAX];
+    q->inode = inode_idx;
+    q->offset = off;
+    q->length = len;
+    q->ahead = ahead;
+    a->ahead_count++;
+    assert(pthread_cond_broadcast(&a->cond) == 0);
+  }
+  assert(pthread_mutex_unlock(&a->lock) == 0);
+
+  return MY_OK;
+}
+
+int32_t aio_cancel(aio_t *a) {
+  if (a == NULL) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&a->lock) == 0);
+  a->ahead_count = 0;
+  if (a->owner != getpid()) {
+    a->ahead_running = 0;
+  }
+
+  while (a->ahead_running > 0) {
+    assert(pthread_cond_wait(&a->cond, &a->lock) == 0);
+  }
+  assert(pthread_mutex_unlock(&a->lock) == 0);
+
+  return MY_OK;
+}
+
+void *aio_worker(void *arg) {
+  aio_t *a = arg;
+
+  assert(pthread_mutex_lock(&a->lock) == 0);
+
+  while (a->sq_count > 0 || !a->stop) {
+    // - Submitted requests come first as a caller waits for them
+    if (a->sq_count == 0 && a->ahead_count > 0) {
+      aio_ahead_t q = a->ahead[a->ahead_head];
+      a->ahead_head = (a->ahead_head + 1) % AIO_AHEAD_MAX;
+      a->ahead_count--;
+      a->ahead_running++;
+      assert(pthread_mutex_unlock(&a->lock) == 0);
+
+      file_prefetch(q.inode, q.offset, q.length, q.ahead);
+
+      assert(pthread_mutex_lock(&a->lock) == 0);
+      if (--a->ahead_running == 0) {
+        assert(pthread_cond_broadcast(&a->cond) == 0);
+      }
+      continue;
+    }
+
+    if (a->sq_count == 0) {
+      assert(pthread_cond_wait(&a->cond, &a->lock) == 0);
+      continue;
+    }
+
+    ssfs_sqe_t sqe = a->sq[a->sq_head];
+    a->sq_head = (a->sq_head + 1) % AIO_QUEUE_MAX;
+    a->sq_count--;
+    assert(pthread_mutex_unlock(&a->lock) == 0);
+
+    int32_t r = MY_ERR;
+    if (sqe.op == SSFS_AIO_READ) {
+      r = ssfs_pread(sqe.fd, sqe.buf, sqe.length, sqe.offset);
+    } else if (sqe.op == SSFS_AIO_WRITE) {
+      r = ssfs_pwrite(sqe.fd, sqe.buf, sqe.length, sqe.offset);
+    }
+
+    // - The completion always has room as requests are bounded until reaped
+    assert(pthread_mutex_lock(&a->lock) == 0);
+    uint32_t tail = (a->cq_head + a->cq_count) % AIO_QUEUE_MAX;
+    a->cq[tail].result = r;
+    a->cq[tail].user_data = sqe.user_data;
+    a->cq_count++;
+  }
+
+  assert(pthread_mutex_unlock(&a->lock) == 0);
+
+  return NULL;
+}
+
+// - Block cache
+
+int32_t bcache_init(bcache_t *c, int32_t capacity) {
+  if (c == NULL || capacity <= 0 || capacity > NUM_BLOCKS) {
+    return MY_ERR;
+  }
+
+  assert(bcache_release(c) == MY_OK);
+
+  assert(pthread_mutex_lock(&c->lock) == 0);
+  c->link = malloc((size_t)capacity * sizeof(bcache_link_t));
+  c->buf = malloc((size_t)capacity * sizeof(bcache_buf_t));
+  c->data = malloc((size_t)capacity * BLOCK_SIZE);
+  assert(c->link != NULL && c->buf != NULL && c->data != NULL);
+  c->capacity = capacity;
+
+  // - Every shard keeps enough slots for the replacement to adapt
+  int32_t shards = capacity / BCACHE_SHARD_MIN;
+  shards = shards < BCACHE_SHARDS ? shards : BCACHE_SHARDS;
+  c->shards = shards > 0 ? shards : 1;
+
+  for (int32_t k = 0; k < c->shards; k++) {
+    bcache_shard_t *h = &c->shard[k];
+    assert(pthread_mutex_init(&h->lock, NULL) == 0);
+    h->first = k * capacity / c->shards;
+    h->capacity = (k + 1) * capacity / c->shards - h->first;
+    h->target = 0;
+    h->last = ENTRY_INVALID;
+    h->hits = 0;
+    h->misses = 0;
+    for (int32_t l = 0; l < BCACHE_LISTS; l++) {
+      h->list[l].head = ENTRY_INVALID;
+      h->list[l].tail = ENTRY_INVALID;
+      h->list[l].size = 0;
+    }
+
+    for (int32_t i = h->first; i < h->first + h->capacity; i++) {
+      c->buf[i].block = ENTRY_INVALID;
+      atomic_init(&c->buf[i].pins, 0);
+      c->buf[i].list = ENTRY_INVALID;
+      c->buf[i].ref = 0;
+      c->buf[i].shard = (int8_t)k;
+      assert(bcache_link(c, BCACHE_FREE, i, 1) == MY_OK);
+    }
+  }
+  assert(pthread_mutex_unlock(&c->lock) == 0);
+
+  return MY_OK;
+}
+
+int32_t bcache_release(bcache_t *c) {
+  if (c == NULL) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&c->lock) == 0);
+
+  // - The data stays with the users of pinned blocks, as for a block which
+  // is written
+  int32_t pins = 0;
+  for (int32_t i = 0; i < c->capacity; i++) {
+    pins += atomic_load(&c->buf[i].pins);
+  }
+
+  if (pins > 0) {
+    bcache_retired_t *r = malloc(sizeof(bcache_retired_t));
+    assert(r != NULL);
+    r->data = c->data;
+    r->capacity = c->capacity;
+    r->pins = pins;
+    r->next = c->retired;
+    c->retired = r;
+  } else {
+    free(c->data);
+  }
+
+  free(c->link);
+  free(c->buf);
+  c->link = NULL;
+  c->buf = NULL;
+  c->data = NULL;
+
+  atomic_fetch_add(&c->gen, 1);
+  for (int32_t k = 0; k < c->shards; k++) {
+    assert(pthread_mutex_destroy(&c->shard[k].lock) == 0);
+  }
+
+  c->capacity = 0;
+  c->shards = 0;
+  for (int32_t i = 0; i < NUM_BLOCKS; i++) {
+    c->slot[i] = ENTRY_INVALID;
+    c->ghost[i] = ENTRY_INVALID;
+  }
+  assert(pthread_mutex_unlock(&c->lock) == 0);
+
+  return MY_OK;
+}
+
+bcache_shard_t *bcache_shard(bcache_t *c, int32_t block) {
+  if (c == NULL || c->shards == 0 || block < 0 || block >= NUM_BLOCKS) {
+    return NULL;
+  }
+
+  return &c->shard[block % c->shards];
+}
+
+int32_t bcache_link(bcache_t *c, int32_t l, int32_t i, int tail) {
+  if (c == NULL || l < 0 || l >= BCACHE_LISTS || i < 0 ||
+      i >= (l >= BCACHE_B1 ? NUM_BLOCKS : c->capacity)) {
+    return MY_ERR;
+  }
+
+  bcache_shard_t *h =
+      l >= BCACHE_B1 ? bcache_shard(c, i) : &c->shard[c->buf[i].shard];
+  bcache_link_t *n = l >= BCACHE_B1 ? c->glink : c->link;
+  bcache_list_t *list = &h->list[l];
+  if (tail) {
+    n[i].prev = list->tail;
+    n[i].next = ENTRY_INVALID;
+    if (list->tail != ENTRY_INVALID) {
+      n[list->tail].next = i;
+    } else {
+      list->head = i;
+    }
+    list->tail = i;
+  } else {
+    n[i].prev = ENTRY_INVALID;
+    n[i].next = list->head;
+    if (list->head != ENTRY_INVALID) {
+      n[list->head].prev = i;
+    } else {
+      list->tail = i;
+    }
+    list->head = i;
+  }
+
+  list->size++;
+  if (l >= BCACHE_B1) {
+    c->ghost[i] = (int8_t)l;
+  } else {
+    c->buf[i].list = (int8_t)l;
+  }
+
+  return MY_OK;
+}
+
+int32_t bcache_unlink(bcache_t *c, int32_t l, int32_t i) {
+  if (c == NULL || l < 0 || l >= BCACHE_LISTS || i < 0 ||
+      i >= (l >= BCACHE_B1 ? NUM_BLOCKS : c->capacity)) {
+    return MY_ERR;
+  }
+
+  bcache_shard_t *h =
+      l >= BCACHE_B1 ? bcache_shard(c, i) : &c->shard[c->buf[i].shard];
+  bcache_link_t *n = l >= BCACHE_B1 ? c->glink : c->link;
+  bcache_list_t *list = &h->list[l];
+  if (n[i].prev != ENTRY_INVALID) {
+    n[n[i].prev].next = n[i].next;
+  } else {
+    list->head = n[i].next;
+  }
+
+  if (n[i].next != ENTRY_INVALID) {
+    n[n[i].next].prev = n[i].prev;
+  } else {
+    list->tail = n[i].prev;
+  }
+
+  list->size--;
+  if (l >= BCACHE_B1) {
+    c->ghost[i] = ENTRY_INVALID;
+  } else {
+    c->buf[i].list = ENTRY_INVALID;
+  }
+
+  return MY_OK;
+}
+
+int32_t bcache_replace(bcache_t *c, bcache_shard_t *h, int b2) {
+  int32_t t1 = h->list[BCACHE_T1].size;
+  int32_t l = t1 > 0 && (t1 > h->target || (b2 && t1 == h->target))
+                  ? BCACHE_T1
+                  : BCACHE_T2;
+
+  // - The other list gives a block when every block of the first is pinned
+  // or was used since, and each list is passed twice since the first pass
+  // may only move the blocks used since
+  for (int32_t k = 0; k < 4; k++, l = BCACHE_T1 + BCACHE_T2 - l) {
+    int32_t s = h->list[l].tail;
+    while (s != ENTRY_INVALID) {
+      int32_t prev = c->link[s].prev;
+      bcache_buf_t *b = &c->buf[s];
+      if (atomic_load(&b->pins) > 0) {
+        s = prev;
+        continue;
+      }
+
+      // - A block of T1 used again becomes frequent and a block of T2 used
+      // since it was passed is kept for another round
+      if (b->ref > (l == BCACHE_T1 ? 1 : 0)) {
+        assert(bcache_unlink(c, l, s) == MY_OK);
+        assert(bcache_link(c, BCACHE_T2, s, 0) == MY_OK);
+        b->ref = 0;
+        s = prev;
+        continue;
+      }
+
+      int32_t block = b->block;
+      assert(bcache_unlink(c, l, s) == MY_OK);
+      c->slot[block] = ENTRY_INVALID;
+      b->block = ENTRY_INVALID;
+      assert(bcache_link(c, l == BCACHE_T1 ? BCACHE_B1 : BCACHE_B2, block,
+                         0) == MY_OK);
+
+      return s;
+    }
+  }
+
+  return ENTRY_INVALID;
+}
+
+int32_t bcache_slot(bcache_t *c, bcache_shard_t *h, int32_t block,
+                    int flags) {
+  int32_t g = block != ENTRY_INVALID ? c->ghost[block] : ENTRY_INVALID;
+  int32_t b1 = h->list[BCACHE_B1].size;
+  int32_t b2 = h->list[BCACHE_B2].size;
+
+  if (g != ENTRY_INVALID) {
+    // - A ghost used again grows the list which would have kept it
+    if (!(flags & BCACHE_AHEAD) && g == BCACHE_B1) {
+      h->target += b2 > b1 ? b2 / b1 : 1;
+      h->target = h->target < h->capacity ? h->target : h->capacity;
+    } else if (!(flags & BCACHE_AHEAD)) {
+      h->target -= b1 > b2 ? b1 / b2 : 1;
+      h->target = h->target > 0 ? h->target : 0;
+    }
+
+    assert(bcache_unlink(c, g, block) == MY_OK);
+  } else if (block != ENTRY_INVALID) {
+    // - T1 with its ghosts holds at most as many blocks as the shard, and all
+    // the lists twice as many
+    int32_t l1 = h->list[BCACHE_T1].size + b1;
+    if (l1 >= h->capacity && b1 > 0) {
+      assert(bcache_unlink(c, BCACHE_B1, h->list[BCACHE_B1].tail) == MY_OK);
+    } else if (l1 + h->list[BCACHE_T2].size + b2 >= 2 * h->capacity &&
+               b2 > 0) {
+      assert(bcache_unlink(c, BCACHE_B2, h->list[BCACHE_B2].tail) == MY_OK);
+    }
+  }
+
+  int32_t s = h->list[BCACHE_FREE].head;
+  if (s != ENTRY_INVALID) {
+    assert(bcache_unlink(c, BCACHE_FREE, s) == MY_OK);
+    return s;
+  }
+
+  return bcache_replace(c, h, g == BCACHE_B2);
+}
+
+int32_t bcache_touch(bcache_t *c, int32_t s, int flags) {
+  if (c == NULL || s < 0 || s >= c->capacity) {
+    return MY_ERR;
+  }
+
+  bcache_buf_t *b = &c->buf[s];
+  if ((flags & BCACHE_AHEAD) || b->list == ENTRY_INVALID) {
+    return MY_OK;
+  }
+
+  // - Uses which follow each other are a single one, so a sequential reader
+  // does not make its blocks frequent
+  bcache_shard_t *h = &c->shard[b->shard];
+  if (flags & BCACHE_COLD) {
+    b->ref = 0;
+  } else if (b->ref > 0 && h->last != b->block) {
+    b->ref = 2;
+  } else if (b->ref == 0) {
+    b->ref = 1;
+  }
+
+  h->last = b->block;
+
+  return MY_OK;
+}
+
+uint32_t bcache_gen(bcache_t *c) {
+  return atomic_load(&c->gen);
+}
+
+const char *bcache_get(bcache_t *c, int32_t block, int flags) {
+  bcache_shard_t *h = bcache_shard(c, block);
+  if (h == NULL) {
+    return NULL;
+  }
+
+  assert(pthread_mutex_lock(&h->lock) == 0);
+  int32_t s = c->slot[block];
+  if (s != ENTRY_INVALID) {
+    atomic_fetch_add(&c->buf[s].pins, 1);
+    assert(bcache_touch(c, s, flags) == MY_OK);
+  }
+
+  // - Reading ahead is not a use of the block
+  if (!(flags & BCACHE_AHEAD) && s != ENTRY_INVALID) {
+    h->hits++;
+  } else if (!(flags & BCACHE_AHEAD)) {
+    h->misses++;
+  }
+  assert(pthread_mutex_unlock(&h->lock) == 0);
+
+  return s != ENTRY_INVALID ? &c->data[(size_t)s * BLOCK_SIZE] : NULL;
+}
+
+const char *bcache_insert(bcache_t *c, int32_t block, const char *data,
+                          uint32_t gen, int flags) {
+  bcache_shard_t *h = bcache_shard(c, block);
+  if (h == NULL || data == NULL) {
+    return NULL;
+  }
+
+  assert(pthread_mutex_lock(&h->lock) == 0);
+
+  // - A write bumps the generation before it drops its blocks, so data read
+  // before the write is either refused here or dropped by the write
+  int fresh = atomic_load(&c->gen) == gen;
+  int pin = flags & BCACHE_PIN;
+  int32_t s = fresh ? c->slot[block] : ENTRY_INVALID;
+  if (s != ENTRY_INVALID) {
+    assert(bcache_touch(c, s, flags) == MY_OK);
+  } else if (fresh || pin) {
+    // - Data which may be stale is only given to the caller
+    int32_t g = fresh ? c->ghost[block] : ENTRY_INVALID;
+    s = bcache_slot(c, h, fresh ? block : ENTRY_INVALID, flags);
+    if (s != ENTRY_INVALID) {
+      memcpy(&c->data[(size_t)s * BLOCK_SIZE], data, BLOCK_SIZE);
+    }
+
+    if (s != ENTRY_INVALID && fresh) {
+      // - A block used again after it was evicted is frequent
+      int32_t l = (g != ENTRY_INVALID &&
+                   !(flags & (BCACHE_AHEAD | BCACHE_COLD))) ||
+                          (flags & BCACHE_FREQUENT)
+                      ? BCACHE_T2
+                      : BCACHE_T1;
+      assert(bcache_link(c, l, s, flags & BCACHE_COLD) == MY_OK);
+      c->slot[block] = s;
+      c->buf[s].block = block;
+      c->buf[s].ref = l == BCACHE_T1 && !(flags & BCACHE_AHEAD);
+      if (!(flags & BCACHE_AHEAD)) {
+        h->last = block;
+      }
+    }
+  }
+
+  if (s != ENTRY_INVALID && pin) {
+    atomic_fetch_add(&c->buf[s].pins, 1);
+  }
+
+  assert(pthread_mutex_unlock(&h->lock) == 0);
+
+  return s != ENTRY_INVALID && pin ? &c->data[(size_t)s * BLOCK_SIZE]
+                                   : NULL;
+}
+
+const char *bcache_load(bcache_t *c, int32_t block) {
+  const char *data = bcache_get(c, block, 0);
+  if (data != NULL) {
+    return data;
+  }
+
+  char buf[BLOCK_SIZE];
+  uint32_t gen = bcache_gen(c);
+  if (segment_read(&segment, block, 1, buf) != 1) {
+    return NULL;
+  }
+
+  return bcache_insert(c, block, buf, gen, BCACHE_PIN);
+}
+
+int32_t bcache_put(bcache_t *c, const char *data) {
+  if (c == NULL || data == NULL) {
+    return MY_ERR;
+  }
+
+  size_t size = (size_t)c->capacity * BLOCK_SIZE;
+  if (c->data != NULL && data >= c->data && data < c->data + size) {
+    size_t d = (size_t)(data - c->data) / BLOCK_SIZE;
+    assert(d < (size_t)c->capacity);
+    bcache_buf_t *b = &c->buf[d];
+    int32_t pins = atomic_fetch_sub(&b->pins, 1);
+    assert(pins > 0);
+
+    // - Only a detached slot is freed by its last user, which a write may
+    // have detached since the count was dropped
+    if (pins == 1) {
+      bcache_shard_t *h = &c->shard[b->shard];
+      assert(pthread_mutex_lock(&h->lock) == 0);
+      if (atomic_load(&b->pins) == 0 && b->list == ENTRY_INVALID) {
+        assert(bcache_link(c, BCACHE_FREE, (int32_t)d, 1) == MY_OK);
+      }
+      assert(pthread_mutex_unlock(&h->lock) == 0);
+    }
+
+    return MY_OK;
+  }
+
+  // - A block of an earlier mount frees the data with the last user
+  assert(pthread_mutex_lock(&c->lock) == 0);
+  for (bcache_retired_t **r = &c->retired; *r != NULL; r = &(*r)->next) {
+    bcache_retired_t *p = *r;
+    if (data < p->data || data >= p->data + (size_t)p->capacity * BLOCK_SIZE) {
+      continue;
+    }
+
+    assert(p->pins > 0);
+    if (--p->pins == 0) {
+      *r = p->next;
+      free(p->data);
+      free(p);
+    }
+    assert(pthread_mutex_unlock(&c->lock) == 0);
+
+    return MY_OK;
+  }
+  assert(pthread_mutex_unlock(&c->lock) == 0);
+
+  return MY_ERR;
+}
+
+int32_t bcache_invalidate(bcache_t *c, int32_t block, int32_t n) {
+  if (c == NULL || block < 0 || n < 0 || block + n > NUM_BLOCKS) {
+    return MY_ERR;
+  }
+
+  atomic_fetch_add(&c->gen, 1);
+  for (int32_t b = block; b < block + n && c->shards > 0; b++) {
+    bcache_shard_t *h = bcache_shard(c, b);
+    assert(pthread_mutex_lock(&h->lock) == 0);
+
+    // - A pinned slot is detached and freed once it is released
+    int32_t s = c->slot[b];
+    if (s != ENTRY_INVALID) {
+      assert(bcache_unlink(c, c->buf[s].list, s) == MY_OK);
+      c->slot[b] = ENTRY_INVALID;
+      c->buf[s].block = ENTRY_INVALID;
+      if (atomic_load(&c->buf[s].pins) == 0) {
+        assert(bcache_link(c, BCACHE_FREE, s, 1) == MY_OK);
+      }
+    }
+
+    assert(pthread_mutex_unlock(&h->lock) == 0);
+  }
+
+  return MY_OK;
+}
+
+int32_t bcache_save(bcache_t *c, hot_table_t *hot) {
+  if (c == NULL || hot == NULL) {
+    return MY_ERR;
+  }
+
+  for (int32_t k = 0; k < c->shards; k++) {
+    assert(pthread_mutex_lock(&c->shard[k].lock) == 0);
+  }
+
+  // - The shards give a block each in turn, so none is left out when the
+  // list is full
+  int32_t n = 0;
+  int32_t next[BCACHE_SHARDS];
+  const int32_t lists[2] = {BCACHE_T2, BCACHE_T1};
+  for (int32_t j = 0; j < 2; j++) {
+    for (int32_t k = 0; k < c->shards; k++) {
+      next[k] = c->shard[k].list[lists[j]].head;
+    }
+
+    for (int more = 1; more && n < HOT_BLOCKS_MAX;) {
+      more = 0;
+      for (int32_t k = 0; k < c->shards && n < HOT_BLOCKS_MAX; k++) {
+        if (next[k] != ENTRY_INVALID) {
+          hot->block[n++] = c->buf[next[k]].block;
+          next[k] = c->link[next[k]].next;
+          more = 1;
+        }
+      }
+    }
+
+    if (lists[j] == BCACHE_T2) {
+      hot->frequent = n;
+    }
+  }
+
+  hot->num = n;
+  for (int32_t k = c->shards - 1; k >= 0; k--) {
+    assert(pthread_mutex_unlock(&c->shard[k].lock) == 0);
+  }
+
+  return MY_OK;
+}
+
+// - Free space summary
+
+int32_t space_count(space_t *s, inode_table_t *t) {
+  if (s == NULL || t == NULL) {
+    return MY_ERR;
+  }
+
+  int32_t free_blocks = 0;
+  assert(pthread_mutex_lock(&fbm_lock) == 0);
+  for (uint32_t i = 0; i < sb.blocks; i++) {
+    free_blocks += fbm_table.block[i] == ENTRY_FREE;
+  }
+  assert(pthread_mutex_unlock(&fbm_lock) == 0);
+
+  int32_t free_inodes = 0;
+  for (uint32_t i = 0; i < t->size; i++) {
+    assert(i < MAX_FILES);
+    inode_t *p = inode_get(t, (int32_t)i);
+    if (p == NULL) {
+      return MY_ERR;
+    }
+
+    free_inodes += p->free == ENTRY_FREE;
+  }
+
+  atomic_store(&s->free_blocks, free_blocks);
+  atomic_store(&s->free_inodes, free_inodes);
+
+  return MY_OK;
+}
+
+// - Cache warm start
+
+int32_t warm_start(warm_t *w, const hot_table_t *hot) {
+  if (w == NULL || hot == NULL) {
+    return MY_ERR;
+  }
+
+  w->inode_blocks = sb.inode_block_num;
+  w->dir_blocks = sb.dir_block_num;
+
+  int32_t n = w->inode_blocks + w->dir_blocks;
+  for (int32_t i = 0; i < NUM_BLOCKS; i++) {
+    w->list[i] = ENTRY_INVALID;
+  }
+
+  for (int32_t i = 0; i < hot->num; i++) {
+    int32_t block = hot->block[i];
+    if (block >= 0 && block < NUM_BLOCKS &&
+        fbm_table.block[block] == ENTRY_TAKEN) {
+      w->list[block] = i < hot->frequent ? BCACHE_T2 : BCACHE_T1;
+      n++;
+    }
+  }
+
+  if (n == 0) {
+    return MY_OK;
+  }
+
+  if (!w->registered) {
+    assert(pthread_atfork(warm_fork, NULL, NULL) == 0);
+    w->registered = 1;
+  }
+
+  // - The condition still counts the waiters of the parent in a forked process
+  if (w->owner != getpid()) {
+    assert(pthread_mutex_init(&w->lock, NULL) == 0);
+    assert(pthread_cond_init(&w->cond, NULL) == 0);
+    w->owner = getpid();
+  }
+
+  pthread_t thread;
+  atomic_store(&w->stop, 0);
+  w->running = 1;
+  if (pthread_create(&thread, NULL, warm_worker, w) != 0) {
+    w->running = 0;
+    return MY_ERR;
+  }
+
+  assert(pthread_detach(thread) == 0);
+
+  return MY_OK;
+}
+
+int32_t warm_stop(warm_t *w) {
+  if (w == NULL) {
+    return MY_ERR;
+  }
+
+  if (w->owner != getpid()) {
+    w->running = 0;
+    return MY_OK;
+  }
+
+  atomic_store(&w->stop, 1);
+  assert(pthread_mutex_lock(&w->lock) == 0);
+  while (w->running) {
+    assert(pthread_cond_wait(&w->cond, &w->lock) == 0);
+  }
+  assert(pthread_mutex_unlock(&w->lock) == 0);
+
+  return MY_OK;
+}
+
+void warm_fork(void) {
+  assert(warm_stop(&warm) == MY_OK);
+  assert(aio_cancel(&aio) == MY_OK);
+}
+
+void *warm_worker(void *arg) {
+  warm_t *w = arg;
+
+  // - Metadata comes first as every request needs it. Blocks which a request
+  // read meanwhile are skipped and a failed read is left to the next use.
+  for (int32_t i = 0; i < w->inode_blocks && !atomic_load(&w->stop); i++) {
+    inode_load_block(&inode_table, i);
+  }
+
+  for (int32_t i = 0; i < w->dir_blocks && !atomic_load(&w->stop); i++) {
+    dir_load_block(&dir_table, i);
+  }
+
+  char *buf = malloc(READAHEAD_BLOCKS * BLOCK_SIZE);
+
+  for (int32_t i = 0; buf != NULL && i < NUM_BLOCKS;) {
+    if (atomic_load(&w->stop)) {
+      break;
+    }
+
+    if (w->list[i] == ENTRY_INVALID) {
+      i++;
+      continue;
+    }
+
+    int32_t n = 1;
+    while (i + n < NUM_BLOCKS && n < READAHEAD_BLOCKS &&
+           w->list[i + n] != ENTRY_INVALID) {
+      n++;
+    }
+
+    // - Blocks used since the mount are not moved by the reads ahead
+    uint32_t gen = bcache_gen(&bcache);
+    if (segment_read(&segment, i, n, buf) == n) {
+      for (int32_t k = 0; k < n; k++) {
+        int flags = w->list[i + k] == BCACHE_T2 ? BCACHE_FREQUENT : 0;
+        bcache_insert(&bcache, i + k, buf + k * BLOCK_SIZE, gen,
+                      BCACHE_AHEAD | flags);
+      }
+    }
+
+    i += n;
+  }
+
+  free(buf);
+
+  assert(pthread_mutex_lock(&w->lock) == 0);
+  w->running = 0;
+  assert(pthread_cond_broadcast(&w->cond) == 0);
+  assert(pthread_mutex_unlock(&w->lock) == 0);
+
+  return NULL;
+}
+
+// - Snapshot management
+
+int32_t snapshot_find(int cnum) {
+  for (int32_t i = 0; i < sb.snapshot_num; i++) {
+    if (cnum >= 0 && sb.snapshots[i].epoch == (uint32_t)cnum) {
+      return i;
+    }
+  }
+
+  return MY_ERR;
+}
+
+int32_t snapshot_drop(int32_t k) {
+  if (k < 0 || k >= sb.snapshot_num) {
+    return MY_ERR;
+  }
+
+  int32_t *freed = malloc(NUM_BLOCKS * sizeof(int32_t));
+  if (freed == NULL) {
+    return MY_ERR;
+  }
+
+  // - A block of the snapshot is still referenced by the file system unless
+  // it was released, by the next snapshot if it was released after that one
+  // was taken and by the previous one if it was allocated before
+  uint32_t epoch = sb.snapshots[k].epoch;
+  uint32_t prev = k > 0 ? sb.snapshots[k - 1].epoch : 0;
+  uint32_t next =
+      k + 1 < sb.snapshot_num ? sb.snapshots[k + 1].epoch : UINT32_MAX;
+
+  assert(journal_begin(&journal) == MY_OK);
+  assert(pthread_mutex_lock(&fbm_lock) == 0);
+
+  int32_t n = 0;
+  freed[n++] = sb.snapshots[k].root;
+  fbm_table.block[sb.snapshots[k].root] = ENTRY_FREE;
+
+  for (uint32_t i = 0; i < sb.blocks; i++) {
+    epoch_entry_t *e = &epoch_map.block[i];
+    if (fbm_table.block[i] == ENTRY_TAKEN && e->death > epoch &&
+        e->death <= next && (k == 0 || e->birth > prev)) {
+      fbm_table.block[i] = ENTRY_FREE;
+      e->death = 0;
+      freed[n++] = (int32_t)i;
+    }
+  }
+
+  for (int32_t i = 0; i < n; i++) {
+    journal.released[freed[i]] = atomic_load(&journal.tid);
+  }
+
+  atomic_fetch_add(&space.free_blocks, n);
+  int32_t r = fbm_update(fbm_table);
+  for (int32_t i = 1; i < n && r == MY_OK; i++) {
+    r = em_update(&epoch_map, freed[i]);
+  }
+
+  assert(pthread_mutex_unlock(&fbm_lock) == 0);
+
+  if (r == MY_OK) {
+    assert(pthread_mutex_lock(&sb_lock) == 0);
+
+    sb.snapshot_num--;
+    for (int32_t i = k; i < sb.snapshot_num; i++) {
+      sb.snapshots[i] = sb.snapshots[i + 1];
+    }
+
+    sb.snapshots[sb.snapshot_num].root = ENTRY_INVALID;
+    sb.snapshots[sb.snapshot_num].epoch = 0;
+    r = sb_update(sb);
+
+    assert(pthread_mutex_unlock(&sb_lock) == 0);
+  }
+
+  assert(journal_end(&journal) == MY_OK);
+
+  // - Images of the freed blocks may still be in the journal, and each revoke
+  // takes a handle of its own so that a full transaction is committed first
+  for (int32_t i = 0; i < n && r == MY_OK; i++) {
+    r = journal_revoke(&journal, freed[i]);
+  }
+
+  free(freed);
+
+  return r;
+}
+
+// - ssfs
+
+void mkssfs(int fresh) {
+  mkssfs_ex(fresh, 0);
+}
+
+void mkssfs_ex(int fresh, int flags) {
+  assert(warm_stop(&warm) == MY_OK);
+  assert(aio_release(&aio) == MY_OK);
+  assert(segment_release(&segment) == MY_OK);
+
+  int32_t cache = flags >> SSFS_MOUNT_CACHE_SHIFT;
+  cache = cache > 0 ? cache : BCACHE_BLOCKS;
+  assert(bcache_init(&bcache, cache < NUM_BLOCKS ? cache : NUM_BLOCKS) ==
+         MY_OK);
+
+  if (mounted) {
+    assert(inode_release(&inode_table) == MY_OK);
+  } else {
+    assert(inode_init(&inode_table) == MY_OK);
+  }
+
+  assert(dir_release(&dir_table) == MY_OK);
+  assert(fdt_release(&file_entry_table) == MY_OK);
+  assert(journal_release(&journal) == MY_OK);
+  mounted = 1;
+
+  if (fresh) {
+    assert(sb_init(&sb) == MY_OK);
+    assert(fbm_init(&fbm_table) == MY_OK);
+
+    assert(init_fresh_disk(MY_NAME, sb.blocks_size,
+                           sb.blocks + (uint32_t)sb.journal_block_num) == 0);
+    assert(journal_init(&journal) == MY_OK);
+    assert(journal_begin(&journal) == MY_OK);
+
+    assert(block_allocate(&fbm_table, sb.fbm_block_idx) == sb.fbm_block_idx);
+    assert(block_allocate(&fbm_table, sb.sb_block_idx) == sb.sb_block_idx);
+
+    assert(em_init(&epoch_map) == MY_OK);
+    for (int32_t i = 0; i < sb.em_block_num; i++) {
+      assert(block_allocate(&fbm_table, sb.em_block_idx + i) ==
+             sb.em_block_idx + i);
+    }
+
+    assert(rc_init(&rc_table) == MY_OK);
+    for (int32_t i = 0; i < sb.rc_block_num; i++) {
+      assert(block_allocate(&fbm_table, sb.rc_block_idx + i) ==
+             sb.rc_block_idx + i);
+    }
+
+    for (int32_t i = 0; i < sb.hot_block_num; i++) {
+      assert(block_allocate(&fbm_table, sb.hot_block_idx + i) ==
+             sb.hot_block_idx + i);
+    }
+
+    assert(sb_update(sb) == MY_OK);
+    assert(fbm_update(fbm_table) == MY_OK);
+    assert(em_update(&epoch_map, ENTRY_INVALID) == MY_OK);
+    assert(rc_update(&rc_table, ENTRY_INVALID) == MY_OK);
+
+    hot_table_t *hot = calloc(1, sizeof(hot_table_t));
+    assert(hot != NULL);
+    assert(hot_update(hot) == MY_OK);
+    free(hot);
+    assert(space_count(&space, &inode_table) == MY_OK);
+
+    // - The super-block is read in place when mounting
+    assert(journal_end(&journal) == MY_OK);
+    assert(journal_checkpoint(&journal) == MY_OK);
+  } else {
+    // - The geometry is fixed at build time, so the image is opened once and
+    // the super-block is checked against it
+    char *mem = malloc(BLOCK_SIZE);
+    assert(mem != NULL);
+    assert(init_disk(MY_NAME, BLOCK_SIZE, NUM_BLOCKS + JOURNAL_BLOCK_NUM) ==
+           0);
+    assert(read_blocks(SB_BLOCK, 1, mem) == 1);
+    memcpy(&sb, mem, sizeof(super_block_t));
+    free(mem);
+    assert(sb_check(&sb) == MY_OK);
+
+    assert(journal_replay(&journal) == MY_OK);
+    assert(sb_read(&sb) == MY_OK);
+    assert(sb_check(&sb) == MY_OK);
+    assert(inode_read(&inode_table) == MY_OK);
+    assert(dir_read(&dir_table) == MY_OK);
+    assert(fbm_read(&fbm_table) == MY_OK);
+    assert(em_read(&epoch_map) == MY_OK);
+    assert(rc_read(&rc_table) == MY_OK);
+
+    // - The counts saved by a clean unmount are trusted. Otherwise the files
+    // which were removed while open are freed and the counts are taken again,
+    // which reads every I-node block.
+    assert(journal_begin(&journal) == MY_OK);
+    if (sb.clean) {
+      atomic_store(&space.free_blocks, sb.free_blocks);
+      atomic_store(&space.free_inodes, sb.free_inodes);
+    } else {
+      assert(inode_reclaim(&inode_table, &dir_table) != MY_ERR);
+      assert(space_count(&space, &inode_table) == MY_OK);
+    }
+
+    // - A crash from now on leaves the file system to be checked
+    sb.clean = 0;
+    assert(sb_update(sb) == MY_OK);
+    assert(journal_end(&journal) == MY_OK);
+  }
+
+  assert(segment_init(&segment, flags & SSFS_MOUNT_LOG) == MY_OK);
+  assert(aio_init(&aio) == MY_OK);
+  opened = 1;
+
+  // - The I-node and directory blocks and the blocks cached at the last
+  // unmount are read in the background
+  if (!fresh) {
+    hot_table_t *hot = malloc(sizeof(hot_table_t));
+    assert(hot != NULL);
+    assert(hot_read(hot) == MY_OK);
+    assert(warm_start(&warm, hot) == MY_OK);
+    free(hot);
+  }
+}
+
+int ssfs_unmount(void) {
+  if (!opened) {
+    return -1;
+  }
+
+  assert(warm_stop(&warm) == MY_OK);
+  assert(aio_release(&aio) == MY_OK);
+
+  // - Files removed while open are freed as they are closed
+  for (uint32_t i = 0; i < file_entry_table.size; i++) {
+    assert(i < FDT_CHUNKS_MAX * FDT_CHUNK_SIZE);
+    ssfs_fclose((int)i);
+  }
+
+  assert(segment_release(&segment) == MY_OK);
+
+  hot_table_t *hot = malloc(sizeof(hot_table_t));
+  assert(hot != NULL);
+  assert(bcache_save(&bcache, hot) == MY_OK);
+  assert(journal_begin(&journal) == MY_OK);
+  assert(hot_update(hot) == MY_OK);
+
+  assert(pthread_mutex_lock(&sb_lock) == 0);
+  sb.clean = 1;
+  sb.free_blocks = atomic_load(&space.free_blocks);
+  sb.free_inodes = atomic_load(&space.free_inodes);
+  assert(sb_update(sb) == MY_OK);
+  assert(pthread_mutex_unlock(&sb_lock) == 0);
+
+  assert(journal_end(&journal) == MY_OK);
+  free(hot);
+
+  assert(journal_checkpoint(&journal) == MY_OK);
+  assert(bcache_release(&bcache) == MY_OK);
+  assert(close_disk() == 0);
+  opened = 0;
+
+  return 0;
+}
+
+int ssfs_fopen(char *name) {
+  assert(journal_begin(&journal) == MY_OK);
+
+  int32_t inode_idx = file_lookup(name, 1);
+  if (inode_idx == MY_ERR) {
+    assert(journal_end(&journal) == MY_OK);
+    return -1;
+  }
+
+  assert(inode_idx >= 0);
+  int32_t fd = fdt_add(&file_entry_table, (uint32_t)inode_idx);
+  if (fd == MY_ERR) {
+    assert(inode_unref(&inode_table, inode_idx) == MY_OK);
+    assert(journal_end(&journal) == MY_OK);
+    return -1;
+  }
+
+  file_entry_t *f = fdt_lock(&file_entry_table, fd, 1);
+  assert(f != NULL);
+  f->ptr_read = 0;
+  f->ptr_write = inode_size(&inode_table, inode_idx);
+  assert(f->ptr_write != MY_ERR);
+  assert(fdt_unlock(f) == MY_OK);
+  assert(journal_end(&journal) == MY_OK);
+
+  return fd;
+}
+
+int ssfs_fclose(int fileID) {
+  assert(journal_begin(&journal) == MY_OK);
+
+  int32_t r = MY_ERR;
+  file_entry_t *f = fdt_lock(&file_entry_table, fileID, 1);
+  if (f != NULL) {
+    int32_t inode_idx = f->linked_inode;
+    r = fdt_remove(&file_entry_table, fileID);
+    assert(fdt_unlock(f) == MY_OK);
+
+    assert(inode_unref(&inode_table, inode_idx) == MY_OK);
+  }
+
+  assert(journal_end(&journal) == MY_OK);
+
+  return r;
+}
+
+int ssfs_frseek(int fileID, int loc) {
+  file_entry_t *f = fdt_lock(&file_entry_table, fileID, 1);
+  if (f == NULL) {
+    return MY_ERR;
+  }
+
+  int r = MY_ERR;
+  if (loc >= 0 && loc <= inode_size(&inode_table, f->linked_inode)) {
+    f->ptr_read = loc;
+    r = MY_OK;
+  }
+
+  assert(fdt_unlock(f) == MY_OK);
+
+  return r;
+}
+
+int ssfs_fwseek(int fileID, int loc) {
+  file_entry_t *f = fdt_lock(&file_entry_table, fileID, 1);
+  if (f == NULL) {
+    return MY_ERR;
+  }
+
+  // - Writing past the end of the file leaves a hole
+  int r = MY_ERR;
+  if (loc >= 0 && loc <= FILE_SIZE_MAX) {
+    f->ptr_write = loc;
+    r = MY_OK;
+  }
+
+  assert(fdt_unlock(f) == MY_OK);
+
+  return r;
+}
+
+int ssfs_fwrite(int fileID, char *buf, int length) {
+  if (buf == NULL || length <= 0) {
+    return MY_ERR;
+  }
+
+  assert(journal_begin(&journal) == MY_OK);
+
+  int32_t written_bytes = MY_ERR;
+  file_entry_t *fd = fdt_lock(&file_entry_table, fileID, 1);
+  if (fd != NULL) {
+    struct iovec iov = {.iov_base = buf, .iov_len = (size_t)length};
+    written_bytes = file_writev(fd->linked_inode, &iov, 1, fd->ptr_write);
+    if (written_bytes != MY_ERR) {
+      fd->ptr_write += written_bytes;
+    }
+
+    assert(fdt_unlock(fd) == MY_OK);
+  }
+
+  assert(journal_end(&journal) == MY_OK);
+
+  if (written_bytes < length) {
+    written_bytes = MY_ERR;
+  }
+
+  return written_bytes;
+}
+
+int ssfs_fread(int fileID, char *buf, int length) {
+  if (buf == NULL || length < 0) {
+    return MY_ERR;
+  }
+
+  file_entry_t *fd = fdt_lock(&file_entry_table, fileID, 1);
+  if (fd == NULL) {
+    return MY_ERR;
+  }
+
+  int32_t inode_idx = fd->linked_inode;
+  int32_t advice = fd->advice;
+  struct iovec iov = {.iov_base = buf, .iov_len = (size_t)length};
+  int32_t read_bytes = file_readv(inode_idx, &iov, 1, fd->ptr_read, advice);
+  if (read_bytes != MY_ERR) {
+    fd->ptr_read += read_bytes;
+  }
+
+  int32_t off = fd->ptr_read;
+  assert(fdt_unlock(fd) == MY_OK);
+
+  // - The read ahead is only queued, once the file handle is free again
+  if (read_bytes != MY_ERR) {
+    file_readahead(inode_idx, advice, off);
+  }
+
+  return read_bytes;
+}
+
+int ssfs_pwrite(int fileID, const char *buf, int length, int offset) {
+  if (buf == NULL || length <= 0) {
+    return MY_ERR;
+  }
+
+  struct iovec iov = {.iov_base = (void *)buf, .iov_len = (size_t)length};
+
+  return ssfs_pwritev(fileID, &iov, 1, offset);
+}
+
+int ssfs_pread(int fileID, char *buf, int length, int offset) {
+  if (buf == NULL || length < 0) {
+    return MY_ERR;
+  }
+
+  struct iovec iov = {.iov_base = buf, .iov_len = (size_t)length};
+
+  return ssfs_preadv(fileID, &iov, 1, offset);
+}
+
+int ssfs_pwritev(int fileID, const struct iovec *iov, int iovcnt, int offset) {
+  if (iov == NULL || iovcnt <= 0) {
+    return MY_ERR;
+  }
+
+  size_t length = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    length += iov[i].iov_len;
+  }
+
+  assert(journal_begin(&journal) == MY_OK);
+
+  int32_t written_bytes = MY_ERR;
+  file_entry_t *fd = fdt_lock(&file_entry_table, fileID, 0);
+  if (fd != NULL) {
+    written_bytes = file_writev(fd->linked_inode, iov, iovcnt, offset);
+    assert(fdt_unlock(fd) == MY_OK);
+  }
+
+  assert(journal_end(&journal) == MY_OK);
+
+  if (written_bytes == MY_ERR || (size_t)written_bytes < length) {
+    return MY_ERR;
+  }
+
+  return written_bytes;
+}
+
+int ssfs_preadv(int fileID, const struct iovec *iov, int iovcnt, int offset) {
+  if (iov == NULL || iovcnt <= 0) {
+    return MY_ERR;
+  }
+
+  file_entry_t *fd = fdt_lock(&file_entry_table, fileID, 0);
+  if (fd == NULL) {
+    return MY_ERR;
+  }
+
+  int32_t inode_idx = fd->linked_inode;
+  int32_t advice = fd->advice;
+  int32_t read_bytes = file_readv(inode_idx, iov, iovcnt, offset, advice);
+  assert(fdt_unlock(fd) == MY_OK);
+
+  if (read_bytes != MY_ERR) {
+    file_readahead(inode_idx, advice, offset + read_bytes);
+  }
+
+  return read_bytes;
 }
 
-int ssfs_fclose(int fileID) {
-  if (fileID >= 0 && fileID < MAX_OPEN_FILES) {
-    return fdt_remove(file_entry_table, MAX_OPEN_FILES, fileID);
+int ssfs_fadvise(int fileID, int offset, int length, int advice) {
+  int pattern = SSFS_FADV_SEQUENTIAL | SSFS_FADV_RANDOM | SSFS_FADV_NOREUSE;
+  int sequential = SSFS_FADV_SEQUENTIAL | SSFS_FADV_RANDOM;
+  if (offset < 0 || length < 0 ||
+      (advice & ~(pattern | SSFS_FADV_WILLNEED | SSFS_FADV_DONTNEED)) != 0 ||
+      (advice & sequential) == sequential) {
+    return MY_ERR;
   }
 
-  return MY_ERR;
+  file_entry_t *fd = fdt_lock(&file_entry_table, fileID, 1);
+  if (fd == NULL) {
+    return MY_ERR;
+  }
+
+  if ((advice & pattern) != 0 || advice == SSFS_FADV_NORMAL) {
+    fd->advice = advice & pattern;
+  }
+
+  int32_t r = MY_OK;
+  if ((advice & SSFS_FADV_WILLNEED) &&
+      aio_prefetch(&aio, fd->linked_inode, offset, length, 0) == MY_ERR) {
+    r = MY_ERR;
+  }
+
+  if ((advice & SSFS_FADV_DONTNEED) &&
+      file_evict(fd->linked_inode, offset, length) == MY_ERR) {
+    r = MY_ERR;
+  }
+
+  assert(fdt_unlock(fd) == MY_OK);
+
+  return r;
 }
 
-int ssfs_frseek(int fileID, int loc) {
-  if (fileID >= 0 && fileID < MAX_OPEN_FILES && loc >= 0) {
-    int32_t inode_idx = file_entry_table[fileID].linked_inode;
-    // TODO(vl): Add an assert for the size cast
-    if (inode_idx == ENTRY_INVALID ||
-        loc > (int32_t)inode_table[inode_idx].size) {
-      return MY_ERR;
-    }
+int ssfs_cache_stats(ssfs_cache_stats_t *stats) {
+  if (stats == NULL) {
+    return MY_ERR;
+  }
 
-    file_entry_table[fileID].ptr_read = loc;
+  assert(pthread_mutex_lock(&bcache.lock) == 0);
+  stats->capacity = bcache.capacity;
+  stats->recent = 0;
+  stats->frequent = 0;
+  stats->target = 0;
+  stats->hits = 0;
+  stats->misses = 0;
+  for (int32_t k = 0; k < bcache.shards; k++) {
+    bcache_shard_t *h = &bcache.shard[k];
+    assert(pthread_mutex_lock(&h->lock) == 0);
+    stats->recent += h->list[BCACHE_T1].size;
+    stats->frequent += h->list[BCACHE_T2].size;
+    stats->target += h->target;
+    stats->hits += h->hits;
+    stats->misses += h->misses;
+    assert(pthread_mutex_unlock(&h->lock) == 0);
+  }
+  assert(pthread_mutex_unlock(&bcache.lock) == 0);
 
-    return MY_OK;
+  return MY_OK;
+}
+
+int ssfs_space_stats(ssfs_space_stats_t *stats) {
+  if (stats == NULL) {
+    return MY_ERR;
   }
 
-  return MY_ERR;
+  stats->blocks = NUM_BLOCKS;
+  stats->free_blocks = atomic_load(&space.free_blocks);
+  stats->inodes = (int32_t)atomic_load(&inode_table.size);
+  stats->free_inodes = atomic_load(&space.free_inodes);
+
+  return MY_OK;
 }
 
-int ssfs_fwseek(int fileID, int loc) {
-  if (fileID >= 0 && fileID < MAX_OPEN_FILES && loc >= 0) {
-    int32_t inode_idx = file_entry_table[fileID].linked_inode;
-    // TODO(vl): Add an assert for the size cast
-    if (inode_idx == ENTRY_INVALID ||
-        loc > (int32_t)inode_table[inode_idx].size) {
-      return MY_ERR;
-    }
+int ssfs_read_view(int fileID, int offset, int length, ssfs_view_t *view) {
+  file_entry_t *fd = fdt_lock(&file_entry_table, fileID, 0);
+  if (fd == NULL) {
+    return MY_ERR;
+  }
 
-    file_entry_table[fileID].ptr_write = loc;
+  int32_t r = file_view(fd->linked_inode, offset, length, view);
+  assert(fdt_unlock(fd) == MY_OK);
 
-    return MY_OK;
+  return r;
+}
+
+int ssfs_release_view(ssfs_view_t *view) {
+  if (view == NULL) {
+    return MY_ERR;
   }
 
-  return MY_ERR;
+  for (int32_t i = 0; i < view->iovcnt; i++) {
+    if (view->pinned[i] != NULL) {
+      assert(bcache_put(&bcache, view->pinned[i]) == MY_OK);
+    }
+  }
+
+  view->iovcnt = 0;
+
+  return MY_OK;
 }
 
-int ssfs_fwrite(int fileID, char *buf, int length) {
-  if (buf == NULL || length <= 0) {
+int ssfs_remove(char *file) {
+  assert(journal_begin(&journal) == MY_OK);
+  assert(pthread_rwlock_wrlock(&dir_lock) == 0);
+
+  int32_t dir_idx = dir_find(&dir_table, file);
+  if (dir_idx == MY_ERR) {
+    assert(pthread_rwlock_unlock(&dir_lock) == 0);
+    assert(journal_end(&journal) == MY_OK);
     return MY_ERR;
   }
 
-  int32_t written_bytes = MY_ERR;
+  int32_t inode_idx = dir_get(&dir_table, dir_idx)->linked_inode;
+  assert(inode_idx != ENTRY_INVALID);
 
-  if (fileID >= 0 && fileID < MAX_OPEN_FILES) {
-    int32_t inode_idx = file_entry_table[fileID].linked_inode;
-    if (inode_idx == ENTRY_INVALID) {
-      return MY_ERR;
+  assert(dir_remove(&dir_table, file) == dir_idx);
+  assert(dir_update(&dir_table, dir_idx) == MY_OK);
+  assert(pthread_rwlock_unlock(&dir_lock) == 0);
+
+  assert(inode_unlink(&inode_table, inode_idx) == MY_OK);
+  assert(journal_end(&journal) == MY_OK);
+
+  return MY_OK;
+}
+
+int ssfs_clone(char *src, char *dst) {
+  assert(journal_begin(&journal) == MY_OK);
+  assert(pthread_rwlock_wrlock(&dir_lock) == 0);
+
+  int32_t dir_idx = dir_find(&dir_table, src);
+  int32_t src_idx = ENTRY_INVALID;
+  if (dir_idx != MY_ERR && dir_find(&dir_table, dst) == MY_ERR) {
+    src_idx = dir_get(&dir_table, dir_idx)->linked_inode;
+  }
+
+  int32_t inode_idx = MY_ERR;
+  if (inode_load(&inode_table, src_idx) == MY_OK) {
+    inode_idx = inode_allocate(&inode_table);
+  }
+
+  int32_t *block_list = calloc(MAX_BLOCKS_PER_FILE, sizeof(int32_t));
+  if (inode_idx == MY_ERR || block_list == NULL) {
+    if (inode_idx != MY_ERR) {
+      assert(pthread_mutex_lock(&inode_table_lock) == 0);
+      assert(inode_remove(&inode_table, inode_idx) == MY_OK);
+      assert(pthread_mutex_unlock(&inode_table_lock) == 0);
     }
 
-    inode_t *node = &inode_table[inode_idx];
-    file_entry_t *fd = &file_entry_table[fileID];
+    free(block_list);
+    assert(pthread_rwlock_unlock(&dir_lock) == 0);
+    assert(journal_end(&journal) == MY_OK);
+    return -1;
+  }
 
-    int32_t avail = FILE_SIZE_MAX - fd->ptr_write;
-    if (avail <= 0) {
-      return MY_ERR;
+  // - Writers of the source are kept out until its blocks are shared, so
+  // they copy every block they change from then on
+  inode_state_t *state = inode_get_state(&inode_table, src_idx);
+  assert(pthread_rwlock_rdlock(&state->lock) == 0);
+
+  _Atomic int32_t *map =
+      atomic_load_explicit(&state->map, memory_order_acquire);
+  for (size_t i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    block_list[i] = atomic_load_explicit(&map[i], memory_order_relaxed);
+  }
+
+  uint32_t size = atomic_load_explicit(&state->size, memory_order_relaxed);
+
+  // - Data held in the I-node has no blocks to share and is copied instead
+  char data[INODE_INLINE_MAX];
+  int inlined = atomic_load_explicit(&state->inlined, memory_order_relaxed);
+  if (inlined) {
+    memcpy(data, inode_get(&inode_table, src_idx)->data, sizeof(data));
+  }
+
+  assert(pthread_mutex_lock(&fbm_lock) == 0);
+
+  int32_t r = MY_OK;
+  for (size_t i = 0; i < MAX_BLOCKS_PER_FILE; i++) {
+    if (block_list[i] != ENTRY_INVALID &&
+        rc_table.count[block_list[i]] == UINT16_MAX) {
+      r = MY_ERR;
+    }
+  }
+
+  for (size_t i = 0; i < MAX_BLOCKS_PER_FILE && r == MY_OK; i++) {
+    if (block_list[i] != ENTRY_INVALID) {
+      rc_table.count[block_list[i]]++;
     }
+  }
+
+  if (r == MY_OK) {
+    r = rc_update(&rc_table, ENTRY_INVALID);
+  }
+
+  assert(pthread_mutex_unlock(&fbm_lock) == 0);
+  assert(pthread_rwlock_unlock(&state->lock) == 0);
+
+  inode_t *node = inode_get(&inode_table, inode_idx);
+  assert(inode_lock_block(&inode_table, inode_idx) == MY_OK);
+  if (r == MY_OK) {
+    r = inode_set_block_list(node, inode_idx, block_list);
+    node->size = size;
+  }
+
+  if (r == MY_OK && inlined) {
+    node->flags |= INODE_INLINE;
+    memcpy(node->data, data, sizeof(data));
+  }
+  assert(inode_unlock_block(&inode_table, inode_idx) == MY_OK);
+  free(block_list);
 
-    int32_t len = 0;
-    if (avail >= length) {
-      len = length;
+  if (r == MY_OK) {
+    dir_idx = dir_add(&dir_table, dst, (uint32_t)inode_idx);
+  }
+
+  // - Destroying the clone drops the references it took
+  if (r == MY_ERR || dir_idx == MY_ERR) {
+    if (r == MY_ERR) {
+      assert(pthread_mutex_lock(&inode_table_lock) == 0);
+      assert(inode_remove(&inode_table, inode_idx) == MY_OK);
+      assert(pthread_mutex_unlock(&inode_table_lock) == 0);
     } else {
-      len = avail;
+      assert(inode_destroy(&inode_table, inode_idx) == MY_OK);
     }
 
-    // TODO(vl): Add an assert for the cast
-    int32_t cur_block = (fd->ptr_write + len) / (int32_t)sb.blocks_size;
+    assert(pthread_rwlock_unlock(&dir_lock) == 0);
+    assert(journal_end(&journal) == MY_OK);
+    return -1;
+  }
+
+  assert(inode_update(&inode_table, inode_idx) == MY_OK);
+  assert(dir_update(&dir_table, dir_idx) == MY_OK);
+  assert(pthread_rwlock_unlock(&dir_lock) == 0);
+  assert(journal_end(&journal) == MY_OK);
 
-    uint32_t block_list_size = 0;
-    int32_t *block_list = inode_get_block_list(*node, &block_list_size);
-    // TODO(vl): Add an assert for the cast
-    if (cur_block >= (int32_t)block_list_size) {
-      cur_block = (int32_t)(block_list_size - 1);
+  return 0;
+}
+
+int ssfs_copy_range(int fd_in, int off_in, int fd_out, int off_out, int len) {
+  if (off_in < 0 || off_out < 0 || len < 0) {
+    return -1;
+  }
+
+  assert(journal_begin(&journal) == MY_OK);
+
+  // - Handles are locked in order, so two copies cannot wait on each other
+  int lo = fd_in < fd_out ? fd_in : fd_out;
+  int hi = fd_in < fd_out ? fd_out : fd_in;
+  file_entry_t *f_lo = fdt_lock(&file_entry_table, lo, 0);
+  file_entry_t *f_hi = f_lo;
+  if (f_lo != NULL && hi != lo) {
+    f_hi = fdt_lock(&file_entry_table, hi, 0);
+  }
+
+  if (f_lo == NULL || f_hi == NULL) {
+    assert(f_lo == NULL || fdt_unlock(f_lo) == MY_OK);
+    assert(journal_end(&journal) == MY_OK);
+    return -1;
+  }
+
+  int32_t in_idx = (fd_in == lo ? f_lo : f_hi)->linked_inode;
+  int32_t out_idx = (fd_out == lo ? f_lo : f_hi)->linked_inode;
+  int32_t size_in = inode_size(&inode_table, in_idx);
+  int32_t size_out = inode_size(&inode_table, out_idx);
+
+  int32_t copied = MY_ERR;
+  if (size_in != MY_ERR && size_out != MY_ERR && off_in < size_in) {
+    int32_t n = len;
+    if (n > size_in - off_in) {
+      n = size_in - off_in;
     }
 
-    for (int32_t i = 0; i <= cur_block; i++) {
-      if (block_list[i] == ENTRY_INVALID) {
-        block_list[i] = block_allocate(&fbm_table, -1);
-        assert(block_list[i] != MY_ERR);
-      }
+    if (n > FILE_SIZE_MAX - off_out) {
+      n = FILE_SIZE_MAX - off_out;
+    }
+
+    // - Ranges of a file overlapping each other are not copied
+    if (in_idx == out_idx && off_in < off_out + n && off_out < off_in + n) {
+      n = MY_ERR;
     }
 
-    assert(inode_set_block_list(node, block_list) == MY_OK);
+    int32_t bs = BLOCK_SIZE;
+    int32_t head = n;
+    int32_t whole = 0;
+    if (n > 0 && off_in % bs == off_out % bs) {
+      head = (bs - off_out % bs) % bs;
+      if (head > n) {
+        head = n;
+      }
 
-    // TODO(vl) Add an assert for the cast
-    if ((int32_t)node->size < fd->ptr_write + len) {
-      node->size = (uint32_t)(fd->ptr_write + len);
+      whole = (n - head) / bs;
     }
 
-    assert(inode_update(inode_table, MAX_FILES) == MY_OK);
+    // - The unaligned head is copied, then whole blocks are shared and the
+    // rest is copied again
+    copied = n == MY_ERR ? MY_ERR : 0;
+    if (head > 0) {
+      copied = file_copy(in_idx, off_in, out_idx, off_out, head);
+    }
 
-    char *file_buf = calloc(FILE_SIZE_MAX, sizeof(char));
-    char *file_cursor = file_buf;
+    if (whole > 0 && copied == head) {
+      int32_t r = file_remap(in_idx, (off_in + head) / bs, out_idx,
+                             (off_out + head) / bs, whole);
+      if (r == MY_ERR) {
+        r = file_copy(in_idx, off_in + head, out_idx, off_out + head,
+                      whole * bs);
+      }
 
-    assert(file_buf != NULL);
+      copied = r == MY_ERR ? head : head + r;
+    }
 
-    for (int32_t i = 0; i <= cur_block; i++) {
-      assert(read_blocks(block_list[i], 1, file_cursor) == 1);
+    int32_t tail = n - copied;
+    if (n > 0 && copied == head + whole * bs && tail > 0) {
+      int32_t r = file_copy(in_idx, off_in + copied, out_idx, off_out + copied,
+                            tail);
+      copied = r == MY_ERR ? copied : copied + r;
+    }
 
-      file_cursor += sb.blocks_size;
+    if (copied == 0 && n > 0) {
+      copied = MY_ERR;
     }
+  }
 
-    memcpy(&file_buf[fd->ptr_write], buf, (size_t)len);
-    fd->ptr_write += len;
-    written_bytes = len;
-    file_cursor = file_buf;
+  if (f_hi != f_lo) {
+    assert(fdt_unlock(f_hi) == MY_OK);
+  }
 
-    for (int32_t i = 0; i <= cur_block; i++) {
-      assert(write_blocks(block_list[i], 1, file_cursor) == 1);
+  assert(fdt_unlock(f_lo) == MY_OK);
+  assert(journal_end(&journal) == MY_OK);
 
-      file_cursor += sb.blocks_size;
-    }
+  return copied;
+}
 
-    free(file_buf);
-    assert(inode_free_block_list(block_list) == MY_OK);
+int ssfs_fallocate(int fileID, int offset, int length) {
+  assert(journal_begin(&journal) == MY_OK);
 
-    if (len == avail) {
-      written_bytes = -1;
-    }
+  int32_t r = MY_ERR;
+  file_entry_t *fd = fdt_lock(&file_entry_table, fileID, 0);
+  if (fd != NULL) {
+    r = file_allocate(fd->linked_inode, offset, length);
+    assert(fdt_unlock(fd) == MY_OK);
   }
 
-  return written_bytes;
+  assert(journal_end(&journal) == MY_OK);
+
+  return r;
 }
 
-int ssfs_fread(int fileID, char *buf, int length) {
-  if (buf == NULL || length < 0) {
+int ssfs_ftruncate(int fileID, int length) {
+  assert(journal_begin(&journal) == MY_OK);
+
+  int32_t r = MY_ERR;
+  file_entry_t *fd = fdt_lock(&file_entry_table, fileID, 0);
+  if (fd != NULL) {
+    r = file_truncate(fd->linked_inode, length);
+    assert(fdt_unlock(fd) == MY_OK);
+  }
+
+  assert(journal_end(&journal) == MY_OK);
+
+  return r;
+}
+
+int ssfs_fsize(int fileID) {
+  file_entry_t *fd = fdt_lock(&file_entry_table, fileID, 0);
+  if (fd == NULL) {
     return MY_ERR;
   }
 
-  int32_t read_bytes = MY_ERR;
+  int32_t size = inode_size(&inode_table, fd->linked_inode);
+  assert(fdt_unlock(fd) == MY_OK);
 
-  if (fileID >= 0 && fileID < MAX_OPEN_FILES) {
-    int32_t inode_idx = file_entry_table[fileID].linked_inode;
-    if (inode_idx == ENTRY_INVALID) {
-      return MY_ERR;
+  return size;
+}
+
+int ssfs_put(char *name, const char *buf, int length) {
+  if (buf == NULL || length < 0 || length > FILE_SIZE_MAX) {
+    return -1;
+  }
+
+  assert(journal_begin(&journal) == MY_OK);
+
+  // - Everything below joins a single journal handle, so the metadata of the
+  // whole call is flushed at once
+  int32_t inode_idx = file_lookup(name, 1);
+  int32_t r = inode_idx == MY_ERR ? MY_ERR : 0;
+  if (r != MY_ERR && length > 0) {
+    struct iovec iov = {.iov_base = (void *)buf, .iov_len = (size_t)length};
+    r = file_writev(inode_idx, &iov, 1, 0);
+  }
+
+  // - Data of the previous object past the end of this one is dropped
+  if (r == length && inode_size(&inode_table, inode_idx) > length &&
+      file_truncate(inode_idx, length) == MY_ERR) {
+    r = MY_ERR;
+  }
+
+  if (inode_idx != MY_ERR) {
+    assert(inode_unref(&inode_table, inode_idx) == MY_OK);
+  }
+
+  assert(journal_end(&journal) == MY_OK);
+
+  return r == length ? length : -1;
+}
+
+int ssfs_get(char *name, char *buf, int length) {
+  if (buf == NULL || length < 0) {
+    return -1;
+  }
+
+  // - The handle is only needed to destroy a file removed meanwhile
+  assert(journal_begin(&journal) == MY_OK);
+
+  int32_t inode_idx = file_lookup(name, 0);
+  int32_t r = MY_ERR;
+  if (inode_idx != MY_ERR) {
+    int32_t size = inode_size(&inode_table, inode_idx);
+    r = size == MY_ERR ? MY_ERR : 0;
+    if (size > 0 && length > 0) {
+      struct iovec iov = {.iov_base = buf, .iov_len = (size_t)length};
+      r = file_readv(inode_idx, &iov, 1, 0, SSFS_FADV_NORMAL);
     }
 
-    inode_t *node = &inode_table[inode_idx];
-    file_entry_t *fd = &file_entry_table[fileID];
+    assert(inode_unref(&inode_table, inode_idx) == MY_OK);
+  }
 
-    // TODO(vl): Add an assert for the cast
-    int32_t avail = (int32_t)node->size - fd->ptr_read;
-    if (avail <= 0) {
-      return MY_ERR;
+  assert(journal_end(&journal) == MY_OK);
+
+  return r;
+}
+
+int ssfs_batch(ssfs_op_t *ops, int num) {
+  if (ops == NULL || num < 0) {
+    return -1;
+  }
+
+  assert(journal_begin(&journal) == MY_OK);
+
+  int done = 0;
+  for (int i = 0; i < num; i++) {
+    ssfs_op_t *op = &ops[i];
+    if (i > 0) {
+      assert(journal_extend(&journal) == MY_OK);
     }
 
-    int32_t len = 0;
-    if (avail >= length) {
-      len = length;
+    if (op->type == SSFS_OP_REMOVE) {
+      op->result = ssfs_remove(op->name);
+    } else if (op->type == SSFS_OP_CREATE || op->type == SSFS_OP_WRITE) {
+      int32_t inode_idx = file_lookup(op->name, 1);
+      op->result = inode_idx == MY_ERR ? MY_ERR : 0;
+
+      if (inode_idx != MY_ERR && op->type == SSFS_OP_WRITE) {
+        op->result = MY_ERR;
+        if (op->buf != NULL && op->length > 0) {
+          struct iovec iov = {.iov_base = (void *)op->buf,
+                              .iov_len = (size_t)op->length};
+          int32_t w = file_writev(inode_idx, &iov, 1, op->offset);
+          op->result = w == op->length ? w : MY_ERR;
+        }
+      }
+
+      if (inode_idx != MY_ERR) {
+        assert(inode_unref(&inode_table, inode_idx) == MY_OK);
+      }
     } else {
-      len = avail;
+      op->result = MY_ERR;
     }
 
-    char *file_buf = calloc(FILE_SIZE_MAX, sizeof(char));
-    char *file_cursor = file_buf;
+    done += op->result != MY_ERR;
+  }
 
-    assert(file_buf != NULL);
+  assert(journal_end(&journal) == MY_OK);
 
-    int32_t cur_block = (fd->ptr_read + len) / (int32_t)sb.blocks_size;
+  return done;
+}
 
-    uint32_t block_list_size = 0;
-    int32_t *block_list = inode_get_block_list(*node, &block_list_size);
-    // TODO(vl): Add an assert for the cast
-    if (cur_block >= (int32_t)block_list_size) {
-      cur_block = (int32_t)(block_list_size - 1);
-    }
+int ssfs_create_many(char **names, int num) {
+  if (names == NULL || num < 0) {
+    return -1;
+  }
+
+  ssfs_op_t *ops = calloc((size_t)num + 1, sizeof(ssfs_op_t));
+  if (ops == NULL) {
+    return -1;
+  }
 
-    for (int32_t i = 0; i <= cur_block; i++) {
-      assert(block_list[i] != ENTRY_INVALID);
-      assert(read_blocks(block_list[i], 1, file_cursor) == 1);
+  for (int i = 0; i < num; i++) {
+    ops[i].type = SSFS_OP_CREATE;
+    ops[i].name = names[i];
+  }
 
-      file_cursor += sb.blocks_size;
-    }
+  int r = ssfs_batch(ops, num);
+  free(ops);
 
-    assert(inode_free_block_list(block_list) == MY_OK);
+  return r;
+}
+
+int ssfs_remove_many(char **names, int num) {
+  if (names == NULL || num < 0) {
+    return -1;
+  }
 
-    memcpy(buf, &file_buf[fd->ptr_read], (size_t)len);
-    fd->ptr_read += len;
-    read_bytes = len;
+  ssfs_op_t *ops = calloc((size_t)num + 1, sizeof(ssfs_op_t));
+  if (ops == NULL) {
+    return -1;
+  }
 
-    free(file_buf);
+  for (int i = 0; i < num; i++) {
+    ops[i].type = SSFS_OP_REMOVE;
+    ops[i].name = names[i];
   }
 
-  return read_bytes;
+  int r = ssfs_batch(ops, num);
+  free(ops);
+
+  return r;
 }
 
-int ssfs_remove(char *file) {
-  int32_t dir_idx = dir_find(dir_table, MAX_FILES, file);
-  if (dir_idx == MY_ERR) {
+int ssfs_submit(const ssfs_sqe_t *sqes, int num) {
+  if (sqes == NULL || num < 0) {
     return MY_ERR;
   }
 
-  int32_t inode_idx = dir_table[dir_idx].linked_inode;
-  assert(inode_idx != ENTRY_INVALID);
-  inode_t node = inode_table[inode_idx];
+  assert(pthread_mutex_lock(&aio.lock) == 0);
+  // - A forked process has none of the workers of its parent
+  if (aio.owner != getpid()) {
+    aio.running = 0;
+  }
+
+  if (!aio.enabled || (aio.running == 0 && aio_start(&aio) == MY_ERR)) {
+    assert(pthread_mutex_unlock(&aio.lock) == 0);
+    return MY_ERR;
+  }
+
+  int32_t n = AIO_QUEUE_MAX - aio.pending;
+  if (num < n) {
+    n = num;
+  }
+
+  for (int32_t i = 0; i < n; i++) {
+    aio.sq[(aio.sq_head + aio.sq_count) % AIO_QUEUE_MAX] = sqes[i];
+    aio.sq_count++;
+  }
+
+  aio.pending += n;
+  if (n > 0) {
+    assert(pthread_cond_broadcast(&aio.cond) == 0);
+  }
+  assert(pthread_mutex_unlock(&aio.lock) == 0);
+
+  return n;
+}
+
+int ssfs_reap(ssfs_cqe_t *cqes, int max) {
+  if (cqes == NULL || max < 0) {
+    return MY_ERR;
+  }
+
+  assert(pthread_mutex_lock(&aio.lock) == 0);
+  assert(aio.cq_count <= AIO_QUEUE_MAX);
+  int32_t n = (int32_t)aio.cq_count;
+  if (max < n) {
+    n = max;
+  }
+
+  for (int32_t i = 0; i < n; i++) {
+    cqes[i] = aio.cq[aio.cq_head];
+    aio.cq_head = (aio.cq_head + 1) % AIO_QUEUE_MAX;
+    aio.cq_count--;
+  }
+
+  aio.pending -= n;
+  assert(pthread_mutex_unlock(&aio.lock) == 0);
+
+  return n;
+}
+
+int ssfs_commit(void) {
+  // - Snapshot numbers are returned as an int
+  if (sb.epoch >= EPOCH_MAX) {
+    return -1;
+  }
+
+  // - The cleaner decides what to move by the snapshots
+  assert(pthread_mutex_lock(&segment.clean_lock) == 0);
+
+  int32_t r = MY_OK;
+  if (sb.snapshot_num == SNAPSHOTS_MAX) {
+    r = snapshot_drop(0);
+  }
+
+  assert(journal_begin(&journal) == MY_OK);
+
+  root_t *root = calloc(1, BLOCK_SIZE);
+  int32_t block = MY_ERR;
+  if (r == MY_OK && root != NULL) {
+    block = block_allocate(&fbm_table, -1);
+  }
 
-  for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-    if (file_entry_table[i].free == ENTRY_TAKEN &&
-        file_entry_table[i].linked_inode ==
-            inode_idx) { // TODO(vl): Add an assert for the cast
-      assert(ssfs_fclose((int)i) == 0);
+  int cnum = -1;
+  if (block != MY_ERR) {
+    // - Only the lists of the root are copied, every block stays shared
+    root->dir_block_num = sb.dir_block_num;
+    root->inode_block_num = sb.inode_block_num;
+    memcpy(root->dir_blocks, sb.dir_blocks, sizeof(root->dir_blocks));
+    memcpy(root->inode_blocks, sb.inode_blocks, sizeof(root->inode_blocks));
+    memcpy(root->rc_blocks, sb.rc_blocks, sizeof(root->rc_blocks));
+    root->free_inodes = atomic_load(&space.free_inodes);
+
+    if (journal_write(&journal, block, root) == MY_OK) {
+      assert(pthread_mutex_lock(&sb_lock) == 0);
+
+      sb.snapshots[sb.snapshot_num].root = block;
+      sb.snapshots[sb.snapshot_num].epoch = sb.epoch;
+      sb.snapshot_num++;
+      assert(sb.epoch <= EPOCH_MAX);
+      cnum = (int)sb.epoch++;
+
+      if (sb_update(sb) == MY_ERR) {
+        cnum = -1;
+      }
+
+      assert(pthread_mutex_unlock(&sb_lock) == 0);
     }
   }
 
-  uint32_t block_list_size = 0;
-  int32_t *block_list = inode_get_block_list(node, &block_list_size);
+  free(root);
+  assert(journal_end(&journal) == MY_OK);
+  assert(pthread_mutex_unlock(&segment.clean_lock) == 0);
 
-  for (size_t i = 0; i < block_list_size; i++) {
-    if (block_list[i] != ENTRY_INVALID) {
-      assert(block_deallocate(&fbm_table, block_list[i]) == MY_OK);
+  return cnum;
+}
+
+int ssfs_restore(int cnum) {
+  int32_t k = snapshot_find(cnum);
+  root_t *root = malloc(BLOCK_SIZE);
+  if (k == MY_ERR || root == NULL) {
+    free(root);
+    return -1;
+  }
+
+  // - The tables are about to be reloaded from other blocks
+  assert(warm_stop(&warm) == MY_OK);
+  assert(aio_cancel(&aio) == MY_OK);
+
+  // - Blocks born after the snapshot are freed, none of which may be replayed
+  assert(pthread_mutex_lock(&segment.clean_lock) == 0);
+  assert(journal_sync(&journal) == MY_OK);
+  assert(journal_checkpoint(&journal) == MY_OK);
+  assert(journal_begin(&journal) == MY_OK);
+
+  int32_t r = journal_read(&journal, sb.snapshots[k].root, root);
+  if (r == MY_OK) {
+    uint32_t epoch = sb.snapshots[k].epoch;
+
+    // - Anything the snapshot references was born before it, so only the
+    // blocks allocated since are released, those released since are in use
+    // again and no I-node has to be read
+    assert(pthread_mutex_lock(&fbm_lock) == 0);
+
+    int32_t free_blocks = 0;
+    for (uint32_t i = 0; i < sb.blocks; i++) {
+      epoch_entry_t *e = &epoch_map.block[i];
+      if (fbm_table.block[i] == ENTRY_TAKEN && e->birth > epoch) {
+        fbm_table.block[i] = ENTRY_FREE;
+        journal.released[i] = atomic_load(&journal.tid);
+      }
+
+      if (fbm_table.block[i] == ENTRY_FREE || e->death > epoch) {
+        e->death = 0;
+      }
+
+      free_blocks += fbm_table.block[i] == ENTRY_FREE;
+    }
+
+    r = fbm_update(fbm_table);
+    if (r == MY_OK) {
+      r = em_update(&epoch_map, ENTRY_INVALID);
+    }
+
+    atomic_store(&space.free_blocks, free_blocks);
+    atomic_store(&space.free_inodes, root->free_inodes);
+    assert(pthread_mutex_unlock(&fbm_lock) == 0);
+
+    assert(pthread_mutex_lock(&sb_lock) == 0);
+
+    sb.dir_block_num = root->dir_block_num;
+    sb.inode_block_num = root->inode_block_num;
+    memcpy(sb.dir_blocks, root->dir_blocks, sizeof(sb.dir_blocks));
+    memcpy(sb.inode_blocks, root->inode_blocks, sizeof(sb.inode_blocks));
+    memcpy(sb.rc_blocks, root->rc_blocks, sizeof(sb.rc_blocks));
+
+    for (int32_t i = k + 1; i < sb.snapshot_num; i++) {
+      sb.snapshots[i].root = ENTRY_INVALID;
+      sb.snapshots[i].epoch = 0;
     }
+
+    sb.snapshot_num = k + 1;
+    sb.epoch = epoch + 1;
+
+    if (r == MY_OK) {
+      r = sb_update(sb);
+    }
+
+    assert(pthread_mutex_unlock(&sb_lock) == 0);
   }
 
-  assert(inode_free_block_list(block_list) == MY_OK);
-  assert(block_deallocate(&fbm_table, node.next) == MY_OK);
+  free(root);
+  assert(journal_end(&journal) == MY_OK);
 
-  assert(inode_remove(inode_table, MAX_FILES, inode_idx) == MY_OK);
-  assert(dir_remove(dir_table, MAX_FILES, file) != MY_ERR);
-  assert(inode_update(inode_table, MAX_FILES) == MY_OK);
-  assert(dir_update(dir_table, MAX_FILES) == MY_OK);
+  if (r == MY_ERR) {
+    assert(pthread_mutex_unlock(&segment.clean_lock) == 0);
+    return -1;
+  }
 
-  return MY_OK;
+  // - The cached tables are reloaded and every open file is closed, and the
+  // files own other blocks than the summary of the log says
+  segment.summarized = 0;
+  assert(fdt_release(&file_entry_table) == MY_OK);
+  assert(inode_release(&inode_table) == MY_OK);
+  assert(inode_read(&inode_table) == MY_OK);
+  assert(dir_release(&dir_table) == MY_OK);
+  assert(dir_read(&dir_table) == MY_OK);
+
+  // - The references are counted as they were when the snapshot was taken
+  assert(pthread_mutex_lock(&fbm_lock) == 0);
+  r = rc_read(&rc_table);
+  assert(pthread_mutex_unlock(&fbm_lock) == 0);
+  assert(pthread_mutex_unlock(&segment.clean_lock) == 0);
+
+  return r == MY_OK ? 0 : -1;
 }
@@ -0,0 +1,119 @@
+#include "goldfs_test.h"
+
+#include <goldfs.hpp>
+
+#include <cstdio>
+#include <cstring>
+#include <exception>
+
+// - The structures declared again in goldfs.hpp must keep the layout checked
+// in sfs_api.h
+static_assert(sizeof(ssfs_sqe_t) ==
+              4 * sizeof(int32_t) + sizeof(char *) + sizeof(void *));
+static_assert(offsetof(ssfs_sqe_t, op) == 0);
+static_assert(offsetof(ssfs_sqe_t, fd) == sizeof(int32_t));
+static_assert(offsetof(ssfs_sqe_t, offset) == 2 * sizeof(int32_t));
+static_assert(offsetof(ssfs_sqe_t, length) == 3 * sizeof(int32_t));
+static_assert(offsetof(ssfs_sqe_t, buf) == 4 * sizeof(int32_t));
+static_assert(offsetof(ssfs_sqe_t, user_data) ==
+              4 * sizeof(int32_t) + sizeof(char *));
+static_assert(sizeof(ssfs_cqe_t) == 2 * sizeof(void *));
+static_assert(offsetof(ssfs_cqe_t, result) == 0);
+static_assert(offsetof(ssfs_cqe_t, user_data) == sizeof(void *));
+
+namespace {
+
+// - Coroutine which runs until its first suspension when called
+struct task {
+  struct promise_type {
+    task get_return_object() noexcept { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+// - Writes a piece of the file, reads it back and counts the mismatches
+task write_read(goldfs::file &f, int32_t piece, int &done, int &err_no) {
+  char text[100];
+  char buf[100] = {0};
+  for (size_t i = 0; i < sizeof(text); i++) {
+    text[i] = static_cast<char>('a' + (static_cast<size_t>(piece) + i) % 26);
+  }
+
+  int32_t r = co_await f.write(text, piece * 100);
+  if (r != 100) {
+    fprintf(stderr, "Error: co_await write returned %d\n", r);
+    err_no += 1;
+  }
+  r = co_await f.read(buf, piece * 100);
+  if (r != 100 || memcmp(buf, text, sizeof(text)) != 0) {
+    fprintf(stderr, "Error: co_await read returned %d\n", r);
+    err_no += 1;
+  }
+  done++;
+}
+
+// - Requests on a closed file fail without suspending
+task closed_file(int &done, int &err_no) {
+  goldfs::file f;
+  char buf[10];
+  if (co_await f.read(buf, 0) != -1 || co_await f.write(buf, 0) != -1) {
+    fprintf(stderr, "Error: closed file accepted a request\n");
+    err_no += 1;
+  }
+  done++;
+}
+
+void run(int flags, int &err_no) {
+  // - More coroutines than the queue of the library holds, so some wait in
+  // the backlog of the engine
+  constexpr int pieces = 2 * 64 + 10;
+  int done = 0;
+
+  goldfs::file kept;
+  {
+    goldfs::filesystem fs(true, flags);
+    goldfs::file f = fs.open("goldfs.txt");
+    if (!f) {
+      fprintf(stderr, "Error: open failed\n");
+      err_no += 1;
+    }
+
+    for (int32_t i = 0; i < pieces; i++) {
+      write_read(f, i, done, err_no);
+    }
+    closed_file(done, err_no);
+    while (fs.pending() > 0) {
+      fs.poll();
+    }
+
+    // - A file may outlive the object it was opened from
+    kept = std::move(f);
+  }
+
+  if (done != pieces + 1 || !kept) {
+    fprintf(stderr, "Error: %d of %d coroutines finished\n", done,
+            pieces + 1);
+    err_no += 1;
+  }
+  kept.close();
+}
+
+} // namespace
+
+int goldfs_test(void) {
+  printf("\n-------------------------------\nInitializing goldfs "
+         "test.\n--------------------------------\n\n");
+  int err_no = 0;
+
+  run(0, err_no);
+  run(goldfs::mount_log | goldfs::mount_cache(64), err_no);
+
+  printf("\n-------------------------------\ngoldfs test "
+         "Finished.\nCurrent Error Num: %d\n--------------------------------\n\n",
+         err_no);
+
+  return err_no == 0 ? 0 : -1;
+}
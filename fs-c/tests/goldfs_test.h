@@ -0,0 +1,11 @@
+#pragma once
+
+// Tests of the C++20 front end in goldfs.hpp.
+// For all tests, -1 is considered error and 0 is considered success.
+#ifdef __cplusplus
+extern "C" {
+#endif
+int goldfs_test(void);
+#ifdef __cplusplus
+}
+#endif
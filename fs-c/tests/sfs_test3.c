@@ -0,0 +1,34 @@
+#include "tests.h"
+
+int extended_test(void) {
+  printf("\n-------------------------------\nInitializing Extended "
+         "test.\n--------------------------------\n\n");
+  int err_no = 0;
+
+  mkssfs(1);
+  test_positional_io(&err_no);
+  test_concurrent_io(&err_no);
+  test_commit_restore(&err_no);
+  test_log_structured(&err_no);
+  test_clone(&err_no);
+  test_copy_range(&err_no);
+  test_sparse(&err_no);
+  test_fallocate_truncate(&err_no);
+  test_inline(&err_no);
+  test_put_get(&err_no);
+  test_batch(&err_no);
+  test_async(&err_no);
+  test_read_view(&err_no);
+  test_fadvise(&err_no);
+  test_cache_scan(&err_no);
+  test_warm_start(&err_no);
+  test_lazy_mount(&err_no);
+  test_clean_unmount(&err_no);
+
+  printf("\n-------------------------------\nExtended test "
+         "Finished.\nCurrent Error Num: %d\n--------------------------------\n\n",
+         err_no);
+
+  ssfs_unmount();
+  return 0;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+// Tests of the extended API which is not part of the assignment.
+// For all tests, -1 is considered error and 0 is considered success.
+int extended_test(void);
@@ -205,9 +205,9 @@ int test_seek(int *file_id, int *file_size, int *write_ptr, char **write_buf,
                       "seek location attempted. Potential fwseek "
                       "fail?\n");
     res = ssfs_fwseek(file_id[i], file_size[i] + 100);
-    if (res >= 0)
-      fprintf(stderr, "Warning: ssfs_frseek returned positive. Seek "
-                      "location beyond file size attempted. Potential "
+    if (res < 0)
+      fprintf(stderr, "Warning: ssfs_fwseek returned negative. Seek "
+                      "location beyond file size leaves a hole. Potential "
                       "fwseek fail?\n");
     res = ssfs_frseek(file_id[i], file_size[i] - offset);
     if (res < 0)
@@ -656,7 +656,11 @@ int test_overflow_open(int *file_id, int *file_sizes, int *write_ptr,
       }
     }
   }
-  // Remove them all and do it again.
+  // Remove them all and do it again. Files still open keep their blocks, so
+  // close them first.
+  for (int i = 0; i < ret; i++) {
+    ssfs_fclose(file_id[i]);
+  }
   test_remove_files(file_id, file_sizes, write_ptr, file_names, write_buf, ret,
                     err_no);
   free_name_element(file_names, ret);
@@ -686,6 +690,9 @@ int test_overflow_open(int *file_id, int *file_sizes, int *write_ptr,
     }
   }
   // Remove all the files.
+  for (int i = 0; i < ret; i++) {
+    ssfs_fclose(file_id[i]);
+  }
   test_remove_files(file_id, file_sizes, write_ptr, file_names, write_buf, ret,
                     err_no);
   free_name_element(file_names, ret);
@@ -885,6 +892,1006 @@ int test_open_old_files(char **file_names, int *file_id, int num_file,
   return 0;
 }
 
+/*
+Writes and reads a file with ssfs_pwrite, ssfs_pread and their vectored
+variants. The read and write pointers must not move.
+*/
+int test_positional_io(int *err_no) {
+  int length = 3 * BLOCK_SIZE + 100;
+  char *text = rand_text(length);
+  char *buf = calloc((size_t)length + 1, sizeof(char));
+  int file_id = ssfs_fopen("pos.txt");
+  int res;
+
+  res = ssfs_pwrite(file_id, text, length, 0);
+  if (res != length) {
+    fprintf(stderr, "Error: ssfs_pwrite returned %d instead of %d\n", res,
+            length);
+    *err_no += 1;
+  }
+  // Unaligned reads across block boundaries
+  for (int off = 0; off < length; off += 333) {
+    int len = length - off < 700 ? length - off : 700;
+    res = ssfs_pread(file_id, buf, len, off);
+    if (res != len || memcmp(buf, &text[off], (size_t)len) != 0) {
+      fprintf(stderr, "Error: ssfs_pread at %d returned wrong data\n", off);
+      *err_no += 1;
+    }
+  }
+  if (ssfs_pread(file_id, buf, 1, length) >= 0) {
+    fprintf(stderr, "Error: ssfs_pread past the end of file succeeded\n");
+    *err_no += 1;
+  }
+  // Both pointers of the new file are still at its start
+  res = ssfs_fwrite(file_id, "AB", 2);
+  res = ssfs_fread(file_id, buf, 2);
+  if (res != 2 || buf[0] != 'A' || buf[1] != 'B') {
+    fprintf(stderr, "Error: ssfs_pwrite moved the file pointers\n");
+    *err_no += 1;
+  }
+  memcpy(text, "AB", 2);
+  // Gather a write from three buffers and scatter a read to two
+  struct iovec wiov[3] = {{text + 100, 10}, {text + 5, 1500}, {text + 40, 7}};
+  res = ssfs_pwritev(file_id, wiov, 3, BLOCK_SIZE - 5);
+  if (res != 1517) {
+    fprintf(stderr, "Error: ssfs_pwritev returned %d instead of 1517\n", res);
+    *err_no += 1;
+  }
+  char *expected = calloc((size_t)length + 1, sizeof(char));
+  memcpy(expected, text, (size_t)length);
+  memcpy(&expected[BLOCK_SIZE - 5], text + 100, 10);
+  memcpy(&expected[BLOCK_SIZE + 5], text + 5, 1500);
+  memcpy(&expected[BLOCK_SIZE + 1505], text + 40, 7);
+  struct iovec riov[2] = {{buf, 1000}, {buf + 1000, (size_t)length}};
+  res = ssfs_preadv(file_id, riov, 2, 0);
+  if (res != length || memcmp(buf, expected, (size_t)length) != 0) {
+    fprintf(stderr, "Error: ssfs_preadv returned wrong data\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(file_id);
+  ssfs_remove("pos.txt");
+  free(expected);
+  free(text);
+  free(buf);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_ROUNDS 16
+
+typedef struct {
+  int id;
+  int shared_id;
+  char *text;
+  int length;
+  int err_no;
+} concurrent_arg_t;
+
+static void *concurrent_worker(void *p) {
+  concurrent_arg_t *arg = p;
+  char name[16];
+  char *buf = calloc((size_t)arg->length, sizeof(char));
+  snprintf(name, sizeof(name), "thread%d.txt", arg->id);
+
+  for (int i = 0; i < CONCURRENT_ROUNDS; i++) {
+    int file_id = ssfs_fopen(name);
+    if (ssfs_pwrite(file_id, arg->text, arg->length, 0) != arg->length ||
+        ssfs_pread(file_id, buf, arg->length, 0) != arg->length ||
+        memcmp(buf, arg->text, (size_t)arg->length) != 0) {
+      fprintf(stderr, "Error: thread %d read back wrong data\n", arg->id);
+      arg->err_no += 1;
+    }
+    // Every thread owns one byte of the shared file
+    char c = (char)('A' + arg->id);
+    if (ssfs_pwrite(arg->shared_id, &c, 1, arg->id) != 1) {
+      fprintf(stderr, "Error: thread %d failed to write shared file\n",
+              arg->id);
+      arg->err_no += 1;
+    }
+    ssfs_fclose(file_id);
+    ssfs_remove(name);
+  }
+  free(buf);
+  return NULL;
+}
+
+int test_concurrent_io(int *err_no) {
+  pthread_t threads[CONCURRENT_THREADS];
+  concurrent_arg_t args[CONCURRENT_THREADS];
+  int shared_id = ssfs_fopen("shared.txt");
+  char buf[CONCURRENT_THREADS + 1] = {0};
+
+  memset(buf, '.', CONCURRENT_THREADS);
+  ssfs_fwrite(shared_id, buf, CONCURRENT_THREADS);
+  for (int i = 0; i < CONCURRENT_THREADS; i++) {
+    args[i].id = i;
+    args[i].shared_id = shared_id;
+    args[i].length = 2 * BLOCK_SIZE + 10 * i;
+    args[i].text = rand_text(args[i].length);
+    args[i].err_no = 0;
+    assert(pthread_create(&threads[i], NULL, concurrent_worker, &args[i]) == 0);
+  }
+  for (int i = 0; i < CONCURRENT_THREADS; i++) {
+    assert(pthread_join(threads[i], NULL) == 0);
+    *err_no += args[i].err_no;
+    free(args[i].text);
+  }
+  if (ssfs_pread(shared_id, buf, CONCURRENT_THREADS, 0) != CONCURRENT_THREADS ||
+      strcmp(buf, "ABCD") != 0) {
+    fprintf(stderr, "Error: shared file holds %s instead of ABCD\n", buf);
+    *err_no += 1;
+  }
+  ssfs_fclose(shared_id);
+  ssfs_remove("shared.txt");
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+int test_commit_restore(int *err_no) {
+  int length = 2 * BLOCK_SIZE + 10;
+  char *text = rand_text(length);
+  char *buf = calloc((size_t)length + 1, sizeof(char));
+  int file_id = ssfs_fopen("snap.txt");
+  int res;
+
+  ssfs_pwrite(file_id, text, length, 0);
+  int cnum = ssfs_commit();
+  if (cnum < 0) {
+    fprintf(stderr, "Error: ssfs_commit returned %d\n", cnum);
+    *err_no += 1;
+  }
+  // Change a block partly, grow the file and then remove it
+  ssfs_pwrite(file_id, "XYZ", 3, BLOCK_SIZE + 7);
+  ssfs_pwrite(file_id, text, 100, length);
+  ssfs_fclose(file_id);
+  ssfs_remove("snap.txt");
+  res = ssfs_restore(cnum);
+  if (res != 0) {
+    fprintf(stderr, "Error: ssfs_restore returned %d instead of 0\n", res);
+    *err_no += 1;
+  }
+  file_id = ssfs_fopen("snap.txt");
+  res = ssfs_pread(file_id, buf, length + 1, 0);
+  if (res != length || memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: restored file does not match the snapshot\n");
+    *err_no += 1;
+  }
+  if (ssfs_restore(cnum + 1) >= 0) {
+    fprintf(stderr, "Error: ssfs_restore of a missing snapshot succeeded\n");
+    *err_no += 1;
+  }
+  // Snapshots of an unchanged file system only hold their roots, so once the
+  // older ones are dropped the free space is the same after any changes
+  ssfs_space_stats_t before;
+  ssfs_space_stats_t after;
+  for (int i = 0; i < SNAPSHOTS_MAX; i++) {
+    ssfs_commit();
+  }
+  ssfs_space_stats(&before);
+  for (int i = 0; i < SNAPSHOTS_MAX + 4; i++) {
+    ssfs_pwrite(file_id, &text[i], BLOCK_SIZE, BLOCK_SIZE);
+    ssfs_clone("snap.txt", "snap2.txt");
+    ssfs_remove("snap2.txt");
+    cnum = ssfs_commit();
+  }
+  ssfs_fclose(file_id);
+  res = ssfs_restore(cnum);
+  for (int i = 0; i < SNAPSHOTS_MAX; i++) {
+    ssfs_commit();
+  }
+  ssfs_space_stats(&after);
+  if (res != 0 || after.free_blocks != before.free_blocks) {
+    fprintf(stderr, "Error: dropped snapshots left %d blocks behind\n",
+            before.free_blocks - after.free_blocks);
+    *err_no += 1;
+  }
+  // The counts taken from the snapshot match those of a recount
+  mkssfs(0);
+  ssfs_space_stats(&before);
+  if (after.free_blocks != before.free_blocks ||
+      after.free_inodes != before.free_inodes) {
+    fprintf(stderr, "Error: ssfs_restore counted the free space wrong\n");
+    *err_no += 1;
+  }
+  file_id = ssfs_fopen("snap.txt");
+  memmove(&text[BLOCK_SIZE], &text[SNAPSHOTS_MAX + 3], BLOCK_SIZE);
+  res = ssfs_pread(file_id, buf, length, 0);
+  if (res != length || memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: restored file does not match the snapshot\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(file_id);
+  ssfs_remove("snap.txt");
+  free(text);
+  free(buf);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+int test_clone(int *err_no) {
+  int length = 4 * BLOCK_SIZE;
+  char *text = rand_text(length);
+  char *buf = calloc((size_t)length + 1, sizeof(char));
+  int src_id = ssfs_fopen("tmpl.txt");
+  int res;
+
+  ssfs_pwrite(src_id, text, length, 0);
+  res = ssfs_clone("tmpl.txt", "copy.txt");
+  if (res != 0) {
+    fprintf(stderr, "Error: ssfs_clone returned %d instead of 0\n", res);
+    *err_no += 1;
+  }
+  if (ssfs_clone("tmpl.txt", "copy.txt") >= 0) {
+    fprintf(stderr, "Error: ssfs_clone over an existing file succeeded\n");
+    *err_no += 1;
+  }
+  // Writing the clone leaves the source untouched
+  int dst_id = ssfs_fopen("copy.txt");
+  ssfs_pwrite(dst_id, "CLONE", 5, BLOCK_SIZE - 2);
+  res = ssfs_pread(src_id, buf, length, 0);
+  if (res != length || memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: writing a clone changed its source\n");
+    *err_no += 1;
+  }
+  memcpy(&text[BLOCK_SIZE - 2], "CLONE", 5);
+  res = ssfs_pread(dst_id, buf, length, 0);
+  if (res != length || memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: ssfs_clone returned wrong data\n");
+    *err_no += 1;
+  }
+  // The clone keeps the shared blocks once the source is gone
+  ssfs_fclose(src_id);
+  ssfs_remove("tmpl.txt");
+  res = ssfs_pread(dst_id, buf, length, 0);
+  if (res != length || memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: removing the source changed its clone\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(dst_id);
+  ssfs_remove("copy.txt");
+  free(text);
+  free(buf);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+int test_copy_range(int *err_no) {
+  int length = 6 * BLOCK_SIZE;
+  char *text = rand_text(length);
+  char *buf = calloc((size_t)2 * length + 1, sizeof(char));
+  char *expected = calloc((size_t)2 * length + 1, sizeof(char));
+  int in_id = ssfs_fopen("in.txt");
+  int out_id = ssfs_fopen("out.txt");
+  int res;
+
+  ssfs_pwrite(in_id, text, length, 0);
+  ssfs_pwrite(out_id, text, 300, 0);
+  memcpy(expected, text, 300);
+  // Unaligned positions are copied, aligned whole blocks are shared
+  res = ssfs_copy_range(in_id, 7, out_id, 300, 2 * BLOCK_SIZE);
+  memcpy(&expected[300], &text[7], 2 * BLOCK_SIZE);
+  int res2 = ssfs_copy_range(in_id, BLOCK_SIZE + 100, out_id,
+                             2 * BLOCK_SIZE + 300, length);
+  memcpy(&expected[2 * BLOCK_SIZE + 300], &text[BLOCK_SIZE + 100],
+         (size_t)(length - BLOCK_SIZE - 100));
+  int total = length + BLOCK_SIZE + 200;
+  if (res != 2 * BLOCK_SIZE || res2 != length - BLOCK_SIZE - 100) {
+    fprintf(stderr, "Error: ssfs_copy_range returned %d and %d\n", res, res2);
+    *err_no += 1;
+  }
+  res = ssfs_pread(out_id, buf, 2 * length, 0);
+  if (res != total || memcmp(buf, expected, (size_t)total) != 0) {
+    fprintf(stderr, "Error: ssfs_copy_range copied wrong data\n");
+    *err_no += 1;
+  }
+  // Writing the destination leaves the source untouched
+  ssfs_pwrite(out_id, "COPY", 4, 3 * BLOCK_SIZE);
+  res = ssfs_pread(in_id, buf, length, 0);
+  if (res != length || memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: writing a copied range changed its source\n");
+    *err_no += 1;
+  }
+  if (ssfs_copy_range(in_id, length, out_id, 0, 10) >= 0) {
+    fprintf(stderr, "Error: ssfs_copy_range past the end of file succeeded\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(in_id);
+  ssfs_fclose(out_id);
+  ssfs_remove("in.txt");
+  ssfs_remove("out.txt");
+  free(text);
+  free(buf);
+  free(expected);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+int test_sparse(int *err_no) {
+  int length = 2 * BLOCK_SIZE;
+  int hole = 100 * BLOCK_SIZE + 300;
+  char *text = rand_text(length);
+  char *buf = calloc((size_t)hole + length + 1, sizeof(char));
+  char *zeros = calloc((size_t)hole, sizeof(char));
+  int file_id = ssfs_fopen("sparse.txt");
+  int res;
+
+  ssfs_fwrite(file_id, text, 10);
+  // Writing past the end of the file leaves a hole that reads as zeros
+  res = ssfs_fwseek(file_id, hole);
+  if (res < 0 || ssfs_fwrite(file_id, text, length) != length) {
+    fprintf(stderr, "Error: writing past the end of file failed\n");
+    *err_no += 1;
+  }
+  res = ssfs_pread(file_id, buf, hole + length, 0);
+  if (res != hole + length || memcmp(buf, text, 10) != 0 ||
+      memcmp(&buf[10], zeros, (size_t)(hole - 10)) != 0 ||
+      memcmp(&buf[hole], text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: reading a sparse file returned wrong data\n");
+    *err_no += 1;
+  }
+  // Filling part of the hole keeps the rest of it zero
+  ssfs_pwrite(file_id, "FILL", 4, 50 * BLOCK_SIZE + 7);
+  res = ssfs_pread(file_id, buf, 2 * BLOCK_SIZE, 49 * BLOCK_SIZE);
+  memcpy(&zeros[BLOCK_SIZE + 7], "FILL", 4);
+  if (res != 2 * BLOCK_SIZE ||
+      memcmp(buf, zeros, (size_t)(2 * BLOCK_SIZE)) != 0) {
+    fprintf(stderr, "Error: filling a hole returned wrong data\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(file_id);
+  ssfs_remove("sparse.txt");
+  free(text);
+  free(buf);
+  free(zeros);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+int test_fallocate_truncate(int *err_no) {
+  int length = 20 * BLOCK_SIZE;
+  char *text = rand_text(length);
+  char *buf = calloc((size_t)length + 1, sizeof(char));
+  char *zeros = calloc((size_t)length, sizeof(char));
+  int file_id = ssfs_fopen("alloc.txt");
+  int res;
+
+  // Preallocated blocks are filled by writes but do not change the size
+  res = ssfs_fallocate(file_id, 0, length);
+  if (res < 0 || ssfs_pread(file_id, buf, 1, 0) >= 0) {
+    fprintf(stderr, "Error: ssfs_fallocate failed or changed the size\n");
+    *err_no += 1;
+  }
+  ssfs_fwrite(file_id, text, length);
+  res = ssfs_pread(file_id, buf, length, 0);
+  if (res != length || memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: writing preallocated blocks returned wrong "
+                    "data\n");
+    *err_no += 1;
+  }
+  // Shrinking drops the data, growing again reads as zeros
+  res = ssfs_ftruncate(file_id, BLOCK_SIZE + 10);
+  int res2 = ssfs_ftruncate(file_id, 3 * BLOCK_SIZE);
+  if (res < 0 || res2 < 0 || ssfs_fsize(file_id) != 3 * BLOCK_SIZE) {
+    fprintf(stderr, "Error: ssfs_ftruncate returned %d and %d\n", res, res2);
+    *err_no += 1;
+  }
+  res = ssfs_pread(file_id, buf, length, 0);
+  if (res != 3 * BLOCK_SIZE ||
+      memcmp(buf, text, (size_t)BLOCK_SIZE + 10) != 0 ||
+      memcmp(&buf[BLOCK_SIZE + 10], zeros, (size_t)2 * BLOCK_SIZE - 10) !=
+          0) {
+    fprintf(stderr, "Error: reading a truncated file returned wrong data\n");
+    *err_no += 1;
+  }
+  if (ssfs_ftruncate(file_id, -1) >= 0) {
+    fprintf(stderr, "Error: ssfs_ftruncate to a negative size succeeded\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(file_id);
+  ssfs_remove("alloc.txt");
+  free(text);
+  free(buf);
+  free(zeros);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+int test_inline(int *err_no) {
+  int length = 3 * BLOCK_SIZE;
+  char *text = rand_text(length);
+  char *buf = calloc((size_t)length + 1, sizeof(char));
+  int file_id = ssfs_fopen("tiny.txt");
+  int res;
+
+  // Tiny files are held in the I-node and moved to blocks as they grow
+  ssfs_fwrite(file_id, text, 20);
+  res = ssfs_pread(file_id, buf, length, 0);
+  if (res != 20 || memcmp(buf, text, 20) != 0) {
+    fprintf(stderr, "Error: reading a tiny file returned wrong data\n");
+    *err_no += 1;
+  }
+  ssfs_clone("tiny.txt", "tiny2.txt");
+  ssfs_fwrite(file_id, &text[20], length - 20);
+  res = ssfs_pread(file_id, buf, length, 0);
+  if (res != length || memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: reading a grown tiny file returned wrong "
+                    "data\n");
+    *err_no += 1;
+  }
+  int clone_id = ssfs_fopen("tiny2.txt");
+  res = ssfs_pread(clone_id, buf, length, 0);
+  if (res != 20 || memcmp(buf, text, 20) != 0) {
+    fprintf(stderr, "Error: reading a clone of a tiny file returned wrong "
+                    "data\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(file_id);
+  ssfs_fclose(clone_id);
+  ssfs_remove("tiny.txt");
+  ssfs_remove("tiny2.txt");
+  free(text);
+  free(buf);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+int test_put_get(int *err_no) {
+  int length = 3 * BLOCK_SIZE;
+  char *text = rand_text(length);
+  char *buf = calloc((size_t)length + 1, sizeof(char));
+  int res;
+
+  // Objects are stored and read back without a file handle
+  res = ssfs_put("obj.bin", text, length);
+  int res2 = ssfs_get("obj.bin", buf, length);
+  if (res != length || res2 != length ||
+      memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: ssfs_put or ssfs_get returned %d and %d\n", res,
+            res2);
+    *err_no += 1;
+  }
+  // A smaller object replaces the previous one entirely
+  ssfs_put("obj.bin", &text[10], 100);
+  res = ssfs_get("obj.bin", buf, length);
+  if (res != 100 || memcmp(buf, &text[10], 100) != 0) {
+    fprintf(stderr, "Error: ssfs_get returned wrong data after a put\n");
+    *err_no += 1;
+  }
+  if (ssfs_get("nothing.bin", buf, length) >= 0) {
+    fprintf(stderr, "Error: ssfs_get of a missing object succeeded\n");
+    *err_no += 1;
+  }
+  ssfs_remove("obj.bin");
+  free(text);
+  free(buf);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+int test_batch(int *err_no) {
+  int num_file = 64;
+  int length = 2 * BLOCK_SIZE;
+  char *text = rand_text(length);
+  char *buf = calloc((size_t)length + 1, sizeof(char));
+  char **names = calloc((size_t)num_file, sizeof(char *));
+  int res;
+
+  for (int i = 0; i < num_file; i++) {
+    names[i] = rand_name();
+  }
+  // Many files are created in a few journal transactions
+  res = ssfs_create_many(names, num_file);
+  if (res != num_file) {
+    fprintf(stderr, "Error: ssfs_create_many created %d of %d files\n", res,
+            num_file);
+    *err_no += 1;
+  }
+  // Writes, creates and removes can be mixed in one batch
+  ssfs_op_t ops[3] = {
+      {SSFS_OP_WRITE, names[0], text, length, 0, 0},
+      {SSFS_OP_WRITE, names[1], text, 100, BLOCK_SIZE, 0},
+      {SSFS_OP_REMOVE, "nothing.bin", NULL, 0, 0, 0},
+  };
+  res = ssfs_batch(ops, 3);
+  if (res != 2 || ops[0].result != length || ops[1].result != 100 ||
+      ops[2].result >= 0) {
+    fprintf(stderr, "Error: ssfs_batch returned %d\n", res);
+    *err_no += 1;
+  }
+  res = ssfs_get(names[0], buf, length);
+  if (res != length || memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: a batched write returned wrong data\n");
+    *err_no += 1;
+  }
+  res = ssfs_get(names[1], buf, length);
+  if (res != BLOCK_SIZE + 100 || memcmp(&buf[BLOCK_SIZE], text, 100) != 0) {
+    fprintf(stderr, "Error: a batched write at an offset was wrong\n");
+    *err_no += 1;
+  }
+  res = ssfs_remove_many(names, num_file);
+  if (res != num_file || ssfs_get(names[0], buf, length) >= 0) {
+    fprintf(stderr, "Error: ssfs_remove_many removed %d of %d files\n", res,
+            num_file);
+    *err_no += 1;
+  }
+  free_name_element(names, num_file);
+  free(names);
+  free(text);
+  free(buf);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+int test_async(int *err_no) {
+  int num = AIO_QUEUE_MAX;
+  int length = num * 100;
+  char *text = rand_text(length);
+  char *buf = calloc((size_t)length + 1, sizeof(char));
+  ssfs_sqe_t sqes[AIO_QUEUE_MAX];
+  ssfs_cqe_t cqes[AIO_QUEUE_MAX];
+  int file_id = ssfs_fopen("async.txt");
+  int res;
+
+  // Writes of separate pieces of the file are all in flight at once
+  for (int i = 0; i < num; i++) {
+    sqes[i].op = SSFS_AIO_WRITE;
+    sqes[i].fd = file_id;
+    sqes[i].offset = i * 100;
+    sqes[i].length = 100;
+    sqes[i].buf = &text[i * 100];
+    sqes[i].user_data = &sqes[i];
+  }
+  res = ssfs_submit(sqes, num);
+  if (res != num || ssfs_submit(sqes, 1) != 0) {
+    fprintf(stderr, "Error: ssfs_submit accepted %d of %d requests\n", res,
+            num);
+    *err_no += 1;
+  }
+  for (int done = 0; done < res;) {
+    int n = ssfs_reap(&cqes[done], num - done);
+    for (int i = done; i < done + n; i++) {
+      ssfs_sqe_t *sqe = cqes[i].user_data;
+      if (cqes[i].result != sqe->length) {
+        fprintf(stderr, "Error: asynchronous write returned %d\n",
+                cqes[i].result);
+        *err_no += 1;
+      }
+    }
+    done += n;
+    if (n == 0) {
+      usleep(100);
+    }
+  }
+  res = ssfs_pread(file_id, buf, length, 0);
+  if (res != length || memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: asynchronous writes returned wrong data\n");
+    *err_no += 1;
+  }
+  // Reads complete as well, and requests on a bad handle fail on their own
+  memset(buf, 0, (size_t)length);
+  sqes[0].op = SSFS_AIO_READ;
+  sqes[0].buf = buf;
+  sqes[0].length = length;
+  sqes[0].offset = 0;
+  sqes[1].op = SSFS_AIO_READ;
+  sqes[1].fd = -1;
+  res = ssfs_submit(sqes, 2);
+  for (int done = 0; done < res;) {
+    int n = ssfs_reap(&cqes[done], res - done);
+    done += n;
+    if (n == 0) {
+      usleep(100);
+    }
+  }
+  for (int i = 0; i < res; i++) {
+    int expected = cqes[i].user_data == &sqes[0] ? length : -1;
+    if (cqes[i].result != expected) {
+      fprintf(stderr, "Error: asynchronous read returned %d\n",
+              cqes[i].result);
+      *err_no += 1;
+    }
+  }
+  if (res != 2 || memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: asynchronous read returned wrong data\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(file_id);
+  ssfs_remove("async.txt");
+  free(text);
+  free(buf);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+int test_read_view(int *err_no) {
+  int length = 5 * BLOCK_SIZE;
+  char *text = rand_text(length);
+  char *buf = calloc((size_t)length + 1, sizeof(char));
+  ssfs_view_t *view = malloc(sizeof(ssfs_view_t));
+  int file_id = ssfs_fopen("view.txt");
+  int res;
+
+  ssfs_pwrite(file_id, text, length, 0);
+  // The pieces of a view cover the range in order
+  res = ssfs_read_view(file_id, 100, 3 * BLOCK_SIZE, view);
+  int covered = 0;
+  for (int i = 0; i < view->iovcnt; i++) {
+    memcpy(&buf[covered], view->iov[i].iov_base, view->iov[i].iov_len);
+    covered += (int)view->iov[i].iov_len;
+  }
+  if (res != 3 * BLOCK_SIZE || covered != res ||
+      memcmp(buf, &text[100], (size_t)res) != 0) {
+    fprintf(stderr, "Error: ssfs_read_view returned %d\n", res);
+    *err_no += 1;
+  }
+  // Data written meanwhile does not change a view
+  ssfs_pwrite(file_id, "VIEW", 4, BLOCK_SIZE);
+  if (view->iovcnt != 4 ||
+      memcmp(view->iov[1].iov_base, &text[BLOCK_SIZE], 4) != 0) {
+    fprintf(stderr, "Error: a write changed the data of a view\n");
+    *err_no += 1;
+  }
+  ssfs_release_view(view);
+  // A view keeps its blocks after the cache is freed by an unmount
+  memcpy(&text[BLOCK_SIZE], "VIEW", 4);
+  ssfs_read_view(file_id, 0, length, view);
+  ssfs_fclose(file_id);
+  ssfs_unmount();
+  mkssfs(0);
+  file_id = ssfs_fopen("view.txt");
+  covered = 0;
+  for (int i = 0; i < view->iovcnt; i++) {
+    memcpy(&buf[covered], view->iov[i].iov_base, view->iov[i].iov_len);
+    covered += (int)view->iov[i].iov_len;
+  }
+  if (covered != length || memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: an unmount changed the data of a view\n");
+    *err_no += 1;
+  }
+  ssfs_release_view(view);
+  if (ssfs_read_view(file_id, length, 10, view) >= 0) {
+    fprintf(stderr, "Error: ssfs_read_view past the end succeeded\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(file_id);
+  ssfs_remove("view.txt");
+  free(view);
+  free(text);
+  free(buf);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+int test_fadvise(int *err_no) {
+  int length = 40 * BLOCK_SIZE;
+  char *text = rand_text(length);
+  char *buf = calloc((size_t)length + 1, sizeof(char));
+  int file_id = ssfs_fopen("fadvise.txt");
+  int res;
+
+  ssfs_pwrite(file_id, text, length, 0);
+  // A sequential reader gets the same data with read-ahead
+  res = ssfs_fadvise(file_id, 0, 0, SSFS_FADV_SEQUENTIAL);
+  ssfs_frseek(file_id, 0);
+  int done = 0;
+  for (int n = 1; done < length && n > 0; done += n) {
+    n = ssfs_fread(file_id, &buf[done], 300);
+  }
+  if (res != 0 || done != length || memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: sequential reads returned wrong data\n");
+    *err_no += 1;
+  }
+  // Prefetched and dropped ranges read back unchanged
+  memset(buf, 0, (size_t)length);
+  if (ssfs_fadvise(file_id, 0, length, SSFS_FADV_DONTNEED) != 0 ||
+      ssfs_fadvise(file_id, BLOCK_SIZE, 8 * BLOCK_SIZE,
+                   SSFS_FADV_WILLNEED | SSFS_FADV_NOREUSE) != 0 ||
+      ssfs_pread(file_id, buf, length, 0) != length ||
+      memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: ssfs_fadvise changed the data of the file\n");
+    *err_no += 1;
+  }
+  if (ssfs_fadvise(file_id, 0, 0,
+                   SSFS_FADV_SEQUENTIAL | SSFS_FADV_RANDOM) >= 0 ||
+      ssfs_fadvise(file_id, 0, 0, 0X100) >= 0 ||
+      ssfs_fadvise(file_id, -1, 0, SSFS_FADV_NORMAL) >= 0) {
+    fprintf(stderr, "Error: ssfs_fadvise accepted wrong advice\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(file_id);
+  if (ssfs_fadvise(file_id, 0, 0, SSFS_FADV_NORMAL) >= 0) {
+    fprintf(stderr, "Error: ssfs_fadvise on a closed file succeeded\n");
+    *err_no += 1;
+  }
+  ssfs_remove("fadvise.txt");
+  free(text);
+  free(buf);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+int test_cache_scan(int *err_no) {
+  int hot_length = 16 * BLOCK_SIZE;
+  int scan_length = 200 * BLOCK_SIZE;
+  char *text = rand_text(scan_length);
+  char *buf = calloc((size_t)scan_length + 1, sizeof(char));
+  ssfs_cache_stats_t stats;
+
+  mkssfs_ex(0, SSFS_MOUNT_CACHE(64));
+  ssfs_cache_stats(&stats);
+  if (stats.capacity != 64) {
+    fprintf(stderr, "Error: the cache holds %d blocks\n", stats.capacity);
+    *err_no += 1;
+  }
+  int hot_id = ssfs_fopen("hot.txt");
+  int scan_id = ssfs_fopen("scan.txt");
+  ssfs_pwrite(hot_id, text, hot_length, 0);
+  ssfs_pwrite(scan_id, text, scan_length, 0);
+  // Blocks read again are kept through a scan larger than the cache
+  for (int round = 0; round < 3; round++) {
+    for (int i = 0; i < 16; i++) {
+      ssfs_pread(hot_id, buf, 100, i * BLOCK_SIZE);
+    }
+  }
+  ssfs_frseek(scan_id, 0);
+  int done = 0;
+  for (int n = 1; n > 0 && done < scan_length; done += n) {
+    n = ssfs_fread(scan_id, &buf[done], 300);
+  }
+  ssfs_cache_stats(&stats);
+  uint64_t hits = stats.hits;
+  for (int i = 0; i < 16; i++) {
+    ssfs_pread(hot_id, buf, 100, i * BLOCK_SIZE);
+  }
+  ssfs_cache_stats(&stats);
+  if (done != scan_length || stats.hits - hits != 16 ||
+      stats.recent + stats.frequent > 64) {
+    fprintf(stderr, "Error: a scan evicted %d blocks read again\n",
+            16 - (int)(stats.hits - hits));
+    *err_no += 1;
+  }
+  if (ssfs_pread(hot_id, buf, hot_length, 0) != hot_length ||
+      memcmp(buf, text, (size_t)hot_length) != 0) {
+    fprintf(stderr, "Error: the cache returned wrong data\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(hot_id);
+  ssfs_fclose(scan_id);
+  ssfs_remove("hot.txt");
+  ssfs_remove("scan.txt");
+  mkssfs(0);
+  free(text);
+  free(buf);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+int test_warm_start(int *err_no) {
+  int length = 16 * BLOCK_SIZE;
+  char *text = rand_text(length);
+  char *buf = calloc((size_t)length + 1, sizeof(char));
+  ssfs_cache_stats_t stats;
+
+  int file_id = ssfs_fopen("warm.txt");
+  ssfs_pwrite(file_id, text, length, 0);
+  ssfs_pread(file_id, buf, length, 0);
+  ssfs_fclose(file_id);
+  if (ssfs_unmount() != 0 || ssfs_unmount() >= 0) {
+    fprintf(stderr, "Error: ssfs_unmount did not unmount once\n");
+    *err_no += 1;
+  }
+  // The blocks cached at the unmount are read again in the background
+  mkssfs(0);
+  for (int i = 0; i < 10000; i++) {
+    ssfs_cache_stats(&stats);
+    if (stats.recent + stats.frequent >= 16) {
+      break;
+    }
+    usleep(100);
+  }
+  file_id = ssfs_fopen("warm.txt");
+  int res = ssfs_pread(file_id, buf, length, 0);
+  ssfs_cache_stats(&stats);
+  if (res != length || memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: a warm cache returned wrong data\n");
+    *err_no += 1;
+  }
+  if (stats.misses != 0) {
+    fprintf(stderr, "Error: %d blocks were not read at mount\n",
+            (int)stats.misses);
+    *err_no += 1;
+  }
+  ssfs_fclose(file_id);
+  ssfs_remove("warm.txt");
+  free(text);
+  free(buf);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+int test_lazy_mount(int *err_no) {
+  int length = 4 * BLOCK_SIZE;
+  char *text = rand_text(length);
+  char *buf = calloc((size_t)length + 1, sizeof(char));
+  char name[16];
+
+  for (int i = 0; i < 40; i++) {
+    snprintf(name, sizeof(name), "lazy%d", i);
+    int file_id = ssfs_fopen(name);
+    ssfs_pwrite(file_id, text, length, 0);
+    ssfs_fclose(file_id);
+  }
+  // The tables are read while files are used right after the mount
+  for (int k = 0; k < 2; k++) {
+    mkssfs(0);
+    for (int i = 39; i >= 0; i--) {
+      snprintf(name, sizeof(name), "lazy%d", i);
+      int file_id = ssfs_fopen(name);
+      int res = ssfs_pread(file_id, buf, length, 0);
+      if (res != length || memcmp(buf, text, (size_t)length) != 0) {
+        fprintf(stderr, "Error: %s returned wrong data after a mount\n", name);
+        *err_no += 1;
+      }
+      ssfs_fclose(file_id);
+    }
+    int file_id = ssfs_fopen("lazy_new");
+    if (file_id < 0 || ssfs_pwrite(file_id, text, length, 0) != length) {
+      fprintf(stderr, "Error: a file could not be written after a mount\n");
+      *err_no += 1;
+    }
+    ssfs_fclose(file_id);
+  }
+  for (int i = 0; i < 40; i++) {
+    snprintf(name, sizeof(name), "lazy%d", i);
+    ssfs_remove(name);
+  }
+  ssfs_remove("lazy_new");
+  free(text);
+  free(buf);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+int test_clean_unmount(int *err_no) {
+  int length = 8 * BLOCK_SIZE;
+  char *text = rand_text(length);
+  ssfs_space_stats_t before;
+  ssfs_space_stats_t after;
+
+  ssfs_unmount();
+  mkssfs(0);
+  int file_id = ssfs_fopen("clean.txt");
+  ssfs_space_stats(&before);
+  ssfs_pwrite(file_id, text, length, 0);
+  ssfs_remove("clean.txt");
+  // The file removed while open is freed when the crash is recovered
+  mkssfs(0);
+  ssfs_space_stats(&after);
+  if (after.free_blocks != before.free_blocks ||
+      after.inodes - after.free_inodes !=
+          before.inodes - before.free_inodes - 1) {
+    fprintf(stderr, "Error: a crash left a removed file behind\n");
+    *err_no += 1;
+  }
+  // A clean unmount closes the file and the next mount trusts the counts
+  file_id = ssfs_fopen("clean.txt");
+  ssfs_space_stats(&before);
+  ssfs_pwrite(file_id, text, length, 0);
+  ssfs_remove("clean.txt");
+  if (ssfs_unmount() != 0) {
+    fprintf(stderr, "Error: ssfs_unmount failed\n");
+    *err_no += 1;
+  }
+  mkssfs(0);
+  ssfs_space_stats(&after);
+  if (after.free_blocks != before.free_blocks ||
+      after.free_inodes != before.free_inodes + 1) {
+    fprintf(stderr, "Error: a clean unmount did not free a removed file\n");
+    *err_no += 1;
+  }
+  // The saved counts match those taken after a crash
+  mkssfs(0);
+  ssfs_space_stats(&before);
+  if (after.free_blocks != before.free_blocks ||
+      after.free_inodes != before.free_inodes) {
+    fprintf(stderr, "Error: the free space saved at unmount is wrong\n");
+    *err_no += 1;
+  }
+  free(text);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
+int test_log_structured(int *err_no) {
+  int length = 8 * BLOCK_SIZE;
+  char *text = rand_text(length);
+  char *buf = calloc((size_t)length + 1, sizeof(char));
+
+  mkssfs_ex(0, SSFS_MOUNT_LOG);
+  int file_id = ssfs_fopen("log.txt");
+  ssfs_pwrite(file_id, text, length, 0);
+  // Small overwrites all over the file go to the log
+  for (int i = 0; i < 200; i++) {
+    int off = rand() % (length - 4);
+    memcpy(&text[off], "LOG!", 4);
+    ssfs_pwrite(file_id, "LOG!", 4, off);
+  }
+  int res = ssfs_pread(file_id, buf, length, 0);
+  if (res != length || memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: log-structured writes returned wrong data\n");
+    *err_no += 1;
+  }
+  // The log is on disk once the file system is opened again in place
+  mkssfs(0);
+  file_id = ssfs_fopen("log.txt");
+  res = ssfs_pread(file_id, buf, length, 0);
+  if (res != length || memcmp(buf, text, (size_t)length) != 0) {
+    fprintf(stderr, "Error: log-structured writes were not persisted\n");
+    *err_no += 1;
+  }
+  ssfs_fclose(file_id);
+  ssfs_remove("log.txt");
+  free(text);
+  free(buf);
+  printf("\n-------------------------------\nTest_num[%d]: Current Error "
+         "Num: %d\n--------------------------------\n\n",
+         test_num, *err_no);
+  test_num++;
+  return 0;
+}
+
 int free_name_element(char **name_list, int num_file) {
   for (int i = 0; i < num_file; i++)
     free(name_list[i]);
@@ -5,6 +5,7 @@
  * Written by Xiru Zhu for Assignment 3.
  */
 
+#include <pthread.h>
 #include <sfs_api.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -87,6 +88,26 @@ int test_overflow_open(int *file_id, int *file_sizes, int *write_ptr,
 // Test persistence
 int test_persistence(int *error, int write_length);
 
+// Extended API
+int test_positional_io(int *err_no);
+int test_concurrent_io(int *err_no);
+int test_commit_restore(int *err_no);
+int test_log_structured(int *err_no);
+int test_clone(int *err_no);
+int test_copy_range(int *err_no);
+int test_sparse(int *err_no);
+int test_fallocate_truncate(int *err_no);
+int test_inline(int *err_no);
+int test_put_get(int *err_no);
+int test_batch(int *err_no);
+int test_async(int *err_no);
+int test_read_view(int *err_no);
+int test_fadvise(int *err_no);
+int test_cache_scan(int *err_no);
+int test_warm_start(int *err_no);
+int test_lazy_mount(int *err_no);
+int test_clean_unmount(int *err_no);
+
 // Help functionn
 int free_name_element(char **name_list, int num_file);
 
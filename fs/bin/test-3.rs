@@ -0,0 +1,9 @@
+extern crate fs;
+
+include!(concat!(env!("OUT_DIR"), "/bindings.rs"));
+
+fn main() {
+    unsafe {
+        extended_test();
+    }
+}
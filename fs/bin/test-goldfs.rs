@@ -0,0 +1,11 @@
+extern crate fs;
+
+include!(concat!(env!("OUT_DIR"), "/bindings.rs"));
+
+fn main() {
+    unsafe {
+        if goldfs_test() != 0 {
+            std::process::exit(1);
+        }
+    }
+}
@@ -11,14 +11,28 @@ fn main() {
         .file("../fs-c/tests/tests.c")
         .file("../fs-c/tests/sfs_test1.c")
         .file("../fs-c/tests/sfs_test2.c")
+        .file("../fs-c/tests/sfs_test3.c")
         .compile("fs-c");
 
+    cc::Build::new()
+        .cpp(true)
+        .flag("-std=c++20")
+        .include("../fs-c/include")
+        .file("../fs-c/tests/goldfs_test.cpp")
+        .compile("fs-cpp");
+
+    println!("cargo:rerun-if-changed=../fs-c/include/goldfs.hpp");
+
     println!("cargo:rerun-if-changed=../fs-c/tests/sfs_test1.h");
     println!("cargo:rerun-if-changed=../fs-c/tests/sfs_test2.h");
+    println!("cargo:rerun-if-changed=../fs-c/tests/sfs_test3.h");
+    println!("cargo:rerun-if-changed=../fs-c/tests/goldfs_test.h");
 
     let bindings = bindgen::Builder::default()
         .header("../fs-c/tests/sfs_test1.h")
         .header("../fs-c/tests/sfs_test2.h")
+        .header("../fs-c/tests/sfs_test3.h")
+        .header("../fs-c/tests/goldfs_test.h")
         .parse_callbacks(Box::new(bindgen::CargoCallbacks))
         .generate()
         .expect("Unable to generate bindings");
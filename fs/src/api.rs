@@ -0,0 +1,333 @@
+use libc::{c_char, c_int};
+use std::ffi::CString;
+use std::io::{self, Read, Seek, SeekFrom, Write};
+use std::marker::PhantomData;
+use std::sync::atomic::{AtomicBool, Ordering};
+
+extern "C" {
+    fn mkssfs_ex(fresh: c_int, flags: c_int);
+    fn ssfs_unmount() -> c_int;
+    fn ssfs_fopen(name: *mut c_char) -> c_int;
+    fn ssfs_fclose(file_id: c_int) -> c_int;
+    fn ssfs_pwrite(file_id: c_int, buf: *const c_char, length: c_int, offset: c_int) -> c_int;
+    fn ssfs_pread(file_id: c_int, buf: *mut c_char, length: c_int, offset: c_int) -> c_int;
+    fn ssfs_fsize(file_id: c_int) -> c_int;
+    fn ssfs_remove(name: *mut c_char) -> c_int;
+}
+
+/// Log-structured writes, mirrors `SSFS_MOUNT_LOG`
+pub const MOUNT_LOG: i32 = 0x1;
+
+/// Caps the block cache to `blocks` blocks, mirrors `SSFS_MOUNT_CACHE`
+pub const fn mount_cache(blocks: i32) -> i32 {
+    blocks << 8
+}
+
+/// Maximum size of a file, mirrors `FILE_SIZE_MAX`
+pub const FILE_SIZE_MAX: u64 = 270 * 1024;
+
+// - The C side keeps a single file system per process
+static MOUNTED: AtomicBool = AtomicBool::new(false);
+
+fn check(r: c_int, what: &str) -> io::Result<usize> {
+    if r < 0 {
+        return Err(io::Error::new(io::ErrorKind::Other, what));
+    }
+
+    Ok(r as usize)
+}
+
+fn c_name(name: &str) -> io::Result<CString> {
+    CString::new(name).map_err(|_| io::Error::new(io::ErrorKind::InvalidInput, "name holds a NUL"))
+}
+
+/// Mounted file system. Only one can exist at a time, and the files opened
+/// through it borrow it so they cannot outlive the mount. The C side locks
+/// its own state, so the file system and its files are `Send` and `Sync`.
+/// Dropping the file system unmounts it.
+pub struct Filesystem {
+    _private: (),
+}
+
+impl Filesystem {
+    /// Mounts the file system, which is created anew when `fresh` is set.
+    /// `flags` takes the `MOUNT_*` options, combined with `mount_cache`.
+    pub fn mount(fresh: bool, flags: i32) -> io::Result<Filesystem> {
+        if MOUNTED
+            .compare_exchange(false, true, Ordering::AcqRel, Ordering::Acquire)
+            .is_err()
+        {
+            return Err(io::Error::new(
+                io::ErrorKind::AlreadyExists,
+                "already mounted",
+            ));
+        }
+
+        unsafe {
+            mkssfs_ex(fresh as c_int, flags);
+        }
+
+        Ok(Filesystem { _private: () })
+    }
+
+    /// Opens a file, which is created if needed.
+    pub fn open(&self, name: &str) -> io::Result<File<'_>> {
+        let name = c_name(name)?;
+        // - The name is only read
+        let fd = check(
+            unsafe { ssfs_fopen(name.as_ptr() as *mut c_char) },
+            "ssfs_fopen failed",
+        )?;
+
+        Ok(File {
+            fd: fd as c_int,
+            pos: 0,
+            _fs: PhantomData,
+        })
+    }
+
+    /// Removes a file. Files which are still open keep their data.
+    pub fn remove(&self, name: &str) -> io::Result<()> {
+        let name = c_name(name)?;
+        check(
+            unsafe { ssfs_remove(name.as_ptr() as *mut c_char) },
+            "ssfs_remove failed",
+        )?;
+
+        Ok(())
+    }
+}
+
+// - The files borrow the file system, so they are all closed by now
+impl Drop for Filesystem {
+    fn drop(&mut self) {
+        unsafe {
+            ssfs_unmount();
+        }
+        MOUNTED.store(false, Ordering::Release);
+    }
+}
+
+/// Open file. `read_at` and `write_at` are positional and take `&self`, so
+/// threads may share a file. `Read`, `Write` and `Seek` use a position kept
+/// by the object. The data moves straight between the slices of the caller
+/// and the C data path.
+pub struct File<'fs> {
+    fd: c_int,
+    pos: u64,
+    _fs: PhantomData<&'fs Filesystem>,
+}
+
+impl<'fs> File<'fs> {
+    /// Size of the file.
+    pub fn len(&self) -> io::Result<u64> {
+        Ok(check(unsafe { ssfs_fsize(self.fd) }, "ssfs_fsize failed")? as u64)
+    }
+
+    /// Reads data at a given position. It returns 0 at the end of the file.
+    pub fn read_at(&self, buf: &mut [u8], offset: u64) -> io::Result<usize> {
+        let size = self.len()?;
+        if buf.is_empty() || offset >= size {
+            return Ok(0);
+        }
+
+        // - Both fit in a C int as the size is at most FILE_SIZE_MAX
+        let len = (size - offset).min(buf.len() as u64) as c_int;
+        let r = unsafe {
+            ssfs_pread(
+                self.fd,
+                buf.as_mut_ptr() as *mut c_char,
+                len,
+                offset as c_int,
+            )
+        };
+
+        // - The file may have shrunk since its size was read, which is the
+        // end of the file rather than an error
+        if r < 0 && offset >= self.len()? {
+            return Ok(0);
+        }
+
+        check(r, "ssfs_pread failed")
+    }
+
+    /// Writes data at a given position. A position past the end of the file
+    /// leaves a hole. Data past `FILE_SIZE_MAX` is not written.
+    pub fn write_at(&self, buf: &[u8], offset: u64) -> io::Result<usize> {
+        if buf.is_empty() {
+            return Ok(0);
+        }
+
+        if offset >= FILE_SIZE_MAX {
+            return Err(io::Error::new(io::ErrorKind::Other, "file is full"));
+        }
+
+        let len = (FILE_SIZE_MAX - offset).min(buf.len() as u64) as c_int;
+        let r =
+            unsafe { ssfs_pwrite(self.fd, buf.as_ptr() as *const c_char, len, offset as c_int) };
+
+        check(r, "ssfs_pwrite failed")
+    }
+}
+
+impl<'fs> Read for File<'fs> {
+    fn read(&mut self, buf: &mut [u8]) -> io::Result<usize> {
+        let n = self.read_at(buf, self.pos)?;
+        self.pos += n as u64;
+
+        Ok(n)
+    }
+}
+
+impl<'fs> Write for File<'fs> {
+    fn write(&mut self, buf: &[u8]) -> io::Result<usize> {
+        let n = self.write_at(buf, self.pos)?;
+        self.pos += n as u64;
+
+        Ok(n)
+    }
+
+    // - Writes are in the journal once they return
+    fn flush(&mut self) -> io::Result<()> {
+        Ok(())
+    }
+}
+
+impl<'fs> Seek for File<'fs> {
+    fn seek(&mut self, pos: SeekFrom) -> io::Result<u64> {
+        let (base, delta) = match pos {
+            SeekFrom::Start(n) => (n, 0),
+            SeekFrom::End(n) => (self.len()?, n),
+            SeekFrom::Current(n) => (self.pos, n),
+        };
+
+        let pos = if delta < 0 {
+            base.checked_sub(delta.wrapping_neg() as u64)
+        } else {
+            base.checked_add(delta as u64)
+        };
+
+        match pos {
+            Some(n) => {
+                self.pos = n;
+                Ok(n)
+            }
+            None => Err(io::Error::new(io::ErrorKind::InvalidInput, "invalid seek")),
+        }
+    }
+}
+
+impl<'fs> Drop for File<'fs> {
+    fn drop(&mut self) {
+        unsafe {
+            ssfs_fclose(self.fd);
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use std::sync::{Mutex, MutexGuard};
+
+    // - The tests share the single file system of the process
+    static LOCK: Mutex<()> = Mutex::new(());
+
+    fn lock() -> MutexGuard<'static, ()> {
+        LOCK.lock().unwrap_or_else(|e| e.into_inner())
+    }
+
+    fn data(length: usize) -> Vec<u8> {
+        (0..length).map(|i| (i % 251) as u8).collect()
+    }
+
+    #[test]
+    fn second_mount_fails() {
+        let _l = lock();
+        let fs = Filesystem::mount(true, 0).unwrap();
+        let err = Filesystem::mount(true, 0).err().unwrap();
+        assert_eq!(err.kind(), io::ErrorKind::AlreadyExists);
+
+        drop(fs);
+        Filesystem::mount(true, 0).unwrap();
+    }
+
+    #[test]
+    fn read_write_seek() {
+        let _l = lock();
+        let fs = Filesystem::mount(true, 0).unwrap();
+        let mut f = fs.open("rws").unwrap();
+        let text = data(5000);
+
+        f.write_all(&text).unwrap();
+        assert_eq!(f.len().unwrap(), 5000);
+        assert_eq!(f.seek(SeekFrom::Start(0)).unwrap(), 0);
+        let mut out = Vec::new();
+        f.read_to_end(&mut out).unwrap();
+        assert_eq!(out, text);
+
+        let mut buf = [0u8; 20];
+        assert_eq!(f.seek(SeekFrom::End(-10)).unwrap(), 4990);
+        assert_eq!(f.read(&mut buf).unwrap(), 10);
+        assert_eq!(&buf[..10], &text[4990..]);
+        assert_eq!(f.read(&mut buf).unwrap(), 0);
+
+        assert_eq!(f.seek(SeekFrom::Current(-20)).unwrap(), 4980);
+        assert_eq!(f.seek(SeekFrom::End(10)).unwrap(), 5010);
+        assert!(f.seek(SeekFrom::End(-5001)).is_err());
+        assert!(f.seek(SeekFrom::Current(-10000)).is_err());
+        assert_eq!(f.seek(SeekFrom::Current(0)).unwrap(), 5010);
+
+        // - Writing past the end leaves a hole of zeros
+        f.write_all(&[1, 2, 3]).unwrap();
+        assert_eq!(f.len().unwrap(), 5013);
+        f.seek(SeekFrom::Start(5000)).unwrap();
+        let mut tail = Vec::new();
+        f.read_to_end(&mut tail).unwrap();
+        assert_eq!(tail, [0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 3]);
+    }
+
+    #[test]
+    fn positional() {
+        let _l = lock();
+        let fs = Filesystem::mount(true, MOUNT_LOG).unwrap();
+        let f = fs.open("pos").unwrap();
+        let text = data(3000);
+
+        assert_eq!(f.write_at(&text, 1000).unwrap(), 3000);
+        assert_eq!(f.write_at(&[], 0).unwrap(), 0);
+        let mut buf = vec![0u8; 4000];
+        assert_eq!(f.read_at(&mut buf, 1000).unwrap(), 3000);
+        assert_eq!(&buf[..3000], &text[..]);
+        assert_eq!(f.read_at(&mut buf, 4000).unwrap(), 0);
+        assert_eq!(f.read_at(&mut buf, 100000).unwrap(), 0);
+        assert_eq!(f.read_at(&mut [], 0).unwrap(), 0);
+
+        // - Files are shared between threads
+        std::thread::scope(|s| {
+            for t in 0..4u8 {
+                let f = &f;
+                s.spawn(move || {
+                    let piece = [t + 1; 100];
+                    assert_eq!(f.write_at(&piece, 100 * t as u64).unwrap(), 100);
+                });
+            }
+        });
+        assert_eq!(f.read_at(&mut buf[..400], 0).unwrap(), 400);
+        assert!(buf[..400]
+            .iter()
+            .enumerate()
+            .all(|(i, &v)| v == (i / 100) as u8 + 1));
+
+        // - The file is full at FILE_SIZE_MAX
+        let big = vec![7u8; FILE_SIZE_MAX as usize + 10];
+        assert_eq!(f.write_at(&big, 0).unwrap(), FILE_SIZE_MAX as usize);
+        assert!(f.write_at(&big, FILE_SIZE_MAX).is_err());
+        assert_eq!(f.len().unwrap(), FILE_SIZE_MAX);
+
+        assert!(fs.open("bad\0name").is_err());
+        drop(f);
+        fs.remove("pos").unwrap();
+        assert!(fs.remove("pos").is_err());
+    }
+}
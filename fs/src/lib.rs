@@ -1 +1,4 @@
+mod api;
 mod demu;
+
+pub use api::{mount_cache, File, Filesystem, FILE_SIZE_MAX, MOUNT_LOG};